@@ -0,0 +1,309 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Binary bytecode (.bfb) writer and loader */
+
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+#include "bfbin.h"
+
+uint32_t bfbin_checksum(const uint8_t *data, size_t length, uint32_t hash){
+    /* 32-bit FNV-1a. Pass 2166136261 to start a new hash, or a previous
+     * result to continue one. */
+    for(size_t i = 0; i < length; i++){
+        hash ^= data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static size_t bfbin_at_size(const bfop_t *op){
+    /* Size of an op that may carry a cell offset, less any argument: the
+     * plain opcode, the _AT form with an 8-bit offset, or the plain opcode
+     * wrapped in a pair of 32-bit moves out to the cell and back. */
+    if(op->off == 0){
+        return 1;
+    }
+    return (op->off >= INT8_MIN && op->off <= INT8_MAX) ? 2 : 11;
+}
+
+static uint8_t *bfbin_move32(uint8_t *pc, int32_t delta){
+    *pc++ = BFBIN_MOVE32;
+    memcpy(pc, &delta, sizeof(int32_t));
+    return pc + sizeof(int32_t);
+}
+
+static size_t bfbin_op_size(const bfop_t *op, int32_t wide_branches){
+    /* Encoded size in bytes of an IR op. Labels take no space. */
+    int32_t delta;
+    switch(op->opcode){
+        case INC:
+        case DEC:
+            return 2;
+        case INCV:
+        case DECV:
+            delta = op->opcode == INCV ? op->arg : -(op->arg);
+            return (delta >= INT8_MIN && delta <= INT8_MAX) ? 2 : 5;
+        case ADD:
+        case ADDV:
+        case SUB:
+        case SUBV:
+            return 1 + bfbin_at_size(op);
+        case ZERO:
+        case PUT:
+        case GET:
+            return bfbin_at_size(op);
+        case JZ:
+        case JNZ:
+            return wide_branches ? 5 : 3;
+        case MUL:
+            return (op->off >= INT8_MIN && op->off <= INT8_MAX) ? 3 : 6;
+        case SCAN:
+            return (op->arg >= INT8_MIN && op->arg <= INT8_MAX) ? 2 : 5;
+        case LABEL:
+            return 0;
+    }
+    return 1;
+}
+
+void bfbin_write(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename){
+    /* Generate packed binary bytecode to output. Like .bc there is no
+     * initial data, so the prefix must already be back in the code, and
+     * output and the tape are up to whoever runs it, so flush doesn't apply
+     * and the origin is bfi's to pick. */
+    if(prefix->cells || prefix->out_length){
+        CriticalError("Binary bytecode can't start from a baked prefix");
+    }
+    if(ir->data_length){
+        CriticalError("Binary bytecode has no constant writes");
+    }
+    if(origin){
+        CriticalError("Binary bytecode takes its origin from bfi -o");
+    }
+    int32_t max_label = -1;
+    uint32_t branch_count = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        if(op->opcode == LABEL && op->arg > max_label){
+            max_label = op->arg;
+        }else if(op->opcode == JZ || op->opcode == JNZ){
+            branch_count++;
+        }
+    }
+    int32_t wide = branch_count > UINT16_MAX;
+
+    /* Lay out the code once to find where every label lands */
+    int32_t *label_offs = malloc((max_label + 1) * sizeof(int32_t));
+    if(!label_offs){
+        CriticalError("Failed to allocate memory");
+    }
+    size_t code_size = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        if(op->opcode == LABEL){
+            label_offs[op->arg] = code_size;
+        }
+        code_size += bfbin_op_size(op, wide);
+    }
+    code_size++;    /* BFBIN_HALT */
+
+    int32_t *branches = malloc((branch_count + 1) * sizeof(int32_t));
+    uint8_t *code = malloc(code_size);
+    if(!branches || !code){
+        CriticalError("Failed to allocate memory");
+    }
+
+    uint8_t *pc = code;
+    uint32_t branch = 0;
+    int32_t delta, far;
+    uint8_t opcode;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        switch(op->opcode){
+            case INC:
+            case DEC:
+                *pc++ = BFBIN_MOVE8;
+                *pc++ = (uint8_t)(op->opcode == INC ? 1 : -1);
+                break;
+            case INCV:
+            case DECV:
+                delta = op->opcode == INCV ? op->arg : -(op->arg);
+                if(delta >= INT8_MIN && delta <= INT8_MAX){
+                    *pc++ = BFBIN_MOVE8;
+                    *pc++ = (uint8_t)delta;
+                }else{
+                    *pc++ = BFBIN_MOVE32;
+                    memcpy(pc, &delta, sizeof(int32_t));
+                    pc += sizeof(int32_t);
+                }
+                break;
+            case ADD:
+            case ADDV:
+            case SUB:
+            case SUBV:
+            case ZERO:
+            case PUT:
+            case GET:
+                far = bfbin_at_size(op) > 2;
+                if(far){
+                    pc = bfbin_move32(pc, op->off);
+                }
+                switch(op->opcode){
+                    case ZERO:opcode = BFBIN_ZERO;break;
+                    case PUT:opcode = BFBIN_PUT;break;
+                    case GET:opcode = BFBIN_GET;break;
+                    default:opcode = BFBIN_ADD;break;
+                }
+                if(op->off && !far){
+                    *pc++ = opcode + BFBIN_AT;
+                    *pc++ = (uint8_t)op->off;
+                }else{
+                    *pc++ = opcode;
+                }
+                switch(op->opcode){
+                    case ADD:*pc++ = 1;break;
+                    case ADDV:*pc++ = (uint8_t)op->arg;break;
+                    case SUB:*pc++ = (uint8_t)-1;break;
+                    case SUBV:*pc++ = (uint8_t)-(op->arg);break;
+                }
+                if(far){
+                    pc = bfbin_move32(pc, -(op->off));
+                }
+                break;
+            case MUL:
+                if(op->off >= INT8_MIN && op->off <= INT8_MAX){
+                    *pc++ = BFBIN_MUL8;
+                    *pc++ = (uint8_t)op->off;
+                }else{
+                    *pc++ = BFBIN_MUL32;
+                    memcpy(pc, &op->off, sizeof(int32_t));
+                    pc += sizeof(int32_t);
+                }
+                *pc++ = (uint8_t)op->arg;
+                break;
+            case SCAN:
+                if(op->arg >= INT8_MIN && op->arg <= INT8_MAX){
+                    *pc++ = BFBIN_SCAN8;
+                    *pc++ = (uint8_t)op->arg;
+                }else{
+                    *pc++ = BFBIN_SCAN32;
+                    memcpy(pc, &op->arg, sizeof(int32_t));
+                    pc += sizeof(int32_t);
+                }
+                break;
+            case JZ:
+            case JNZ:
+                if(op->arg < 0 || op->arg > max_label){
+                    CriticalError("Branch to undefined label");
+                }
+                branches[branch] = label_offs[op->arg];
+                if(wide){
+                    *pc++ = op->opcode == JZ ? BFBIN_JZ32 : BFBIN_JNZ32;
+                    memcpy(pc, &branch, sizeof(uint32_t));
+                    pc += sizeof(uint32_t);
+                }else{
+                    uint16_t idx = (uint16_t)branch;
+                    *pc++ = op->opcode == JZ ? BFBIN_JZ16 : BFBIN_JNZ16;
+                    memcpy(pc, &idx, sizeof(uint16_t));
+                    pc += sizeof(uint16_t);
+                }
+                branch++;
+                break;
+        }
+    }
+    *pc++ = BFBIN_HALT;
+
+    bfbin_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BFBIN_MAGIC, 4);
+    header.version = BFBIN_VERSION;
+    header.code_size = code_size;
+    header.branch_count = branch_count;
+    header.checksum = bfbin_checksum((uint8_t *)branches,
+                        branch_count * sizeof(int32_t), 2166136261u);
+    header.checksum = bfbin_checksum(code, code_size, header.checksum);
+
+    fwrite(&header, sizeof(header), 1, output);
+    fwrite(branches, sizeof(int32_t), branch_count, output);
+    fwrite(code, 1, code_size, output);
+
+    free(code);
+    free(branches);
+    free(label_offs);
+}
+
+int32_t bfbin_map(const char *filename, bfbin_image_t *image){
+    /* Maps a .bfb file read-only and points image into it. Returns 0 on
+     * success; on failure prints the reason and returns 1. Nothing is decoded
+     * here, only the header and the checksum are verified. */
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "Could not open file: %s\n", filename);
+        return 1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(bfbin_header_t)){
+        fprintf(stderr, "%s: not a bfcc binary\n", filename);
+        close(fd);
+        return 1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        fprintf(stderr, "%s: mmap failed\n", filename);
+        return 1;
+    }
+
+    const bfbin_header_t *header = (const bfbin_header_t *)map;
+    size_t expected = sizeof(bfbin_header_t)
+                        + (size_t)header->branch_count * sizeof(int32_t)
+                        + header->code_size;
+    const char *err = NULL;
+    if(memcmp(header->magic, BFBIN_MAGIC, 4)){
+        err = "not a bfcc binary";
+    }else if(header->version == 0 || header->version > BFBIN_VERSION){
+        err = "unsupported version";
+    }else if(expected != (size_t)st.st_size || header->code_size == 0){
+        err = "truncated";
+    }
+
+    if(!err){
+        image->header = header;
+        image->branches = (const int32_t *)(header + 1);
+        image->code = (const uint8_t *)(image->branches + header->branch_count);
+        image->map = map;
+        image->map_size = st.st_size;
+
+        uint32_t sum = bfbin_checksum((const uint8_t *)image->branches,
+                            header->branch_count * sizeof(int32_t), 2166136261u);
+        sum = bfbin_checksum(image->code, header->code_size, sum);
+        if(sum != header->checksum){
+            err = "bad checksum";
+        }else if(image->code[header->code_size - 1] != BFBIN_HALT){
+            err = "missing halt";
+        }
+        for(uint32_t i = 0; !err && i < header->branch_count; i++){
+            if(image->branches[i] < 0
+                    || (uint32_t)image->branches[i] >= header->code_size){
+                err = "branch out of range";
+            }
+        }
+    }
+
+    if(err){
+        fprintf(stderr, "%s: %s\n", filename, err);
+        munmap(map, st.st_size);
+        return 1;
+    }
+    return 0;
+}
+
+void bfbin_unmap(bfbin_image_t *image){
+    munmap(image->map, image->map_size);
+    image->map = NULL;
+    image->map_size = 0;
+}
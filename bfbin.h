@@ -0,0 +1,85 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Binary bytecode (.bfb) definitions */
+
+#ifndef BFBIN_H
+#define BFBIN_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include "error_handling.h"
+#include "bfop.h"
+#include "bfir.h"
+#include "bfeval.h"
+
+/* File layout (all fields little-endian):
+ *
+ *   bfbin_header_t
+ *   int32_t branches[branch_count]   byte offsets into code
+ *   uint8_t code[code_size]          packed ops, ends with BFBIN_HALT
+ *
+ * Every op is a one byte opcode followed by its argument, if any. Branch ops
+ * carry an index into the branch table rather than an offset, so the table
+ * is the only thing that needs to know where code lands. The checksum is
+ * 32-bit FNV-1a over the branch table and the code. */
+#define BFBIN_MAGIC "BFBC"
+#define BFBIN_VERSION 4     /* older images are a subset and still load */
+
+/* Packed opcodes */
+#define BFBIN_HALT 0
+#define BFBIN_MOVE8 1       /* int8_t pointer delta */
+#define BFBIN_MOVE32 2      /* int32_t pointer delta */
+#define BFBIN_ADD 3         /* uint8_t addend */
+#define BFBIN_ZERO 4
+#define BFBIN_PUT 5
+#define BFBIN_GET 6
+#define BFBIN_JZ16 7        /* uint16_t branch index */
+#define BFBIN_JZ32 8        /* uint32_t branch index */
+#define BFBIN_JNZ16 9
+#define BFBIN_JNZ32 10
+#define BFBIN_MUL8 11       /* int8_t cell offset, uint8_t factor */
+#define BFBIN_MUL32 12      /* int32_t cell offset, uint8_t factor */
+#define BFBIN_SCAN8 17      /* int8_t stride */
+#define BFBIN_SCAN32 18     /* int32_t stride */
+
+/* ADD, ZERO, PUT and GET on the cell an int8_t offset away, which comes
+ * right after the opcode. Offsets that don't fit are moved out to and back
+ * with MOVE32 instead. */
+#define BFBIN_AT 10
+#define BFBIN_ADD_AT (BFBIN_ADD + BFBIN_AT)
+#define BFBIN_ZERO_AT (BFBIN_ZERO + BFBIN_AT)
+#define BFBIN_PUT_AT (BFBIN_PUT + BFBIN_AT)
+#define BFBIN_GET_AT (BFBIN_GET + BFBIN_AT)
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t code_size;
+    uint32_t branch_count;
+    uint32_t checksum;
+    uint32_t reserved;
+} bfbin_header_t;
+
+/* A loaded image. All pointers point into the mapping. */
+typedef struct {
+    const bfbin_header_t *header;
+    const int32_t *branches;
+    const uint8_t *code;
+    void *map;
+    size_t map_size;
+} bfbin_image_t;
+
+uint32_t bfbin_checksum(const uint8_t *data, size_t length, uint32_t hash);
+
+void bfbin_write(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename);
+
+int32_t bfbin_map(const char *filename, bfbin_image_t *image);
+
+void bfbin_unmap(bfbin_image_t *image);
+
+#endif
@@ -3,70 +3,32 @@
 
 #include "bfcc.h"
 
-list_t *bfcc_parse(char *program, list_t *parse_lst){
-    /*Produces the initial parse list for the program. Does not allocate
-     * memory for a new list because it may be used recursively. */
-    char input;
-    intptr_t label_ct = 0;
-    list_t loop_stack;
-    list_init(&loop_stack);
-
-    while((input = *program++) != EOF){
-        switch(input){
-            case '>':
-                list_addlast(parse_lst, bfop_new(INC, 0));
-                break;
-            case '<':
-                list_addlast(parse_lst, bfop_new(DEC, 0));
-                break;
-            case '+':
-                list_addlast(parse_lst, bfop_new(ADD, 0));
-                break;
-            case '-':
-                list_addlast(parse_lst, bfop_new(SUB, 0));
-                break;
-            case '.':
-                list_addlast(parse_lst, bfop_new(PUT, 0));
-                break;
-            case ',':
-                list_addlast(parse_lst, bfop_new(GET, 0));
-                break;
-            case '[':
-                //First add the jz and the label for the top of the loop
-                list_addlast(parse_lst, bfop_new(JZ, label_ct + 1));
-                list_addlast(parse_lst, bfop_new(LABEL, label_ct));
-                
-                /*Now push the label numbers onto the stack. DO NOT use the
-                 * label counts as actual pointers */
-                list_addfirst(&loop_stack, (void *)(label_ct + 1));
-                list_addfirst(&loop_stack, (void *)label_ct);
-
-                label_ct += 2;
-                break;
-            case ']':
-                //Try to pop from the stack. If it's empty, you dun goofed
-                if(loop_stack.length <= 1){
-                    fprintf(stderr, "Error: mismatched []\n");
-                    exit(1);
-                }
-
-                intptr_t top_label = (intptr_t)list_remove(loop_stack.head->next);
-                intptr_t bot_label = (intptr_t)list_remove(loop_stack.head->next);
-
-                list_addlast(parse_lst, bfop_new(JNZ, top_label));
-                list_addlast(parse_lst, bfop_new(LABEL, bot_label));
-                break;
-        }
+static const char bfcc_bounds_msg[] = "Program failed due to errors: ERR_BOUNDS\n";
+static const char bfcc_mem_msg[] = "Program failed due to errors: ERR_MEM\n";
+
+void bfcc_codegen(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename){
+    /* Generate portable brainfuck bytecode to output. Bytecode has no initial
+     * data, so the prefix must already have been put back into the code.
+     * bfi does its own output, so flush doesn't apply, and sets up the tape,
+     * so the origin is its to pick. */
+    if(prefix->cells || prefix->out_length){
+        CriticalError("Bytecode can't start from a baked prefix");
     }
-
-    return parse_lst;
-}
-
-void bfcc_codegen(FILE *output, list_t *parse_lst, char *filename){
-    //Generate portable brainfuck bytecode to output.
-    node_t *node = parse_lst->head->next;
-    while(node != parse_lst->head){
-        bfop_t *op = node->data;
+    if(ir->data_length){
+        CriticalError("Bytecode has no constant writes");
+    }
+    if(origin){
+        CriticalError("Bytecode takes its origin from bfi -o");
+    }
+    char at[16];
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        /* Ops folded into a deferred move carry their cell offset as @k */
+        at[0] = '\0';
+        if(op->off && op->opcode != MUL){
+            snprintf(at, sizeof(at), " @%d", op->off);
+        }
         switch(op->opcode){
             case INC:
                 fprintf(output, "%s\n", "inc");
@@ -81,22 +43,22 @@ void bfcc_codegen(FILE *output, list_t *parse_lst, char *filename){
                 fprintf(output, "%s %d\n", "decv", op->arg);
                 break;
             case ADD:
-                fprintf(output, "%s\n", "add");
+                fprintf(output, "%s%s\n", "add", at);
                 break;
             case ADDV:
-                fprintf(output, "%s %d\n", "addv", op->arg);
+                fprintf(output, "%s %d%s\n", "addv", op->arg, at);
                 break;
             case SUB:
-                fprintf(output, "%s\n", "sub");
+                fprintf(output, "%s%s\n", "sub", at);
                 break;
             case SUBV:
-                fprintf(output, "%s %d\n", "subv", op->arg);
+                fprintf(output, "%s %d%s\n", "subv", op->arg, at);
                 break;
             case PUT:
-                fprintf(output, "%s\n", "put");
+                fprintf(output, "%s%s\n", "put", at);
                 break;
             case GET:
-                fprintf(output, "%s\n", "get");
+                fprintf(output, "%s%s\n", "get", at);
                 break;
             case LABEL:
                 fprintf(output, "L%d:\n", op->arg);
@@ -108,49 +70,739 @@ void bfcc_codegen(FILE *output, list_t *parse_lst, char *filename){
                 fprintf(output, "%s L%d\n", "jz", op->arg);
                 break;
             case ZERO:
-                fprintf(output, "%s\n", "zero");
+                fprintf(output, "%s%s\n", "zero", at);
+                break;
+            case MUL:
+                fprintf(output, "%s %d %d\n", "mul", op->arg, op->off);
+                break;
+            case SCAN:
+                fprintf(output, "%s %d\n", "scan", op->arg);
                 break;
         }
-        node = node->next;
     }
 }
 
-int32_t gen32_find_bestp(int32_t curr, int32_t diff, int32_t *ptrs, int32_t *refresh){
-    /* Given a set of pointer locations and valid flags, return the best 
-     * value to put the next pointer. Hash into a location that's already
-     * loaded if possible, else take the first invalid slot. If that fails,
-     * overwrite the next location.
-     *
-     * Assumptions: Arrays are of length 3.
-     *              Pointer locations are relative to the zeroth entry.
-     * Sets the ptrs and refresh values to the desired result, and returns
-     * the new curr pointer. */
-    
-    /* Best possibility: We already have the pointer we needed */
-    curr = curr % 3;
-    int32_t srch = ptrs[curr] + diff;
-    for(int32_t i = 0; i < 3; i++){
-        if(ptrs[i] == srch && (!refresh[i])){
+static void bfcc_emit_bytes(FILE *output, const char *label, const uint8_t *bytes, size_t length){
+    fprintf(output, "%s:\n", label);
+    for(size_t i = 0; i < length; i++){
+        fprintf(output, i % 16 ? ",%u" : "\t .byte\t%u", bytes[i]);
+        if(i % 16 == 15 || i + 1 == length){
+            fputc('\n', output);
+        }
+    }
+}
+
+void bfcc_emit_prefix(FILE *output, const bfeval_t *prefix){
+    /* Read-only data for main: bf_tape, copied over the start of the tape,
+     * and bf_text, written out before bf_prog runs. */
+    if(!prefix->cells && !prefix->out_length){
+        return;
+    }
+    fprintf(output, "\t .section\t.rodata\n");
+    if(prefix->cells){
+        bfcc_emit_bytes(output, "bf_tape", prefix->tape, prefix->cells);
+    }
+    if(prefix->out_length){
+        bfcc_emit_bytes(output, "bf_text", prefix->out, prefix->out_length);
+    }
+}
+
+void bfcc_emit_consts(FILE *output, const bfir_t *ir){
+    //Read-only data for WRITE_CONST: ir's data pool as bf_const.
+    if(!ir->data_length){
+        return;
+    }
+    fprintf(output, "\t .section\t.rodata\n");
+    bfcc_emit_bytes(output, "bf_const", ir->data, ir->data_length);
+}
+
+void bfcc_emit_runtime32(FILE *output, int32_t flush){
+    /* The I/O runtime for gen32's programs. Output is collected in bf_outbuf
+     * and written when it fills, at exit, and as flush asks; input is read
+     * a buffer at a time. bf_put takes its byte in ebp, bf_get the address
+     * of the cell to store into, and bf_write the usual stack arguments.
+     * All of them keep every register but ebp, so cached cells stay put. */
+    fprintf(output, "\t .type\tbf_flush, @function\nbf_flush:\n");
+    fprintf(output, "\t pushal\n");
+    fprintf(output, "\t movl\t%%esp, %%ebp\n");
+    fprintf(output, "\t andl\t$-16, %%esp\n");
+    fprintf(output, "\t subl\t$16, %%esp\n");
+    fprintf(output, "\t movl\t$bf_outbuf, %%esi\n");
+    fprintf(output, "\t movl\tbf_outlen, %%edi\n");
+    fprintf(output, ".Rflush:\n");
+    fprintf(output, "\t testl\t%%edi, %%edi\n");
+    fprintf(output, "\t jle\t.Rflushed\n");
+    fprintf(output, "\t movl\t$1, (%%esp)\n");
+    fprintf(output, "\t movl\t%%esi, 4(%%esp)\n");
+    fprintf(output, "\t movl\t%%edi, 8(%%esp)\n");
+    fprintf(output, "\t call\twrite\n");
+    fprintf(output, "\t testl\t%%eax, %%eax\n");
+    fprintf(output, "\t jle\t.Rflushed\n");
+    fprintf(output, "\t addl\t%%eax, %%esi\n");
+    fprintf(output, "\t subl\t%%eax, %%edi\n");
+    fprintf(output, "\t jmp\t.Rflush\n");
+    fprintf(output, ".Rflushed:\n");
+    fprintf(output, "\t movl\t$0, bf_outlen\n");
+    fprintf(output, "\t movl\t%%ebp, %%esp\n");
+    fprintf(output, "\t popal\n");
+    fprintf(output, "\t ret\n\t .size\tbf_flush, .-bf_flush\n");
+
+    fprintf(output, "\t .type\tbf_put, @function\nbf_put:\n");
+    fprintf(output, "\t pushl\t%%eax\n");
+    fprintf(output, "\t pushl\t%%ecx\n");
+    fprintf(output, "\t movl\t%%ebp, %%eax\n");
+    fprintf(output, "\t movl\tbf_outlen, %%ecx\n");
+    fprintf(output, "\t movb\t%%al, bf_outbuf(%%ecx)\n");
+    fprintf(output, "\t incl\t%%ecx\n");
+    fprintf(output, "\t movl\t%%ecx, bf_outlen\n");
+    fprintf(output, "\t cmpl\t$%d, %%ecx\n", BFCC_OUTBUF_SIZE);
+    fprintf(output, "\t jae\t.Rput_full\n");
+    if(flush == BFCC_FLUSH_NEWLINE){
+        fprintf(output, "\t cmpb\t$10, %%al\n");
+        fprintf(output, "\t je\t.Rput_full\n");
+    }
+    fprintf(output, "\t popl\t%%ecx\n");
+    fprintf(output, "\t popl\t%%eax\n");
+    fprintf(output, "\t ret\n");
+    fprintf(output, ".Rput_full:\n");
+    fprintf(output, "\t call\tbf_flush\n");
+    fprintf(output, "\t popl\t%%ecx\n");
+    fprintf(output, "\t popl\t%%eax\n");
+    fprintf(output, "\t ret\n\t .size\tbf_put, .-bf_put\n");
+
+    /* Text is copied in as much at a time as the buffer has room for, or
+     * up to the next newline if those flush */
+    fprintf(output, "\t .type\tbf_write, @function\nbf_write:\n");
+    fprintf(output, "\t pushal\n");
+    fprintf(output, "\t movl\t36(%%esp), %%esi\n");
+    fprintf(output, "\t movl\t40(%%esp), %%ebx\n");
+    fprintf(output, ".Rwrite:\n");
+    fprintf(output, "\t testl\t%%ebx, %%ebx\n");
+    fprintf(output, "\t jz\t.Rwritten\n");
+    fprintf(output, "\t movl\t$%d, %%ecx\n", BFCC_OUTBUF_SIZE);
+    fprintf(output, "\t subl\tbf_outlen, %%ecx\n");
+    fprintf(output, "\t cmpl\t%%ebx, %%ecx\n");
+    fprintf(output, "\t jbe\t.Rwrite_room\n");
+    fprintf(output, "\t movl\t%%ebx, %%ecx\n");
+    fprintf(output, ".Rwrite_room:\n");
+    if(flush == BFCC_FLUSH_NEWLINE){
+        fprintf(output, "\t movl\t%%esi, %%edi\n");
+        fprintf(output, "\t movl\t%%ecx, %%edx\n");
+        fprintf(output, "\t movl\t$10, %%eax\n");
+        fprintf(output, "\t repne scasb\n");
+        fprintf(output, "\t jne\t.Rwrite_line\n");
+        fprintf(output, "\t subl\t%%ecx, %%edx\n");
+        fprintf(output, ".Rwrite_line:\n");
+        fprintf(output, "\t movl\t%%edx, %%ecx\n");
+    }
+    fprintf(output, "\t subl\t%%ecx, %%ebx\n");
+    fprintf(output, "\t movl\tbf_outlen, %%edi\n");
+    fprintf(output, "\t addl\t%%ecx, bf_outlen\n");
+    fprintf(output, "\t addl\t$bf_outbuf, %%edi\n");
+    fprintf(output, "\t rep movsb\n");
+    fprintf(output, "\t cmpl\t$%d, bf_outlen\n", BFCC_OUTBUF_SIZE);
+    fprintf(output, "\t jae\t.Rwrite_full\n");
+    if(flush == BFCC_FLUSH_NEWLINE){
+        fprintf(output, "\t cmpb\t$10, -1(%%esi)\n");
+        fprintf(output, "\t je\t.Rwrite_full\n");
+    }
+    fprintf(output, "\t jmp\t.Rwrite\n");
+    fprintf(output, ".Rwrite_full:\n");
+    fprintf(output, "\t call\tbf_flush\n");
+    fprintf(output, "\t jmp\t.Rwrite\n");
+    fprintf(output, ".Rwritten:\n");
+    fprintf(output, "\t popal\n");
+    fprintf(output, "\t ret\n\t .size\tbf_write, .-bf_write\n");
+
+    /* End of input stores -1, as fgetc would */
+    fprintf(output, "\t .type\tbf_get, @function\nbf_get:\n");
+    fprintf(output, "\t pushl\t%%eax\n");
+    fprintf(output, "\t pushl\t%%ecx\n");
+    fprintf(output, "\t movl\tbf_inpos, %%ecx\n");
+    fprintf(output, "\t cmpl\tbf_inlen, %%ecx\n");
+    fprintf(output, "\t jb\t.Rget_have\n");
+    if(flush != BFCC_FLUSH_EXIT){
+        fprintf(output, "\t call\tbf_flush\n");
+    }
+    fprintf(output, "\t pushal\n");
+    fprintf(output, "\t movl\t%%esp, %%ebp\n");
+    fprintf(output, "\t andl\t$-16, %%esp\n");
+    fprintf(output, "\t subl\t$16, %%esp\n");
+    fprintf(output, "\t movl\t$0, (%%esp)\n");
+    fprintf(output, "\t movl\t$bf_inbuf, 4(%%esp)\n");
+    fprintf(output, "\t movl\t$%d, 8(%%esp)\n", BFCC_INBUF_SIZE);
+    fprintf(output, "\t call\tread\n");
+    fprintf(output, "\t movl\t%%ebp, %%esp\n");
+    fprintf(output, "\t testl\t%%eax, %%eax\n");
+    fprintf(output, "\t jg\t.Rget_fill\n");
+    fprintf(output, "\t xorl\t%%eax, %%eax\n");
+    fprintf(output, ".Rget_fill:\n");
+    fprintf(output, "\t movl\t%%eax, bf_inlen\n");
+    fprintf(output, "\t movl\t$0, bf_inpos\n");
+    fprintf(output, "\t popal\n");
+    fprintf(output, "\t xorl\t%%ecx, %%ecx\n");
+    fprintf(output, "\t cmpl\tbf_inlen, %%ecx\n");
+    fprintf(output, "\t jb\t.Rget_have\n");
+    fprintf(output, "\t movb\t$-1, (%%ebp)\n");
+    fprintf(output, "\t jmp\t.Rget_done\n");
+    fprintf(output, ".Rget_have:\n");
+    fprintf(output, "\t movb\tbf_inbuf(%%ecx), %%al\n");
+    fprintf(output, "\t movb\t%%al, (%%ebp)\n");
+    fprintf(output, "\t incl\t%%ecx\n");
+    fprintf(output, "\t movl\t%%ecx, bf_inpos\n");
+    fprintf(output, ".Rget_done:\n");
+    fprintf(output, "\t popl\t%%ecx\n");
+    fprintf(output, "\t popl\t%%eax\n");
+    fprintf(output, "\t ret\n\t .size\tbf_get, .-bf_get\n");
+
+    /* bf_tape_map returns the first cell of a guarded tape, or 0 if it
+     * can't be had, and keeps the whole mapping's start in bf_tape_at. */
+    fprintf(output, "\t .type\tbf_tape_map, @function\nbf_tape_map:\n");
+    fprintf(output, "\t pushl\t%%ebx\n");
+    fprintf(output, "\t subl\t$24, %%esp\n");
+    fprintf(output, "\t movl\t$0, (%%esp)\n");
+    fprintf(output, "\t movl\t$%d, 4(%%esp)\n", BFCC_GUARD32 + BFCC_TAPE_SIZE32 + BFCC_GUARD32);
+    fprintf(output, "\t movl\t$%d, 8(%%esp)\n", PROT_NONE);
+    fprintf(output, "\t movl\t$%d, 12(%%esp)\n", MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    fprintf(output, "\t movl\t$-1, 16(%%esp)\n");
+    fprintf(output, "\t movl\t$0, 20(%%esp)\n");
+    fprintf(output, "\t call\tmmap\n");
+    fprintf(output, "\t cmpl\t$-1, %%eax\n");
+    fprintf(output, "\t je\t.Rtape_none\n");
+    fprintf(output, "\t movl\t%%eax, bf_tape_at\n");
+    fprintf(output, "\t leal\t%d(%%eax), %%ebx\n", BFCC_GUARD32);
+    fprintf(output, "\t movl\t%%ebx, (%%esp)\n");
+    fprintf(output, "\t movl\t$%d, 4(%%esp)\n", BFCC_TAPE_SIZE32);
+    fprintf(output, "\t movl\t$%d, 8(%%esp)\n", PROT_READ | PROT_WRITE);
+    fprintf(output, "\t call\tmprotect\n");
+    fprintf(output, "\t testl\t%%eax, %%eax\n");
+    fprintf(output, "\t jnz\t.Rtape_none\n");
+    fprintf(output, "\t movl\t$%d, (%%esp)\n", SIGSEGV);
+    fprintf(output, "\t movl\t$bf_segv, 4(%%esp)\n");
+    fprintf(output, "\t movl\t$0, 8(%%esp)\n");
+    fprintf(output, "\t call\tsigaction\n");
+    fprintf(output, "\t testl\t%%eax, %%eax\n");
+    fprintf(output, "\t jnz\t.Rtape_none\n");
+    fprintf(output, "\t movl\t%%ebx, %%eax\n");
+    fprintf(output, "\t addl\t$24, %%esp\n");
+    fprintf(output, "\t popl\t%%ebx\n");
+    fprintf(output, "\t ret\n");
+    fprintf(output, ".Rtape_none:\n");
+    fprintf(output, "\t xorl\t%%eax, %%eax\n");
+    fprintf(output, "\t addl\t$24, %%esp\n");
+    fprintf(output, "\t popl\t%%ebx\n");
+    fprintf(output, "\t ret\n\t .size\tbf_tape_map, .-bf_tape_map\n");
+
+    /* bf_fault(sig, info, context) reports a touch of either guard the way
+     * bfi would: ERR_BOUNDS before the tape, ERR_MEM past it. A fault
+     * anywhere else is a real crash, so the default action goes back and
+     * returning faults again. si_addr is 12 bytes into siginfo_t. */
+    fprintf(output, "\t .type\tbf_fault, @function\nbf_fault:\n");
+    fprintf(output, "\t pushl\t%%ebp\n");
+    fprintf(output, "\t movl\t%%esp, %%ebp\n");
+    fprintf(output, "\t andl\t$-16, %%esp\n");
+    fprintf(output, "\t subl\t$16, %%esp\n");
+    fprintf(output, "\t movl\t12(%%ebp), %%eax\n");
+    fprintf(output, "\t movl\t12(%%eax), %%eax\n");
+    fprintf(output, "\t subl\tbf_tape_at, %%eax\n");
+    fprintf(output, "\t movl\t$bf_bounds_msg, %%esi\n");
+    fprintf(output, "\t movl\t$%zu, %%edi\n", sizeof(bfcc_bounds_msg) - 1);
+    fprintf(output, "\t movl\t$%d, %%ebx\n", ERR_BOUNDS);
+    fprintf(output, "\t cmpl\t$%d, %%eax\n", BFCC_GUARD32);
+    fprintf(output, "\t jb\t.Rfault_guard\n");
+    fprintf(output, "\t movl\t$bf_mem_msg, %%esi\n");
+    fprintf(output, "\t movl\t$%zu, %%edi\n", sizeof(bfcc_mem_msg) - 1);
+    fprintf(output, "\t movl\t$%d, %%ebx\n", ERR_MEM);
+    fprintf(output, "\t subl\t$%d, %%eax\n", BFCC_GUARD32 + BFCC_TAPE_SIZE32);
+    fprintf(output, "\t cmpl\t$%d, %%eax\n", BFCC_GUARD32);
+    fprintf(output, "\t jb\t.Rfault_guard\n");
+    fprintf(output, "\t movl\t$%d, (%%esp)\n", SIGSEGV);
+    fprintf(output, "\t movl\t$0, 4(%%esp)\n");
+    fprintf(output, "\t call\tsignal\n");
+    fprintf(output, "\t leave\n");
+    fprintf(output, "\t ret\n");
+    fprintf(output, ".Rfault_guard:\n");
+    fprintf(output, "\t call\tbf_flush\n");
+    fprintf(output, "\t movl\t$2, (%%esp)\n");
+    fprintf(output, "\t movl\t%%esi, 4(%%esp)\n");
+    fprintf(output, "\t movl\t%%edi, 8(%%esp)\n");
+    fprintf(output, "\t call\twrite\n");
+    fprintf(output, "\t movl\t%%ebx, (%%esp)\n");
+    fprintf(output, "\t call\t_exit\n\t .size\tbf_fault, .-bf_fault\n");
+
+    /* struct sigaction: the handler, an empty mask, flags and restorer */
+    fprintf(output, "\t .data\n\t .align\t4\nbf_segv:\n");
+    fprintf(output, "\t .long\tbf_fault\n\t .zero\t128\n");
+    fprintf(output, "\t .long\t%d\n\t .zero\t4\n", SA_SIGINFO);
+    fprintf(output, "\t .section\t.rodata\n");
+    bfcc_emit_bytes(output, "bf_bounds_msg", (const uint8_t *)bfcc_bounds_msg,
+        sizeof(bfcc_bounds_msg) - 1);
+    bfcc_emit_bytes(output, "bf_mem_msg", (const uint8_t *)bfcc_mem_msg,
+        sizeof(bfcc_mem_msg) - 1);
+
+    fprintf(output, "\t .local\tbf_tape_at\n\t .comm\tbf_tape_at,4,4\n");
+    fprintf(output, "\t .local\tbf_outlen\n\t .comm\tbf_outlen,4,4\n");
+    fprintf(output, "\t .local\tbf_inlen\n\t .comm\tbf_inlen,4,4\n");
+    fprintf(output, "\t .local\tbf_inpos\n\t .comm\tbf_inpos,4,4\n");
+    fprintf(output, "\t .local\tbf_outbuf\n\t .comm\tbf_outbuf,%d,32\n", BFCC_OUTBUF_SIZE);
+    fprintf(output, "\t .local\tbf_inbuf\n\t .comm\tbf_inbuf,%d,32\n", BFCC_INBUF_SIZE);
+}
+
+void bfcc_emit_runtime64(FILE *output, int32_t flush){
+    /* gen64's version of the I/O runtime, with SysV calls: bf_put(c),
+     * bf_get() returning the byte or -1, and bf_write(text, length). */
+    fprintf(output, "\t .type\tbf_flush, @function\nbf_flush:\n");
+    fprintf(output, "\t pushq\t%%rbx\n");
+    fprintf(output, "\t pushq\t%%r12\n");
+    fprintf(output, "\t subq\t$8, %%rsp\n");
+    fprintf(output, "\t leaq\tbf_outbuf(%%rip), %%rbx\n");
+    fprintf(output, "\t movl\tbf_outlen(%%rip), %%r12d\n");
+    fprintf(output, ".Rflush:\n");
+    fprintf(output, "\t testl\t%%r12d, %%r12d\n");
+    fprintf(output, "\t jle\t.Rflushed\n");
+    fprintf(output, "\t movl\t$1, %%edi\n");
+    fprintf(output, "\t movq\t%%rbx, %%rsi\n");
+    fprintf(output, "\t movl\t%%r12d, %%edx\n");
+    fprintf(output, "\t call\twrite@PLT\n");
+    fprintf(output, "\t testq\t%%rax, %%rax\n");
+    fprintf(output, "\t jle\t.Rflushed\n");
+    fprintf(output, "\t addq\t%%rax, %%rbx\n");
+    fprintf(output, "\t subl\t%%eax, %%r12d\n");
+    fprintf(output, "\t jmp\t.Rflush\n");
+    fprintf(output, ".Rflushed:\n");
+    fprintf(output, "\t movl\t$0, bf_outlen(%%rip)\n");
+    fprintf(output, "\t addq\t$8, %%rsp\n");
+    fprintf(output, "\t popq\t%%r12\n");
+    fprintf(output, "\t popq\t%%rbx\n");
+    fprintf(output, "\t ret\n\t .size\tbf_flush, .-bf_flush\n");
+
+    fprintf(output, "\t .type\tbf_put, @function\nbf_put:\n");
+    fprintf(output, "\t movl\tbf_outlen(%%rip), %%eax\n");
+    fprintf(output, "\t leaq\tbf_outbuf(%%rip), %%rdx\n");
+    fprintf(output, "\t movb\t%%dil, (%%rdx,%%rax)\n");
+    fprintf(output, "\t incl\t%%eax\n");
+    fprintf(output, "\t movl\t%%eax, bf_outlen(%%rip)\n");
+    fprintf(output, "\t cmpl\t$%d, %%eax\n", BFCC_OUTBUF_SIZE);
+    fprintf(output, "\t jae\tbf_flush\n");
+    if(flush == BFCC_FLUSH_NEWLINE){
+        fprintf(output, "\t cmpb\t$10, %%dil\n");
+        fprintf(output, "\t je\tbf_flush\n");
+    }
+    fprintf(output, "\t ret\n\t .size\tbf_put, .-bf_put\n");
+
+    /* As gen32's, with the text and what's left of it kept in rbx and r12
+     * across bf_flush */
+    fprintf(output, "\t .type\tbf_write, @function\nbf_write:\n");
+    fprintf(output, "\t pushq\t%%rbx\n");
+    fprintf(output, "\t pushq\t%%r12\n");
+    fprintf(output, "\t subq\t$8, %%rsp\n");
+    fprintf(output, "\t movq\t%%rdi, %%rbx\n");
+    fprintf(output, "\t movq\t%%rsi, %%r12\n");
+    fprintf(output, ".Rwrite:\n");
+    fprintf(output, "\t testq\t%%r12, %%r12\n");
+    fprintf(output, "\t jz\t.Rwritten\n");
+    fprintf(output, "\t movl\t$%d, %%ecx\n", BFCC_OUTBUF_SIZE);
+    fprintf(output, "\t subl\tbf_outlen(%%rip), %%ecx\n");
+    fprintf(output, "\t cmpq\t%%r12, %%rcx\n");
+    fprintf(output, "\t jbe\t.Rwrite_room\n");
+    fprintf(output, "\t movq\t%%r12, %%rcx\n");
+    fprintf(output, ".Rwrite_room:\n");
+    if(flush == BFCC_FLUSH_NEWLINE){
+        fprintf(output, "\t movq\t%%rbx, %%rdi\n");
+        fprintf(output, "\t movq\t%%rcx, %%rdx\n");
+        fprintf(output, "\t movl\t$10, %%eax\n");
+        fprintf(output, "\t repne scasb\n");
+        fprintf(output, "\t jne\t.Rwrite_line\n");
+        fprintf(output, "\t subq\t%%rcx, %%rdx\n");
+        fprintf(output, ".Rwrite_line:\n");
+        fprintf(output, "\t movq\t%%rdx, %%rcx\n");
+    }
+    fprintf(output, "\t subq\t%%rcx, %%r12\n");
+    fprintf(output, "\t movl\tbf_outlen(%%rip), %%edi\n");
+    fprintf(output, "\t addl\t%%ecx, bf_outlen(%%rip)\n");
+    fprintf(output, "\t leaq\tbf_outbuf(%%rip), %%rax\n");
+    fprintf(output, "\t addq\t%%rax, %%rdi\n");
+    fprintf(output, "\t movq\t%%rbx, %%rsi\n");
+    fprintf(output, "\t rep movsb\n");
+    fprintf(output, "\t movq\t%%rsi, %%rbx\n");
+    fprintf(output, "\t cmpl\t$%d, bf_outlen(%%rip)\n", BFCC_OUTBUF_SIZE);
+    fprintf(output, "\t jae\t.Rwrite_full\n");
+    if(flush == BFCC_FLUSH_NEWLINE){
+        fprintf(output, "\t cmpb\t$10, -1(%%rbx)\n");
+        fprintf(output, "\t je\t.Rwrite_full\n");
+    }
+    fprintf(output, "\t jmp\t.Rwrite\n");
+    fprintf(output, ".Rwrite_full:\n");
+    fprintf(output, "\t call\tbf_flush\n");
+    fprintf(output, "\t jmp\t.Rwrite\n");
+    fprintf(output, ".Rwritten:\n");
+    fprintf(output, "\t addq\t$8, %%rsp\n");
+    fprintf(output, "\t popq\t%%r12\n");
+    fprintf(output, "\t popq\t%%rbx\n");
+    fprintf(output, "\t ret\n\t .size\tbf_write, .-bf_write\n");
+
+    fprintf(output, "\t .type\tbf_get, @function\nbf_get:\n");
+    fprintf(output, "\t movl\tbf_inpos(%%rip), %%eax\n");
+    fprintf(output, "\t cmpl\tbf_inlen(%%rip), %%eax\n");
+    fprintf(output, "\t jb\t.Rget_have\n");
+    fprintf(output, "\t subq\t$8, %%rsp\n");
+    if(flush != BFCC_FLUSH_EXIT){
+        fprintf(output, "\t call\tbf_flush\n");
+    }
+    fprintf(output, "\t xorl\t%%edi, %%edi\n");
+    fprintf(output, "\t leaq\tbf_inbuf(%%rip), %%rsi\n");
+    fprintf(output, "\t movl\t$%d, %%edx\n", BFCC_INBUF_SIZE);
+    fprintf(output, "\t call\tread@PLT\n");
+    fprintf(output, "\t addq\t$8, %%rsp\n");
+    fprintf(output, "\t movl\t$0, bf_inpos(%%rip)\n");
+    fprintf(output, "\t testq\t%%rax, %%rax\n");
+    fprintf(output, "\t jg\t.Rget_fill\n");
+    fprintf(output, "\t movl\t$0, bf_inlen(%%rip)\n");
+    fprintf(output, "\t movl\t$-1, %%eax\n");
+    fprintf(output, "\t ret\n");
+    fprintf(output, ".Rget_fill:\n");
+    fprintf(output, "\t movl\t%%eax, bf_inlen(%%rip)\n");
+    fprintf(output, "\t xorl\t%%eax, %%eax\n");
+    fprintf(output, ".Rget_have:\n");
+    fprintf(output, "\t leaq\tbf_inbuf(%%rip), %%rdx\n");
+    fprintf(output, "\t movzbl\t(%%rdx,%%rax), %%ecx\n");
+    fprintf(output, "\t incl\t%%eax\n");
+    fprintf(output, "\t movl\t%%eax, bf_inpos(%%rip)\n");
+    fprintf(output, "\t movl\t%%ecx, %%eax\n");
+    fprintf(output, "\t ret\n\t .size\tbf_get, .-bf_get\n");
+
+    /* gen32's bf_tape_map and bf_fault, with 64-bit sizes. si_addr is 16
+     * bytes into siginfo_t here. */
+    fprintf(output, "\t .type\tbf_tape_map, @function\nbf_tape_map:\n");
+    fprintf(output, "\t pushq\t%%rbx\n");
+    fprintf(output, "\t xorl\t%%edi, %%edi\n");
+    fprintf(output, "\t movabsq\t$%" PRId64 ", %%rsi\n", BFCC_GUARD64 + BFCC_TAPE_SIZE64 + BFCC_GUARD64);
+    fprintf(output, "\t movl\t$%d, %%edx\n", PROT_NONE);
+    fprintf(output, "\t movl\t$%d, %%ecx\n", MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    fprintf(output, "\t movl\t$-1, %%r8d\n");
+    fprintf(output, "\t xorl\t%%r9d, %%r9d\n");
+    fprintf(output, "\t call\tmmap@PLT\n");
+    fprintf(output, "\t cmpq\t$-1, %%rax\n");
+    fprintf(output, "\t je\t.Rtape_none\n");
+    fprintf(output, "\t movq\t%%rax, bf_tape_at(%%rip)\n");
+    fprintf(output, "\t movabsq\t$%" PRId64 ", %%rbx\n", BFCC_GUARD64);
+    fprintf(output, "\t addq\t%%rax, %%rbx\n");
+    fprintf(output, "\t movq\t%%rbx, %%rdi\n");
+    fprintf(output, "\t movabsq\t$%" PRId64 ", %%rsi\n", BFCC_TAPE_SIZE64);
+    fprintf(output, "\t movl\t$%d, %%edx\n", PROT_READ | PROT_WRITE);
+    fprintf(output, "\t call\tmprotect@PLT\n");
+    fprintf(output, "\t testl\t%%eax, %%eax\n");
+    fprintf(output, "\t jnz\t.Rtape_none\n");
+    fprintf(output, "\t movl\t$%d, %%edi\n", SIGSEGV);
+    fprintf(output, "\t leaq\tbf_segv(%%rip), %%rsi\n");
+    fprintf(output, "\t xorl\t%%edx, %%edx\n");
+    fprintf(output, "\t call\tsigaction@PLT\n");
+    fprintf(output, "\t testl\t%%eax, %%eax\n");
+    fprintf(output, "\t jnz\t.Rtape_none\n");
+    fprintf(output, "\t movq\t%%rbx, %%rax\n");
+    fprintf(output, "\t popq\t%%rbx\n");
+    fprintf(output, "\t ret\n");
+    fprintf(output, ".Rtape_none:\n");
+    fprintf(output, "\t xorl\t%%eax, %%eax\n");
+    fprintf(output, "\t popq\t%%rbx\n");
+    fprintf(output, "\t ret\n\t .size\tbf_tape_map, .-bf_tape_map\n");
+
+    fprintf(output, "\t .type\tbf_fault, @function\nbf_fault:\n");
+    fprintf(output, "\t pushq\t%%rbx\n");
+    fprintf(output, "\t pushq\t%%r12\n");
+    fprintf(output, "\t pushq\t%%r13\n");
+    fprintf(output, "\t movq\t16(%%rsi), %%rax\n");
+    fprintf(output, "\t subq\tbf_tape_at(%%rip), %%rax\n");
+    fprintf(output, "\t movabsq\t$%" PRId64 ", %%rcx\n", BFCC_GUARD64);
+    fprintf(output, "\t leaq\tbf_bounds_msg(%%rip), %%rbx\n");
+    fprintf(output, "\t movl\t$%zu, %%r12d\n", sizeof(bfcc_bounds_msg) - 1);
+    fprintf(output, "\t movl\t$%d, %%r13d\n", ERR_BOUNDS);
+    fprintf(output, "\t cmpq\t%%rcx, %%rax\n");
+    fprintf(output, "\t jb\t.Rfault_guard\n");
+    fprintf(output, "\t leaq\tbf_mem_msg(%%rip), %%rbx\n");
+    fprintf(output, "\t movl\t$%zu, %%r12d\n", sizeof(bfcc_mem_msg) - 1);
+    fprintf(output, "\t movl\t$%d, %%r13d\n", ERR_MEM);
+    fprintf(output, "\t movabsq\t$%" PRId64 ", %%rdx\n", BFCC_GUARD64 + BFCC_TAPE_SIZE64);
+    fprintf(output, "\t subq\t%%rdx, %%rax\n");
+    fprintf(output, "\t cmpq\t%%rcx, %%rax\n");
+    fprintf(output, "\t jb\t.Rfault_guard\n");
+    fprintf(output, "\t movl\t$%d, %%edi\n", SIGSEGV);
+    fprintf(output, "\t xorl\t%%esi, %%esi\n");
+    fprintf(output, "\t call\tsignal@PLT\n");
+    fprintf(output, "\t popq\t%%r13\n");
+    fprintf(output, "\t popq\t%%r12\n");
+    fprintf(output, "\t popq\t%%rbx\n");
+    fprintf(output, "\t ret\n");
+    fprintf(output, ".Rfault_guard:\n");
+    fprintf(output, "\t call\tbf_flush\n");
+    fprintf(output, "\t movl\t$2, %%edi\n");
+    fprintf(output, "\t movq\t%%rbx, %%rsi\n");
+    fprintf(output, "\t movl\t%%r12d, %%edx\n");
+    fprintf(output, "\t call\twrite@PLT\n");
+    fprintf(output, "\t movl\t%%r13d, %%edi\n");
+    fprintf(output, "\t call\t_exit@PLT\n\t .size\tbf_fault, .-bf_fault\n");
+
+    fprintf(output, "\t .data\n\t .align\t8\nbf_segv:\n");
+    fprintf(output, "\t .quad\tbf_fault\n\t .zero\t128\n");
+    fprintf(output, "\t .long\t%d\n\t .zero\t12\n", SA_SIGINFO);
+    fprintf(output, "\t .section\t.rodata\n");
+    bfcc_emit_bytes(output, "bf_bounds_msg", (const uint8_t *)bfcc_bounds_msg,
+        sizeof(bfcc_bounds_msg) - 1);
+    bfcc_emit_bytes(output, "bf_mem_msg", (const uint8_t *)bfcc_mem_msg,
+        sizeof(bfcc_mem_msg) - 1);
+
+    fprintf(output, "\t .local\tbf_tape_at\n\t .comm\tbf_tape_at,8,8\n");
+    fprintf(output, "\t .local\tbf_tape_lo\n\t .comm\tbf_tape_lo,8,8\n");
+    fprintf(output, "\t .local\tbf_tape_hi\n\t .comm\tbf_tape_hi,8,8\n");
+    fprintf(output, "\t .local\tbf_outlen\n\t .comm\tbf_outlen,4,4\n");
+    fprintf(output, "\t .local\tbf_inlen\n\t .comm\tbf_inlen,4,4\n");
+    fprintf(output, "\t .local\tbf_inpos\n\t .comm\tbf_inpos,4,4\n");
+    fprintf(output, "\t .local\tbf_outbuf\n\t .comm\tbf_outbuf,%d,32\n", BFCC_OUTBUF_SIZE);
+    fprintf(output, "\t .local\tbf_inbuf\n\t .comm\tbf_inbuf,%d,32\n", BFCC_INBUF_SIZE);
+}
+
+/* gen32's register pairs, slot by slot. Values need byte registers, which
+ * leaves the pointers the rest. The runtime saves everything but ebp, so
+ * both survive I/O. */
+static char *gen32_ptr_regs[GEN32_SLOTS] = {"ebx", "esi", "edi"};
+static char *gen32_val_regs[GEN32_SLOTS] = {"eax", "ecx", "edx"};
+static char *gen32_val_bregs[GEN32_SLOTS] = {"al", "cl", "dl"};
+
+int32_t gen32_find_slot(gen32_cache_t *cache, int32_t loc){
+    //Returns the slot pointing at loc, or -1.
+    for(int32_t i = 0; i < GEN32_SLOTS; i++){
+        if(cache->ptr_valid[i] && cache->locs[i] == loc){
+            cache->stamp[i] = ++cache->clock;
             return i;
         }
     }
+    return -1;
+}
 
-    /* If we get here, we're going to have to do a memory access. Try to do it
-     * without overwriting someone else's registers */
-    for(int32_t i = 0, c = ((curr + 1) % 3); i < 3; i++, c = ((c + 1) % 3)){
-        if(refresh[c]){
-            return c;
+int32_t gen32_find_bestp(FILE *output, gen32_cache_t *cache, int32_t loc, int32_t *refresh){
+    /* Returns the slot to use for a pointer to loc: one that already points
+     * there if there is one, else an empty slot, else the least recently
+     * used, whose value is written back. The data pointer's slot is never
+     * taken, since the new pointer is worked out from it. Sets refresh if
+     * the pointer has to be loaded, in which case the slot is claimed for
+     * loc with no value. */
+    int32_t slot = gen32_find_slot(cache, loc);
+    *refresh = slot < 0;
+    if(slot >= 0){
+        return slot;
+    }
+    for(int32_t i = 0; i < GEN32_SLOTS; i++){
+        if(i == cache->curr){
+            continue;
+        }
+        if(!cache->ptr_valid[i]){
+            slot = i;
+            break;
         }
+        if(slot < 0 || cache->stamp[i] < cache->stamp[slot]){
+            slot = i;
+        }
+    }
+    gen32_store(output, cache, slot);
+    cache->ptr_valid[slot] = 1;
+    cache->val_valid[slot] = 0;
+    cache->locs[slot] = loc;
+    cache->stamp[slot] = ++cache->clock;
+    return slot;
+}
+
+void gen32_load(FILE *output, gen32_cache_t *cache, int32_t slot){
+    //Makes sure slot's value register holds its cell.
+    if(!cache->val_valid[slot]){
+        fprintf(output, "\t movzbl\t(%%%s), %%%s\n", gen32_ptr_regs[slot],
+            gen32_val_regs[slot]);
+        cache->val_valid[slot] = 1;
     }
+}
+
+void gen32_store(FILE *output, gen32_cache_t *cache, int32_t slot){
+    //Writes slot's value back to its cell if it's dirty.
+    if(cache->dirty[slot]){
+        fprintf(output, "\t movb\t%%%s, (%%%s)\n", gen32_val_bregs[slot],
+            gen32_ptr_regs[slot]);
+        cache->dirty[slot] = 0;
+    }
+}
+
+void gen32_flush(FILE *output, gen32_cache_t *cache){
+    //Writes back every dirty value, before anything that looks at memory.
+    for(int32_t i = 0; i < GEN32_SLOTS; i++){
+        gen32_store(output, cache, i);
+    }
+}
 
-    /* This is the sucky case */
-    int32_t ret = (curr + 1) % 3;
-    refresh[ret] = 1;
-    return ret;
+void gen32_switch(FILE *output, gen32_cache_t *cache, int32_t slot){
+    /* Moves the data pointer, and its value if cached, into slot, whose
+     * own value is written back first. The slot it leaves is emptied so no
+     * two slots point at the same cell. */
+    int32_t old = cache->curr;
+    if(old == slot){
+        return;
+    }
+    gen32_store(output, cache, slot);
+    fprintf(output, "\t movl\t%%%s, %%%s\n", gen32_ptr_regs[old], gen32_ptr_regs[slot]);
+    if(cache->val_valid[old]){
+        fprintf(output, "\t movl\t%%%s, %%%s\n", gen32_val_regs[old],
+            gen32_val_regs[slot]);
+    }
+    cache->ptr_valid[slot] = 1;
+    cache->val_valid[slot] = cache->val_valid[old];
+    cache->dirty[slot] = cache->dirty[old];
+    cache->locs[slot] = cache->locs[old];
+    cache->stamp[slot] = ++cache->clock;
+    cache->ptr_valid[old] = cache->val_valid[old] = cache->dirty[old] = 0;
+    cache->curr = slot;
 }
 
-void bfcc_gen32(FILE *output, list_t *parse_lst, char *filename){
-    //Generate 32-bit x86 code.
+void gen32_join(FILE *output, gen32_cache_t *cache, const gen32_cache_t *other){
+    /* Gets cache's path ready to join other's, whose code is already out:
+     * writes back cache's dirty values other won't keep, and fetches every
+     * value other has dirty, since other can't write them back any more.
+     * After this gen32_meet loses no stores. The data pointer must already
+     * be in the same slot on both. */
+    int32_t c = cache->curr;
+    for(int32_t s = 0; s < GEN32_SLOTS; s++){
+        if(!other->ptr_valid[s] || !other->val_valid[s]
+                || cache->locs[s] - cache->locs[c] != other->locs[s] - other->locs[c]){
+            gen32_store(output, cache, s);
+        }
+    }
+    for(int32_t s = 0; s < GEN32_SLOTS; s++){
+        int32_t rel = other->locs[s] - other->locs[c];
+        if(!other->dirty[s] || (cache->val_valid[s]
+                && cache->locs[s] - cache->locs[c] == rel)){
+            continue;
+        }
+        if(!cache->ptr_valid[s] || cache->locs[s] - cache->locs[c] != rel){
+            /* Any other slot on that cell is clean by now; drop it so no
+             * two slots share a cell */
+            for(int32_t t = 0; t < GEN32_SLOTS; t++){
+                if(t != c && cache->ptr_valid[t] && cache->locs[t] - cache->locs[c] == rel){
+                    cache->ptr_valid[t] = cache->val_valid[t] = 0;
+                }
+            }
+            fprintf(output, "\t leal\t%d(%%%s), %%%s\n", rel, gen32_ptr_regs[c],
+                gen32_ptr_regs[s]);
+            cache->ptr_valid[s] = 1;
+            cache->val_valid[s] = 0;
+            cache->locs[s] = cache->locs[c] + rel;
+        }
+        gen32_load(output, cache, s);
+    }
+}
+
+void gen32_meet(gen32_cache_t *cache, const gen32_cache_t *other){
+    /* Where two paths join: keeps what both agree on, dirty if either path
+     * left it so. Cells are compared by where they are relative to the data
+     * pointer, which must already be in the same slot on both. */
+    int32_t c = cache->curr;
+    for(int32_t i = 0; i < GEN32_SLOTS; i++){
+        if(!cache->ptr_valid[i] || !other->ptr_valid[i]
+                || cache->locs[i] - cache->locs[c] != other->locs[i] - other->locs[c]){
+            cache->ptr_valid[i] = cache->val_valid[i] = cache->dirty[i] = 0;
+        }else if(!other->val_valid[i]){
+            cache->val_valid[i] = cache->dirty[i] = 0;
+        }else{
+            cache->dirty[i] |= other->dirty[i];
+        }
+    }
+}
+
+void gen32_reconcile(FILE *output, gen32_cache_t *cache, const gen32_cache_t *target){
+    /* Emits the fix-up that takes cache to target's state before a back
+     * edge to target's label, and leaves cache equal to target. Pointers are
+     * rebuilt relative to the data pointer, so this is right however far
+     * the loop moved it; a balanced loop usually needs nothing. Dirty
+     * values are written back first unless target has them dirty too. The
+     * data pointer's own register is the base for the rest, so it goes
+     * last. */
+    int32_t base = cache->curr, tc = target->curr;
+    for(int32_t s = 0; s < GEN32_SLOTS; s++){
+        if(!target->dirty[s] || !cache->ptr_valid[s]
+                || cache->locs[s] - cache->locs[base] != target->locs[s] - target->locs[tc]){
+            gen32_store(output, cache, s);
+        }
+    }
+    for(int32_t k = 1; k <= GEN32_SLOTS; k++){
+        int32_t s = (base + k) % GEN32_SLOTS;
+        if(!target->ptr_valid[s]){
+            continue;
+        }
+        int32_t rel = target->locs[s] - target->locs[tc];
+        if(cache->ptr_valid[s] && cache->locs[s] - cache->locs[base] == rel){
+            continue;
+        }
+        if(rel){
+            fprintf(output, "\t leal\t%d(%%%s), %%%s\n", rel, gen32_ptr_regs[base],
+                gen32_ptr_regs[s]);
+        }else if(s != base){
+            fprintf(output, "\t movl\t%%%s, %%%s\n", gen32_ptr_regs[base],
+                gen32_ptr_regs[s]);
+        }
+        cache->val_valid[s] = 0;
+    }
+    for(int32_t s = 0; s < GEN32_SLOTS; s++){
+        if(target->val_valid[s] && !cache->val_valid[s]){
+            fprintf(output, "\t movzbl\t(%%%s), %%%s\n", gen32_ptr_regs[s],
+                gen32_val_regs[s]);
+        }
+    }
+    *cache = *target;
+}
+
+int32_t *gen32_loop_heads(const bfir_t *ir, int32_t labels){
+    /* For each label, GEN32_BALANCED or GEN32_UNBALANCED if a later branch
+     * jumps back to it, else 0. A loop is balanced if it can't be seen to
+     * move the data pointer: then it's worth keeping every cached cell
+     * across its back edge, since the fix-up there will usually be empty.
+     * Only a guess, as it goes by the sum of the moves in between. */
+    int32_t *kinds = calloc(labels + 1, sizeof(int32_t));
+    size_t *where = malloc((labels + 1) * sizeof(size_t));
+    int64_t *pos = malloc((ir->length + 1) * sizeof(int64_t));
+    int64_t *scans = malloc((ir->length + 1) * sizeof(int64_t));
+    if(!kinds || !where || !pos || !scans){
+        CriticalError("Failed to allocate memory");
+    }
+    for(int32_t l = 0; l <= labels; l++){
+        where[l] = ir->length;
+    }
+    pos[0] = scans[0] = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        const bfop_t *op = &ir->ops[i];
+        pos[i + 1] = pos[i] + (bfop_type(op->opcode) == T_PTR ? bfopt_delta(op) : 0);
+        scans[i + 1] = scans[i] + (op->opcode == SCAN);
+        if(op->opcode == LABEL){
+            where[op->arg] = i;
+        }
+    }
+    for(size_t i = 0; i < ir->length; i++){
+        const bfop_t *op = &ir->ops[i];
+        if(op->opcode != LABEL && bfop_type(op->opcode) == T_BRANCH
+                && where[op->arg] < i){
+            size_t k = where[op->arg];
+            int32_t balanced = pos[i] == pos[k] && scans[i] == scans[k];
+            kinds[op->arg] = balanced && kinds[op->arg] != GEN32_UNBALANCED
+                                ? GEN32_BALANCED : GEN32_UNBALANCED;
+        }
+    }
+    free(where);
+    free(pos);
+    free(scans);
+    return kinds;
+}
+
+void bfcc_gen32(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename){
+    /* Generate 32-bit x86 code, starting from prefix's tape and output,
+     * origin cells into the tape. */
+    if(origin >= BFCC_TAPE_SIZE32){
+        CriticalError("Origin past the end of the tape");
+    }
     fprintf(output, "\t .file\t\"%s\"\n", filename);
     fprintf(output, "\t .text\n.globl bf_prog\n\t .type\t bf_prog, @function\n");
     fprintf(output, "bf_prog:\n");
@@ -160,170 +812,258 @@ void bfcc_gen32(FILE *output, list_t *parse_lst, char *filename){
     fprintf(output, "\t pushl\t%%esi\n");
     fprintf(output, "\t pushl\t%%edi\n");
     fprintf(output, "\t movl\t8(%%ebp), %%ebx\n");
-    fprintf(output, "\t subl\t$8, %%esp\n");
-    fprintf(output, "\t movl\tstdout, %%eax\n");
-    fprintf(output, "\t movl\t%%eax, 4(%%esp)\n");
-
-    node_t *node = parse_lst->head->next;
-
-    /* Try to track 3 different ptr/value combinations with 6 available
-     * registers (ebx/eax, esi/ecx, edi/edx) */
-    int32_t refresh_vals = {1, 1, 1};
-    int32_t refresh_ptrs = {1, 1, 1};
-
-    int32_t ptr_locs[] = {0, 0, 0};
-    int32_t curr_ptr = 2;  /* uninitialized */
+    fprintf(output, "\t subl\t$28, %%esp\n");
+
+    /* Each slot is a pointer register and a value register caching the
+     * cell it points at. Stores are put off until something needs memory
+     * to be right: a scan, an eviction, or a join or back edge that
+     * doesn't keep the value. Cell positions are only ever compared
+     * relative to the data pointer's slot, so states from different paths
+     * can be matched up. ebp is free for scratch once the argument is
+     * loaded. */
+    int32_t labels = -1;
+    for(size_t i = 0; i < ir->length; i++){
+        if(ir->ops[i].opcode == LABEL && ir->ops[i].arg > labels){
+            labels = ir->ops[i].arg;
+        }
+    }
+    int32_t *heads = gen32_loop_heads(ir, labels);
+    int32_t *seen = calloc(labels + 1, sizeof(int32_t));
+    gen32_cache_t *states = malloc((labels + 1) * sizeof(gen32_cache_t));
+    if(!seen || !states){
+        CriticalError("Failed to allocate memory");
+    }
 
-    /* We use callee-save registers for the pointers because it's harder to 
-     * get them back if we lose them. The values are just a memory access */
-    char *ptr_regs[] = {"ebx", "esi", "edi"};
-    char *val_regs[] = {"eax", "ecx", "edx"};
-    char *val_bregs[] = {"al", "cl", "dl"};
+    gen32_cache_t cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.ptr_valid[0] = 1;
 
-    while(node != parse_lst->head){
-        bfop_t *op = node->data;
+    int32_t slot, diff, refresh, loc, scratch = 0, mul_runs = 0, scans = 0;
+    char **ptr_regs = gen32_ptr_regs, **val_regs = gen32_val_regs;
+    char **val_bregs = gen32_val_bregs;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        int32_t curr = cache.curr;
         switch(op->opcode){
             case INC:
-                int32_t old_ptr = curr_ptr;
-                curr_ptr = gen32_find_bestp(curr_ptr, 1, ptr_locs, refresh_ptrs);
-                if(refresh_ptrs[curr_ptr]){
-                    fprintf(output, "\t leal\t1(%%%s), %%%s\n", 
-                        ptr_regs[old_ptr], ptr_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 1;
-                }
-                break;
             case INCV:
-                int32_t old_ptr = curr_ptr;
-                curr_ptr = gen32_find_bestp(curr_ptr, op->arg, ptr_locs, refresh_ptrs);
-                if(refresh_ptrs[curr_ptr]){
-                    fprintf(output, "\t leal\t%d(%%%s), %%%s\n", 
-                        op->arg, ptr_regs[old_ptr], ptr_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 1;
-                }
-                break;
             case DEC:
-                int32_t old_ptr = curr_ptr;
-                curr_ptr = gen32_find_bestp(curr_ptr, -1, ptr_locs, refresh_ptrs);
-                if(refresh_ptrs[curr_ptr]){
-                    fprintf(output, "\t leal\t-1(%%%s), %%%s\n", 
-                        ptr_regs[old_ptr], ptr_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 1;
-                }
-                break;
             case DECV:
-                int32_t old_ptr = curr_ptr;
-                curr_ptr = gen32_find_bestp(curr_ptr, -(op->arg), 
-                                ptr_locs, refresh_ptrs);
-                if(refresh_ptrs[curr_ptr]){
-                    fprintf(output, "\t leal\t%d(%%%s), %%%s\n", 
-                        -(op->arg), ptr_regs[old_ptr], ptr_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 1;
+                diff = bfopt_delta(op);
+                slot = gen32_find_bestp(output, &cache, cache.locs[curr] + diff,
+                    &refresh);
+                if(refresh){
+                    fprintf(output, "\t leal\t%d(%%%s), %%%s\n", diff,
+                        ptr_regs[curr], ptr_regs[slot]);
                 }
+                cache.curr = slot;
                 break;
             case ADD:
-                if(refresh_vals[curr_ptr]){
-                    fprintf(output, "\t movzbl\t(%%%s), %%%s\n",
-                        ptr_regs[curr_ptr], val_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 0;
-                }
-                fprintf(output, "\t inc\t%%%s\n", val_regs[curr_ptr]);
-                fprintf(output, "\t movb\t%%%s, (%%%s)\n", val_bregs[curr_ptr],
-                    ptr_regs[curr_ptr]);
-                break;
             case ADDV:
-                if(refresh_vals[curr_ptr]){
-                    fprintf(output, "\t movzbl\t(%%%s), %%%s\n",
-                        ptr_regs[curr_ptr], val_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 0;
+            case SUB:
+            case SUBV:
+                /* A cell at an offset is done in memory unless some slot
+                 * already points at it */
+                diff = bfopt_delta(op);
+                slot = op->off ? gen32_find_slot(&cache, cache.locs[curr] + op->off) : curr;
+                if(slot < 0){
+                    fprintf(output, "\t addb\t$%d, %d(%%%s)\n", (int8_t)diff,
+                        op->off, ptr_regs[curr]);
+                    break;
+                }
+                gen32_load(output, &cache, slot);
+                if(op->opcode == ADD){
+                    fprintf(output, "\t inc\t%%%s\n", val_regs[slot]);
+                }else if(op->opcode == SUB){
+                    fprintf(output, "\t dec\t%%%s\n", val_regs[slot]);
+                }else if(op->opcode == ADDV){
+                    fprintf(output, "\t addl\t$%d, %%%s\n", op->arg, val_regs[slot]);
+                }else{
+                    fprintf(output, "\t subl\t$%d, %%%s\n", op->arg, val_regs[slot]);
                 }
-                fprintf(output, "\t addl\t$%d, %%%s\n", op->arg, val_regs[curr_ptr]);
-                fprintf(output, "\t movb\t%%%s, (%%%s)\n", val_bregs[curr_ptr],
-                    ptr_regs[curr_ptr]);
+                cache.dirty[slot] = 1;
                 break;
-            case SUB:
-                if(refresh_vals[curr_ptr]){
-                    fprintf(output, "\t movzbl\t(%%%s), %%%s\n",
-                        ptr_regs[curr_ptr], val_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 0;
+            case ZERO:
+                slot = op->off ? gen32_find_slot(&cache, cache.locs[curr] + op->off) : curr;
+                if(slot < 0){
+                    fprintf(output, "\t movb\t$0, %d(%%%s)\n", op->off, ptr_regs[curr]);
+                    break;
                 }
-                fprintf(output, "\t dec\t%%%s\n", val_regs[curr_ptr]);
-                fprintf(output, "\t movb\t%%%s, (%%%s)\n", val_bregs[curr_ptr],
-                    ptr_regs[curr_ptr]);
+                fprintf(output, "\t xorl\t%%%s, %%%s\n", val_regs[slot],
+                    val_regs[slot]);
+                cache.val_valid[slot] = cache.dirty[slot] = 1;
                 break;
-            case SUBV:
-                if(refresh_vals[curr_ptr]){
-                    fprintf(output, "\t movzbl\t(%%%s), %%%s\n",
-                        ptr_regs[curr_ptr], val_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 0;
+            case MUL:
+                /* Products are made in a scratch slot's value register, the
+                 * least recently used one no MUL in the run adds into, and
+                 * added into a cached target or straight into memory. A run
+                 * of MULs is skipped when the loop cell is zero, so nothing
+                 * else in the cache may change inside it. */
+                if(i == 0 || ir->ops[i - 1].opcode != MUL){
+                    int32_t best = -1, best_target = 0;
+                    for(int32_t s = 0; s < GEN32_SLOTS; s++){
+                        int32_t target = 0;
+                        for(size_t j = i; j < ir->length && ir->ops[j].opcode == MUL; j++){
+                            loc = cache.locs[curr] + ir->ops[j].off;
+                            target |= cache.ptr_valid[s] && cache.locs[s] == loc;
+                        }
+                        if(s != curr && (best < 0 || (best_target && !target)
+                                || (best_target == target
+                                    && cache.stamp[s] < cache.stamp[best]))){
+                            best = s;
+                            best_target = target;
+                        }
+                    }
+                    scratch = best;
+                    gen32_store(output, &cache, scratch);
+                    cache.val_valid[scratch] = 0;
+                    gen32_load(output, &cache, curr);
+                    fprintf(output, "\t testb\t%%%s, %%%s\n", val_bregs[curr],
+                        val_bregs[curr]);
+                    fprintf(output, "\t jz\t.M%d\n", mul_runs);
+                }
+                fprintf(output, "\t imull\t$%d, %%%s, %%%s\n", op->arg, val_regs[curr],
+                    val_regs[scratch]);
+                loc = cache.locs[curr] + op->off;
+                slot = -1;
+                for(int32_t s = 0; s < GEN32_SLOTS; s++){
+                    if(cache.ptr_valid[s] && cache.val_valid[s] && cache.locs[s] == loc){
+                        slot = s;
+                    }
+                }
+                if(slot >= 0){
+                    fprintf(output, "\t addb\t%%%s, %%%s\n", val_bregs[scratch],
+                        val_bregs[slot]);
+                    cache.dirty[slot] = 1;
+                }else{
+                    fprintf(output, "\t addb\t%%%s, %d(%%%s)\n",
+                        val_bregs[scratch], op->off, ptr_regs[curr]);
+                }
+                if(i + 1 == ir->length || ir->ops[i + 1].opcode != MUL){
+                    fprintf(output, ".M%d:\n", mul_runs++);
                 }
-                fprintf(output, "\t subl\t$%d, %%%s\n", op->arg, val_regs[curr_ptr]);
-                fprintf(output, "\t movb\t%%%s, (%%%s)\n", val_bregs[curr_ptr],
-                    ptr_regs[curr_ptr]);
                 break;
-            case ZERO:
-                fprintf(output, "\t xorl\t%%%s, %%%s\n", val_regs[curr_ptr],
-                    val_regs[curr_ptr]);
-                fprintf(output, "\t movb\t%%%s, (%%%s)\n", val_bregs[curr_ptr],
-                    ptr_regs[curr_ptr]);
-                refresh_vals[curr_ptr] = 0;
+            case SCAN:
+                /* Plain loop; SSE2 isn't part of the i386 baseline. The
+                 * pointer ends up somewhere unknown, so only it survives. */
+                gen32_flush(output, &cache);
+                fprintf(output, ".S%d:\n", scans);
+                fprintf(output, "\t cmpb\t$0, (%%%s)\n", ptr_regs[curr]);
+                fprintf(output, "\t jz\t.T%d\n", scans);
+                fprintf(output, "\t addl\t$%d, %%%s\n", op->arg, ptr_regs[curr]);
+                fprintf(output, "\t jmp\t.S%d\n", scans);
+                fprintf(output, ".T%d:\n", scans++);
+                for(int32_t s = 0; s < GEN32_SLOTS; s++){
+                    cache.ptr_valid[s] = cache.val_valid[s] = s == curr;
+                }
+                fprintf(output, "\t xorl\t%%%s, %%%s\n", val_regs[curr], val_regs[curr]);
                 break;
             case LABEL:
-                /* TODO: Figure out how we're going to handle curr_ptr assumptions
-                 *  and refresh requirements around loops. A stack might be a 
-                 *  good idea */
-                fprintf(output, ".L%d:\n", op->arg);
-                for(int i = 0; i < 3; i++){
-                    refresh_ptrs[i] = refresh_vals[i] = 1;
+                /* Joins the paths from earlier branches here. The data
+                 * pointer must be in the same slot on all of them, so the
+                 * fallthrough moves it if need be. A loop head also fixes
+                 * the state its back edges will have to match; its values
+                 * count as dirty so the loop can change them without
+                 * storing them on every trip. */
+                if(seen[op->arg]){
+                    gen32_switch(output, &cache, states[op->arg].curr);
+                    gen32_join(output, &cache, &states[op->arg]);
+                    gen32_meet(&cache, &states[op->arg]);
                 }
-                break;
-            case JNZ:
-                if(refresh_vals[curr_ptr]){
-                    fprintf(output, "\t movzbl\t(%%%s), %%%s\n", 
-                        ptr_regs[curr_ptr], val_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 0;
+                if(heads[op->arg] == GEN32_UNBALANCED){
+                    for(int32_t s = 0; s < GEN32_SLOTS; s++){
+                        if(s != cache.curr){
+                            gen32_store(output, &cache, s);
+                            cache.ptr_valid[s] = cache.val_valid[s] = 0;
+                        }
+                    }
+                }
+                if(heads[op->arg]){
+                    for(int32_t s = 0; s < GEN32_SLOTS; s++){
+                        cache.dirty[s] = cache.val_valid[s];
+                    }
                 }
-                fprintf(output, "\t test\t%%%s, %%%s\n", val_regs[curr_ptr], 
-                    val_regs[curr_ptr]);
-                fprintf(output, "\t jnz\t.L%d\n", op->arg);
+                states[op->arg] = cache;
+                seen[op->arg] = GEN32_PASSED;
+                fprintf(output, ".L%d:\n", op->arg);
                 break;
+            case JNZ:
             case JZ:
-                if(refresh_vals[curr_ptr]){
-                    fprintf(output, "\t movzbl\t(%%%s), %%%s\n", 
-                        ptr_regs[curr_ptr], val_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 0;
+                if(seen[op->arg] == GEN32_PASSED){
+                    /* Back edge: the label's state is already settled */
+                    gen32_reconcile(output, &cache, &states[op->arg]);
+                }else if(seen[op->arg]){
+                    gen32_switch(output, &cache, states[op->arg].curr);
+                    gen32_join(output, &cache, &states[op->arg]);
+                }else if(i + 1 < ir->length && ir->ops[i + 1].opcode == LABEL
+                        && heads[ir->ops[i + 1].arg] == GEN32_UNBALANCED){
+                    /* Skipping a loop that moves the pointer: its head
+                     * writes these back anyway, and if the skip edge kept
+                     * them the exit would have to fetch whatever cells sit
+                     * there after the loop, which may be off the tape */
+                    for(int32_t s = 0; s < GEN32_SLOTS; s++){
+                        if(s != cache.curr){
+                            gen32_store(output, &cache, s);
+                        }
+                    }
+                }
+                curr = cache.curr;
+                gen32_load(output, &cache, curr);
+                fprintf(output, "\t testb\t%%%s, %%%s\n", val_bregs[curr],
+                    val_bregs[curr]);
+                fprintf(output, "\t %s\t.L%d\n", op->opcode == JZ ? "jz" : "jnz",
+                    op->arg);
+                if(seen[op->arg] == GEN32_PENDING){
+                    gen32_meet(&states[op->arg], &cache);
+                }else if(!seen[op->arg]){
+                    states[op->arg] = cache;
+                    seen[op->arg] = GEN32_PENDING;
                 }
-                fprintf(output, "\t test\t%%%s, %%%s\n", val_regs[curr_ptr], 
-                    val_regs[curr_ptr]);
-                fprintf(output, "\t jz\t.L%d\n", op->arg);
                 break;
             case PUT:
-                if(refresh_vals[curr_ptr]){
-                    fprintf(output, "\t movzbl\t(%%%s), %%%s\n", 
-                        ptr_regs[curr_ptr], val_regs[curr_ptr]);
-                    refresh_vals[curr_ptr] = 0;
+                /* The runtime keeps every register but ebp, so nothing
+                 * cached has to be written back or reloaded around I/O */
+                slot = gen32_find_slot(&cache, cache.locs[curr] + op->off);
+                if(slot >= 0 && cache.val_valid[slot]){
+                    fprintf(output, "\t movzbl\t%%%s, %%ebp\n", val_bregs[slot]);
+                }else{
+                    fprintf(output, "\t movzbl\t%d(%%%s), %%ebp\n", op->off,
+                        ptr_regs[curr]);
                 }
-                fprintf(output, "\t movzbl\t%%%s, %%%s\n", val_bregs[curr_ptr],
-                    val_regs[curr_ptr]);
-                fprintf(output, "\t movl\t%%%s, (%%esp)\n", val_regs[curr_ptr]);
-                fprintf(output, "\t call\tfputc\n");
+                fprintf(output, "\t call\tbf_put\n");
                 break;
             case GET:
-                fprintf(output, "\t movl\tstdin, %%%s\n", val_regs[curr_ptr]);
-                fprintf(output, "\t movl\t%%%s, (%%esp)\n", val_regs[curr_ptr]);
-                fprintf(output, "\t call\tfgetc\n");
-                fprintf(output, "\t movb\t%%%s, (%%%s)\n", val_bregs[curr_ptr],
-                    ptr_regs[curr_ptr]);
+                /* bf_get stores straight into the cell, so a cached copy
+                 * is stale, and any unwritten change to it is moot */
+                fprintf(output, "\t leal\t%d(%%%s), %%ebp\n", op->off, ptr_regs[curr]);
+                fprintf(output, "\t call\tbf_get\n");
+                slot = gen32_find_slot(&cache, cache.locs[curr] + op->off);
+                if(slot >= 0){
+                    cache.val_valid[slot] = cache.dirty[slot] = 0;
+                }
+                break;
+            case WRITE_CONST:
+                if(op->off == 1){
+                    fprintf(output, "\t movl\t$%u, %%ebp\n", ir->data[op->arg]);
+                    fprintf(output, "\t call\tbf_put\n");
+                }else{
+                    fprintf(output, "\t movl\t$bf_const+%d, (%%esp)\n", op->arg);
+                    fprintf(output, "\t movl\t$%d, 4(%%esp)\n", op->off);
+                    fprintf(output, "\t call\tbf_write\n");
+                }
                 break;
         }
-        node = node->next;
     }
+    free(heads);
+    free(seen);
+    free(states);
 
     /* Finish up the bf program function and fill in main */
 #if 0
     fprintf(output, "\t popl\t%%edi\n");
     fprintf(output, "\t popl\t%%esi\n");
 #endif
-    fprintf(output, "\t addl\t$8, %%esp\n");
+    fprintf(output, "\t addl\t$28, %%esp\n");
     fprintf(output, "\t popl\t%%edi\n");
     fprintf(output, "\t popl\t%%esi\n");
     fprintf(output, "\t popl\t%%ebx\n");
@@ -334,554 +1074,352 @@ void bfcc_gen32(FILE *output, list_t *parse_lst, char *filename){
     fprintf(output, "\t movl\t%%esp, %%ebp\n");
     fprintf(output, "\t andl\t$-16, %%esp\n");
     fprintf(output, "\t subl\t$32, %%esp\n");
+    fprintf(output, "\t call\tbf_tape_map\n");
+    fprintf(output, "\t testl\t%%eax, %%eax\n");
+    fprintf(output, "\t jnz\t.Rmapped\n");
     fprintf(output, "\t movl\t$1, 4(%%esp)\n");
-    fprintf(output, "\t movl\t$30000, (%%esp)\n");
+    fprintf(output, "\t movl\t$%zu, (%%esp)\n", 30000 + origin);
     fprintf(output, "\t call\tcalloc\n");
+    fprintf(output, ".Rmapped:\n");
+    if(origin){
+        fprintf(output, "\t addl\t$%zu, %%eax\n", origin);
+    }
     fprintf(output, "\t movl\t%%eax, 28(%%esp)\n");
+    if(prefix->cells){
+        fprintf(output, "\t movl\t%%eax, (%%esp)\n");
+        fprintf(output, "\t movl\t$bf_tape, 4(%%esp)\n");
+        fprintf(output, "\t movl\t$%zu, 8(%%esp)\n", prefix->cells);
+        fprintf(output, "\t call\tmemcpy\n");
+    }
+    if(prefix->out_length){
+        fprintf(output, "\t movl\t$bf_text, (%%esp)\n");
+        fprintf(output, "\t movl\t$%zu, 4(%%esp)\n", prefix->out_length);
+        fprintf(output, "\t call\tbf_write\n");
+    }
     fprintf(output, "\t movl\t28(%%esp), %%eax\n");
     fprintf(output, "\t movl\t%%eax, (%%esp)\n");
     fprintf(output, "\t call\tbf_prog\n");
+    fprintf(output, "\t call\tbf_flush\n");
     fprintf(output, "\t movl\t$0, %%eax\n");
     fprintf(output, "\t leave\n");
     fprintf(output, "\t ret\n");
     fprintf(output, "\t .size\tmain, .-main\n");
+    bfcc_emit_runtime32(output, flush);
+    bfcc_emit_prefix(output, prefix);
+    bfcc_emit_consts(output, ir);
     fprintf(output, "\t .ident\t\"bfcc 1.0.0\"\n");
     fprintf(output, "\t .section\t.note.GNU-stack,\"\",@progbits\n");
     
 }
 
-void bfcc_gen64(FILE *output, list_t *parse_lst, char *filename){
-    //XXX
-
+int32_t gen64_find_slot(gen64_cache_t *cache, int32_t offset){
+    /* Returns the slot caching the cell at offset from the data pointer, or
+     * -1 if that cell isn't cached. */
+    for(int32_t i = 0; i < GEN64_SLOTS; i++){
+        if(cache->valid[i] && cache->offs[i] == offset){
+            cache->stamp[i] = ++cache->clock;
+            return i;
+        }
+    }
+    return -1;
 }
 
-list_t *bfopt_combine_arith(list_t *parse_lst){
-    //Combine repeated arithmetic and ptr ops.
-    if(parse_lst->length < 2){
-        return parse_lst;
+int32_t gen64_alloc_slot(gen64_cache_t *cache, int32_t offset){
+    /* Claims a slot for the cell at offset, evicting the least recently used
+     * one if they're all taken. Stores are write-through, so eviction never
+     * has to emit anything. */
+    int32_t slot = 0;
+    for(int32_t i = 0; i < GEN64_SLOTS; i++){
+        if(!cache->valid[i]){
+            slot = i;
+            break;
+        }
+        if(cache->stamp[i] < cache->stamp[slot]){
+            slot = i;
+        }
     }
-    int32_t curr_type, next_type;
-    bfop_t *curr_op, *next_op;
-
-    node_t *node = parse_lst->head->next;
-    next_op = (bfop_t *)node->data;
-    next_type = bfop_type(next_op->opcode);
+    cache->valid[slot] = 1;
+    cache->offs[slot] = offset;
+    cache->stamp[slot] = ++cache->clock;
+    return slot;
+}
 
-    while(node != parse_lst->head && node->next != parse_lst->head){
-        curr_op = (bfop_t *)node->data;
-        next_op = (bfop_t *)node->next->data;
+void gen64_invalidate(gen64_cache_t *cache){
+    for(int32_t i = 0; i < GEN64_SLOTS; i++){
+        cache->valid[i] = 0;
+    }
+}
 
-        curr_type = bfop_type(curr_op->opcode);
-        next_type = bfop_type(next_op->opcode);
+void gen64_move(gen64_cache_t *cache, int32_t diff){
+    //Data pointer moved by diff; cached cells are now that much closer.
+    for(int32_t i = 0; i < GEN64_SLOTS; i++){
+        cache->offs[i] -= diff;
+    }
+}
 
-        if(curr_type != next_type || (curr_type != T_PTR && curr_type != T_ARITH)){
-            node = node->next;
-            continue;
-        }
+int32_t gen64_load(FILE *output, gen64_cache_t *cache, char **val_regs, int32_t offset){
+    //Returns a slot holding the cell at offset, loading it if needed.
+    int32_t slot = gen64_find_slot(cache, offset);
+    if(slot < 0){
+        slot = gen64_alloc_slot(cache, offset);
+        fprintf(output, "\t movzbl\t%d(%%rbx), %%%s\n", offset, val_regs[slot]);
+    }
+    return slot;
+}
 
-        int32_t op1 = curr_op->opcode;
-        int32_t op2 = next_op->opcode;
-        bfop_t *r1 = NULL, *r2 = NULL;
-        switch(op1){
+void bfcc_gen64(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename){
+    /* Generate x86-64 code for the SysV ABI, starting from prefix's tape and
+     * output, origin cells into the tape. */
+    if(origin >= (size_t)BFCC_TAPE_SIZE64){
+        CriticalError("Origin past the end of the tape");
+    }
+    fprintf(output, "\t .file\t\"%s\"\n", filename);
+    fprintf(output, "\t .text\n.globl bf_prog\n\t .type\t bf_prog, @function\n");
+    fprintf(output, "bf_prog:\n");
+    fprintf(output, "\t pushq\t%%rbx\n");
+    fprintf(output, "\t pushq\t%%rbp\n");
+    fprintf(output, "\t pushq\t%%r12\n");
+    fprintf(output, "\t pushq\t%%r13\n");
+    fprintf(output, "\t pushq\t%%r14\n");
+    fprintf(output, "\t pushq\t%%r15\n");
+    fprintf(output, "\t subq\t$8, %%rsp\n");
+    fprintf(output, "\t movq\t%%rdi, %%rbx\n");
+
+    /* The data pointer lives in rbx. Cell values are cached in the remaining
+     * callee-save registers so they survive calls into libc, and each slot
+     * remembers where its cell is relative to rbx. */
+    char *val_regs[] = {"r12d", "r13d", "r14d", "r15d", "ebp"};
+    char *val_bregs[] = {"r12b", "r13b", "r14b", "r15b", "bpl"};
+    gen64_cache_t cache, guard;
+    memset(&cache, 0, sizeof(cache));
+    memset(&guard, 0, sizeof(guard));
+
+    int32_t slot, target, diff, mask, mul_runs = 0, scans = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        switch(op->opcode){
             case INC:
-                switch(op2){
-                    case INC:
-                        curr_op->opcode = INCV;
-                        curr_op->arg = 2;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                    case INCV:
-                        curr_op->opcode = INCV;
-                        curr_op->arg = 1 + next_op->arg;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                    case DEC:
-                        node = node->next->next;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        r2 = (bfop_t *)list_remove(node);
-                        break;
-                    case DECV:
-                        curr_op->opcode = DECV;
-                        curr_op->arg = next_op->arg - 1;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                }
-                break;
-            case DEC:
-                switch(op2){
-                     case INC:
-                        node = node->next->next;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        r2 = (bfop_t *)list_remove(node);
-                        break;
-                    case INCV:
-                        curr_op->opcode = INCV;
-                        curr_op->arg = next_op->arg - 1;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                    case DEC:
-                        curr_op->opcode = DECV;
-                        curr_op->arg = 2;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                    case DECV:
-                        curr_op->opcode = DECV;
-                        curr_op->arg = next_op->arg + 1;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                }
-                break;
             case INCV:
-                switch(op2){
-                    case INC:
-                        curr_op->arg = curr_op->arg + 1;
-                        break;
-                    case INCV:
-                        curr_op->arg = curr_op->arg + next_op->arg;
-                        break;
-                    case DEC:
-                        curr_op->arg = curr_op->arg - 1;
-                        break;
-                    case DECV:
-                        curr_op->arg = curr_op->arg - next_op->arg;
-                        break;
-                }
-                r1 = (bfop_t *)list_remove(node->next);
-                break;
+            case DEC:
             case DECV:
-                switch(op2){
-                    case INC:
-                        curr_op->arg = curr_op->arg - 1;
-                        break;
-                    case INCV:
-                        curr_op->arg = curr_op->arg - next_op->arg;
-                        break;
-                    case DEC:
-                        curr_op->arg = curr_op->arg + 1;
-                        break;
-                    case DECV:
-                        curr_op->arg = curr_op->arg + next_op->arg;
-                        break;
-                }
-                r1 = (bfop_t *)list_remove(node->next);
+                diff = op->opcode == INC ? 1 : op->opcode == DEC ? -1
+                    : op->opcode == INCV ? op->arg : -(op->arg);
+                fprintf(output, "\t addq\t$%d, %%rbx\n", diff);
+                gen64_move(&cache, diff);
                 break;
             case ADD:
-                switch(op2){
-                    case ADD:
-                        curr_op->opcode = ADDV;
-                        curr_op->arg = 2;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                    case ADDV:
-                        curr_op->opcode = ADDV;
-                        curr_op->arg = 1 + next_op->arg;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                    case SUB:
-                        node = node->next->next;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        r2 = (bfop_t *)list_remove(node);
-                        break;
-                    case SUBV:
-                        curr_op->opcode = SUBV;
-                        curr_op->arg = next_op->arg - 1;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                }
-                break;
             case ADDV:
-                switch(op2){
-                    case ADD:
-                        curr_op->arg = 1 + curr_op->arg;
-                        break;
-                    case ADDV:
-                        curr_op->arg = next_op->arg + curr_op->arg;
-                        break;
-                    case SUB:
-                        curr_op->arg = curr_op->arg - 1;
-                        break;
-                    case SUBV:
-                        curr_op->arg = curr_op->arg - next_op->arg;
-                        break;
-
-                }
-                r1 = (bfop_t *)list_remove(node->next);
-                break;
             case SUB:
-                switch(op2){
-                    case ADD:
-                        node = node->next->next;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        r2 = (bfop_t *)list_remove(node);
-                        break;
-                    case ADDV:
-                        curr_op->opcode = ADDV;
-                        curr_op->arg = next_op->arg - 1;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                    case SUB:
-                        curr_op->opcode = SUBV;
-                        curr_op->arg = 2;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                    case SUBV:
-                        curr_op->opcode = SUBV;
-                        curr_op->arg = 1 + next_op->arg;
-                        r1 = (bfop_t *)list_remove(node->next);
-                        break;
-                }
-                break;
             case SUBV:
-                switch(op2){
-                    case ADD:
-                        curr_op->arg = curr_op->arg - 1;
-                        break;
-                    case ADDV:
-                        curr_op->arg = curr_op->arg - next_op->arg;
-                        break;
-                    case SUB:
-                        curr_op->arg = 1 + curr_op->arg;
-                        break;
-                    case SUBV:
-                        curr_op->arg = next_op->arg + curr_op->arg;
-                        break;
-                }
-                r1 = (bfop_t *)list_remove(node->next);
+                diff = op->opcode == ADD ? 1 : op->opcode == SUB ? -1
+                    : op->opcode == ADDV ? op->arg : -(op->arg);
+                slot = gen64_load(output, &cache, val_regs, op->off);
+                fprintf(output, "\t addb\t$%d, %%%s\n", (int8_t)diff, val_bregs[slot]);
+                fprintf(output, "\t movb\t%%%s, %d(%%rbx)\n", val_bregs[slot], op->off);
                 break;
-        }
-        /* In case there are bfop_t's that we removed, free them */
-        if(r1 != NULL){
-            free(r1);
-        }
-        if(r2 != NULL){
-            free(r2);
-        }
-    }
-
-    /*Need to do a quick sanity check to finish up here */
-    node = parse_lst->head->next;
-    while(node != parse_lst->head){
-        curr_op = (bfop_t *)node->data;
-        switch(curr_op->opcode){
-            case ADDV:
-                if(curr_op->arg < 0){
-                    curr_op->opcode = curr_op->arg == -1 ? SUB : SUBV;
-                    curr_op->arg = -(curr_op->arg);
-                }else if(curr_op->arg == 0){
-                    node = node->next;
-                    free(list_remove(node));
-                    break;
-                }else if(curr_op->arg == 1){
-                    curr_op->opcode = ADD;
+            case ZERO:
+                slot = gen64_find_slot(&cache, op->off);
+                if(slot < 0){
+                    slot = gen64_alloc_slot(&cache, op->off);
                 }
-                node = node->next;
+                fprintf(output, "\t xorl\t%%%s, %%%s\n", val_regs[slot],
+                    val_regs[slot]);
+                fprintf(output, "\t movb\t$0, %d(%%rbx)\n", op->off);
                 break;
-            case SUBV:
-                if(curr_op->arg < 0){
-                    curr_op->opcode = curr_op->arg == -1 ? ADD : ADDV;
-                    curr_op->arg = -(curr_op->arg);
-                }else if(curr_op->arg == 0){
-                    node = node->next;
-                    free(list_remove(node));
-                    break;
-                }else if(curr_op->arg == 1){
-                    curr_op->opcode = SUB;
+            case MUL:
+                /* A run of MULs is skipped as a whole when the loop cell is
+                 * zero, as the loop would have been, so targets outside the
+                 * tape are never touched. Loading the loop cell first also
+                 * makes it the most recently used slot, so claiming a target
+                 * can't evict it. */
+                slot = gen64_load(output, &cache, val_regs, 0);
+                if(i == 0 || ir->ops[i - 1].opcode != MUL){
+                    guard = cache;
+                    fprintf(output, "\t testb\t%%%s, %%%s\n", val_bregs[slot],
+                        val_bregs[slot]);
+                    fprintf(output, "\t jz\t.M%d\n", mul_runs);
                 }
-                node = node->next;
-                break;
-            case INCV:
-                if(curr_op->arg < 0){
-                    curr_op->opcode = curr_op->arg == -1 ? DEC : DECV;
-                    curr_op->arg = -(curr_op->arg);
-                }else if(curr_op->arg == 0){
-                    node = node->next;
-                    free(list_remove(node));
-                    break;
-                }else if(curr_op->arg == 1){
-                    curr_op->opcode = INC;
+                target = gen64_find_slot(&cache, op->off);
+                if(target < 0){
+                    target = gen64_alloc_slot(&cache, op->off);
+                    fprintf(output, "\t movzbl\t%d(%%rbx), %%%s\n", op->off,
+                        val_regs[target]);
                 }
-                node = node->next;
-                break;
-            case DECV:
-                if(curr_op->arg < 0){
-                    curr_op->opcode = curr_op->arg == -1 ? INC : INCV;
-                    curr_op->arg = -(curr_op->arg);
-                }else if(curr_op->arg == 0){
-                    node = node->next;
-                    free(list_remove(node));
-                    break;
-                }else if(curr_op->arg == 1){
-                    curr_op->opcode = DEC;
+                if(op->arg == 1 || op->arg == -1){
+                    fprintf(output, "\t %s\t%%%s, %%%s\n", op->arg == 1 ? "addb" : "subb",
+                        val_bregs[slot], val_bregs[target]);
+                }else{
+                    fprintf(output, "\t imull\t$%d, %%%s, %%eax\n", op->arg,
+                        val_regs[slot]);
+                    fprintf(output, "\t addb\t%%al, %%%s\n", val_bregs[target]);
                 }
-                node = node->next;
-                break;
-
-            default:
-                node = node->next;
-                break;
-        }
-    }
-
-    return parse_lst;
-}
-
-int32_t bfop_structural_eq(const void *op1, const void *op2){
-    bfop_t *lhs = (bfop_t *)op1;
-    bfop_t *rhs = (bfop_t *)op2;
-
-    if(lhs->opcode == rhs->opcode && lhs->arg == rhs->arg){
-        return 1;
-    }
-
-    switch(lhs->opcode){
-        case JZ:
-        case JNZ:
-        case LABEL:
-        case ZERO:
-        case PUT:
-        case GET:
-            return lhs->opcode == rhs->opcode;
-        case ADD:
-            return rhs->opcode == ADD || (rhs->opcode == ADDV && rhs->arg == 1)
-                    || (rhs->opcode == SUBV && rhs->arg == -1);
-        case SUB:
-            return rhs->opcode == SUB || (rhs->opcode == SUBV && rhs->arg == 1)
-                || (rhs->opcode == ADDV && rhs->arg == -1);
-        case INC:
-            return rhs->opcode == INC || (rhs->opcode == INCV && rhs->arg == 1)
-                || (rhs->opcode == DECV && rhs->arg == -1);
-        case DEC:
-            return rhs->opcode == DEC || (rhs->opcode == DECV && rhs->arg == 1)
-                || (rhs->opcode == INCV && rhs->arg == -1);
-        case ADDV:
-            if(rhs->opcode == ADD)
-                return lhs->arg == 1;
-            if(rhs->opcode == SUB)
-                return lhs->arg == -1;
-            if(rhs->opcode == SUBV)
-                return lhs->arg == -(rhs->arg);
-            break;
-        case SUBV:
-            if(rhs->opcode == SUB)
-                return lhs->arg == 1;
-            if(rhs->opcode == ADD)
-                return lhs->arg == -1;
-            if(rhs->opcode == ADDV)
-                return lhs->arg == -(rhs->arg);
-            break;
-        case INCV:
-            if(rhs->opcode == INC)
-                return lhs->arg == 1;
-            if(rhs->opcode == DEC)
-                return lhs->arg == -1;
-            if(rhs->opcode == DECV)
-                return lhs->arg == -(rhs->arg);
-            break;
-        case DECV:
-            if(rhs->opcode == DEC)
-                return lhs->arg == 1;
-            if(rhs->opcode == INC)
-                return lhs->arg == -1;
-            if(rhs->opcode == INCV)
-                return lhs->arg == -(rhs->arg);
-            break;
-
-    }
-    return 0;
-}
-
-list_t *bfopt_apply_filter(list_t *parse_lst, list_t *pattern, list_t *replace){
-    
-    /* Applies the filter described in pattern to the parse list. */
-    int32_t label = -1, replace_labels = 0;
-    node_t *node = parse_lst->head->next;
-    while(node != parse_lst->head){
-        /*Find the highest loop label so as to avoid labelling conflicts */
-        bfop_t *op = (bfop_t *)node->data;
-        if(op->opcode == LABEL && op->arg > label){
-            label = op->arg;
-        }
-        node = node->next;
-    }
-    label++;
-
-    /*Determine how many labels there are in the replace list. */
-    node = replace->head->next;
-    while(node != replace->head){
-        bfop_t *op = (bfop_t *)node->data;
-        if(op->opcode == LABEL)
-            replace_labels++;
-
-        node = node->next;
-    }
-
-    node = parse_lst->head->next;
-    node_t *leader = node;
-    for(int i = 1; i < pattern->length; i++){
-        leader = leader->next;
-        if(leader == parse_lst->head){
-            break;
-        }
-    }
-    while(leader != parse_lst->head){
-        int32_t match = list_match(parse_lst, node, pattern, pattern->head->next,
-                            bfop_structural_eq, pattern->length);
-
-        if(match){
-            node_t *last = node->prev;
-            for(int j = 0; j < pattern->length; j++){
-                free(list_remove(last->next));
-            }
-            last = last->next;
-            node_t *foo = replace->head->next;
-            while(foo != replace->head){
-                bfop_t *fop = (bfop_t *)foo->data;
-                int32_t farg = fop->arg;
-                if(bfop_type(fop->opcode) == T_BRANCH){
-                    farg += label;
+                fprintf(output, "\t movb\t%%%s, %d(%%rbx)\n", val_bregs[target], op->off);
+                if(i + 1 == ir->length || ir->ops[i + 1].opcode != MUL){
+                    /* Slots still caching what they did before the run hold
+                     * the right value either way; newly claimed ones don't */
+                    fprintf(output, ".M%d:\n", mul_runs++);
+                    for(int32_t k = 0; k < GEN64_SLOTS; k++){
+                        if(!guard.valid[k] || guard.offs[k] != cache.offs[k]){
+                            cache.valid[k] = 0;
+                        }
+                    }
                 }
-
-                list_insertbefore(last, bfop_new(fop->opcode, farg));
-                foo = foo->next;
-            }
-            label += replace_labels;
-            node = last;
-            leader = node;
-            for(int i = 1; i < pattern->length; i++){
-                leader = leader->next;
-                if(leader == parse_lst->head){
-                    break;
+                break;
+            case SCAN:
+                /* Strides dividing 16 compare a block of 16 cells at once and
+                 * mask off the cells the loop would have stepped over, while
+                 * the whole block is on the tape, as bfx64_scan does. Near
+                 * the ends, and for other strides, the scan steps one cell
+                 * at a time, so it only touches the cells the loop would. */
+                mask = bfx64_scan_mask(op->arg);
+                if(mask){
+                    fprintf(output, "\t pxor\t%%xmm1, %%xmm1\n");
+                    fprintf(output, ".S%d:\n", scans);
+                    if(op->arg > 0){
+                        fprintf(output, "\t leaq\t16(%%rbx), %%rax\n");
+                        fprintf(output, "\t cmpq\tbf_tape_hi(%%rip), %%rax\n");
+                        fprintf(output, "\t ja\t.U%d\n", scans);
+                        fprintf(output, "\t movdqu\t(%%rbx), %%xmm0\n");
+                    }else{
+                        fprintf(output, "\t leaq\t-15(%%rbx), %%rax\n");
+                        fprintf(output, "\t cmpq\tbf_tape_lo(%%rip), %%rax\n");
+                        fprintf(output, "\t jb\t.U%d\n", scans);
+                        fprintf(output, "\t movdqu\t-15(%%rbx), %%xmm0\n");
+                    }
+                    fprintf(output, "\t pcmpeqb\t%%xmm1, %%xmm0\n");
+                    fprintf(output, "\t pmovmskb\t%%xmm0, %%eax\n");
+                    fprintf(output, "\t andl\t$%d, %%eax\n", mask);
+                    fprintf(output, "\t jnz\t.V%d\n", scans);
+                    fprintf(output, "\t addq\t$%d, %%rbx\n", op->arg > 0 ? 16 : -16);
+                    fprintf(output, "\t jmp\t.S%d\n", scans);
+                    fprintf(output, ".V%d:\n", scans);
+                    if(op->arg > 0){
+                        fprintf(output, "\t bsfl\t%%eax, %%eax\n");
+                        fprintf(output, "\t addq\t%%rax, %%rbx\n");
+                    }else{
+                        fprintf(output, "\t bsrl\t%%eax, %%eax\n");
+                        fprintf(output, "\t leaq\t-15(%%rbx,%%rax), %%rbx\n");
+                    }
+                    fprintf(output, "\t jmp\t.T%d\n", scans);
                 }
-            }
-        }else{
-            node = node->next;
-            leader = leader->next;
-        }
-    }
-    return parse_lst;
-}
-
-list_t *bfopt_make_zeros(list_t *parse_lst){
-    list_t pattern, replace;
-    list_init(&pattern);
-    list_init(&replace);
-
-    list_addlast(&pattern, bfop_new(JZ, 0));
-    list_addlast(&pattern, bfop_new(LABEL, 1));
-    list_addlast(&pattern, bfop_new(SUB, 0));
-    list_addlast(&pattern, bfop_new(JNZ, 1));
-    list_addlast(&pattern, bfop_new(LABEL, 0));
-
-    list_addfirst(&replace, bfop_new(ZERO, 0));
-
-    bfopt_apply_filter(parse_lst, &pattern, &replace);
-
-    list_clear(&pattern, 1);
-    list_clear(&replace, 1);
-    return parse_lst;
-}
-
-void load_filter(FILE *input, list_t *pattern, list_t *replace){
-    char buf[24];
-    char *commands[] = {
-        "inc",
-        "incv", 
-        "dec", 
-        "decv", 
-        "add",
-        "addv",
-        "sub",
-        "subv",
-        "put",
-        "get",
-        "jnz",
-        "jz",
-        "zero"
-    };
-    int32_t opcodes[] = {INC, INCV, DEC, DECV, ADD, ADDV, SUB, SUBV, PUT, GET,
-                            JNZ, JZ, ZERO};
-    int32_t length = sizeof(opcodes) / sizeof(opcodes[0]);
-    int32_t cmd, arg;
-
-    /* Burn the first input line; should be "pattern" */
-    fscanf(input, "%s", buf);
-    
-    while(fscanf(input, "%s", buf) != EOF){
-        if(!strcmp(buf, "replace")){
-            break;
-        }
-        cmd = LABEL;
-        for(int i = 0; i < length; i++){
-            if(!strcmp(buf, commands[i])){
-                cmd = opcodes[i];
-                arg = 0;
+                fprintf(output, ".U%d:\n", scans);
+                fprintf(output, "\t cmpb\t$0, (%%rbx)\n");
+                fprintf(output, "\t jz\t.T%d\n", scans);
+                fprintf(output, "\t addq\t$%d, %%rbx\n", op->arg);
+                fprintf(output, "\t jmp\t.U%d\n", scans);
+                fprintf(output, ".T%d:\n", scans++);
+                gen64_invalidate(&cache);
                 break;
-            }
-        }
-        switch(cmd){
-            case INCV:
-            case DECV:
-            case ADDV:
-            case SUBV:
-                fscanf(input, "%d", &arg);
+            case LABEL:
+                /* Anything can jump here, so nothing cached survives */
+                fprintf(output, ".L%d:\n", op->arg);
+                gen64_invalidate(&cache);
                 break;
             case JNZ:
             case JZ:
-                fscanf(input, " L%d", &arg);
-                break;
-            case LABEL:
-                sscanf(buf, "L%d:", &arg);
-                break;
-        }
-
-        list_addlast(pattern, bfop_new(cmd, arg));
-    }
-    while(fscanf(input, "%s", buf) != EOF){
-        cmd = LABEL;
-        for(int i = 0; i< length; i++){
-            if(!strcmp(buf, commands[i])){
-                cmd = opcodes[i];
-                arg = 0;
+                slot = gen64_find_slot(&cache, 0);
+                if(slot >= 0){
+                    fprintf(output, "\t testb\t%%%s, %%%s\n", val_bregs[slot],
+                        val_bregs[slot]);
+                }else{
+                    fprintf(output, "\t cmpb\t$0, (%%rbx)\n");
+                }
+                fprintf(output, "\t %s\t.L%d\n", op->opcode == JZ ? "jz" : "jnz",
+                    op->arg);
                 break;
-            }
-        }
-        switch(cmd){
-            case INCV:
-            case DECV:
-            case ADDV:
-            case SUBV:
-                fscanf(input, " %d", &arg);
+            case PUT:
+                slot = gen64_find_slot(&cache, op->off);
+                if(slot >= 0){
+                    fprintf(output, "\t movzbl\t%%%s, %%edi\n", val_bregs[slot]);
+                }else{
+                    fprintf(output, "\t movzbl\t%d(%%rbx), %%edi\n", op->off);
+                }
+                fprintf(output, "\t call\tbf_put\n");
                 break;
-            case JNZ:
-            case JZ:
-                fscanf(input, " L%d", &arg);
+            case WRITE_CONST:
+                /* Cached values are in callee-save registers, so they
+                 * survive the call */
+                if(op->off == 1){
+                    fprintf(output, "\t movl\t$%u, %%edi\n", ir->data[op->arg]);
+                    fprintf(output, "\t call\tbf_put\n");
+                }else{
+                    fprintf(output, "\t leaq\tbf_const+%d(%%rip), %%rdi\n", op->arg);
+                    fprintf(output, "\t movl\t$%d, %%esi\n", op->off);
+                    fprintf(output, "\t call\tbf_write\n");
+                }
                 break;
-            case LABEL:
-                sscanf(buf, "L%d:", &arg);
+            case GET:
+                fprintf(output, "\t call\tbf_get\n");
+                fprintf(output, "\t movb\t%%al, %d(%%rbx)\n", op->off);
+                slot = gen64_find_slot(&cache, op->off);
+                if(slot < 0){
+                    slot = gen64_alloc_slot(&cache, op->off);
+                }
+                fprintf(output, "\t movzbl\t%%al, %%%s\n", val_regs[slot]);
                 break;
-           
         }
-        list_addlast(replace, bfop_new(cmd, arg));
     }
-}
 
-void apply_filter_file(char *filename, list_t *parse_lst){
-    FILE *input = fopen(filename, "r");
-    if(!input){
-        CriticalError("Could not open file");
+    /* Finish up the bf program function and fill in main */
+    fprintf(output, "\t addq\t$8, %%rsp\n");
+    fprintf(output, "\t popq\t%%r15\n");
+    fprintf(output, "\t popq\t%%r14\n");
+    fprintf(output, "\t popq\t%%r13\n");
+    fprintf(output, "\t popq\t%%r12\n");
+    fprintf(output, "\t popq\t%%rbp\n");
+    fprintf(output, "\t popq\t%%rbx\n");
+    fprintf(output, "\t ret\n\t .size\tbf_prog, .-bf_prog\n");
+    fprintf(output, ".globl main\n\t .type\tmain, @function\nmain:\n");
+    fprintf(output, "\t pushq\t%%rbx\n");
+    fprintf(output, "\t call\tbf_tape_map\n");
+    fprintf(output, "\t testq\t%%rax, %%rax\n");
+    fprintf(output, "\t jz\t.Rcalloc\n");
+    fprintf(output, "\t movabsq\t$%" PRId64 ", %%rcx\n", BFCC_TAPE_SIZE64);
+    fprintf(output, "\t jmp\t.Rtaped\n");
+    fprintf(output, ".Rcalloc:\n");
+    fprintf(output, "\t movl\t$1, %%esi\n");
+    fprintf(output, "\t movabsq\t$%zu, %%rdi\n", 30000 + origin);
+    fprintf(output, "\t call\tcalloc@PLT\n");
+    fprintf(output, "\t movabsq\t$%zu, %%rcx\n", 30000 + origin);
+    fprintf(output, ".Rtaped:\n");
+    /* The tape's ends, for the block scans */
+    fprintf(output, "\t movq\t%%rax, %%rbx\n");
+    fprintf(output, "\t movq\t%%rax, bf_tape_lo(%%rip)\n");
+    fprintf(output, "\t addq\t%%rax, %%rcx\n");
+    fprintf(output, "\t movq\t%%rcx, bf_tape_hi(%%rip)\n");
+    if(origin){
+        /* Start origin cells in, which the program is free to walk back
+         * over */
+        fprintf(output, "\t movabsq\t$%zu, %%rax\n", origin);
+        fprintf(output, "\t addq\t%%rax, %%rbx\n");
     }
-
-    list_t pattern, replace;
-    list_init(&pattern);
-    list_init(&replace);
-
-    load_filter(input, &pattern, &replace);
-    bfopt_apply_filter(parse_lst, &pattern, &replace);
-
-    list_clear(&replace, 1);
-    list_clear(&pattern, 1);
+    if(prefix->cells){
+        fprintf(output, "\t movq\t%%rbx, %%rdi\n");
+        fprintf(output, "\t leaq\tbf_tape(%%rip), %%rsi\n");
+        fprintf(output, "\t movl\t$%zu, %%edx\n", prefix->cells);
+        fprintf(output, "\t call\tmemcpy@PLT\n");
+    }
+    if(prefix->out_length){
+        fprintf(output, "\t leaq\tbf_text(%%rip), %%rdi\n");
+        fprintf(output, "\t movl\t$%zu, %%esi\n", prefix->out_length);
+        fprintf(output, "\t call\tbf_write\n");
+    }
+    fprintf(output, "\t movq\t%%rbx, %%rdi\n");
+    fprintf(output, "\t call\tbf_prog\n");
+    fprintf(output, "\t call\tbf_flush\n");
+    fprintf(output, "\t xorl\t%%eax, %%eax\n");
+    fprintf(output, "\t popq\t%%rbx\n");
+    fprintf(output, "\t ret\n");
+    fprintf(output, "\t .size\tmain, .-main\n");
+    bfcc_emit_runtime64(output, flush);
+    bfcc_emit_prefix(output, prefix);
+    bfcc_emit_consts(output, ir);
+    fprintf(output, "\t .ident\t\"bfcc 1.0.0\"\n");
+    fprintf(output, "\t .section\t.note.GNU-stack,\"\",@progbits\n");
 }
 
+
 void exec_and_block(const char *filename, const char *argv[], const char *envp[]){
     int i = 0;
     const char *arg;
@@ -919,6 +1457,112 @@ void exec_and_block(const char *filename, const char *argv[], const char *envp[]
     }
 }
 
+void bfcc_report(FILE *output, int32_t format, const bfopt_stats_t *parse,
+        const bfopt_pipeline_t *pipeline, const bfopt_filters_t *filters,
+        const bfopt_stats_t *codegen, const bfopt_stats_t *gcc){
+    /* Prints where the compile went: each stage that ran with its time, op
+     * counts and the peak memory use at its end, then how many times each
+     * filter fired. Ops out is left out for the stages that don't make IR. */
+    const char *names[BFOPT_MAX_PASSES + 3];
+    const bfopt_stats_t *stats[BFOPT_MAX_PASSES + 3];
+    int32_t count = 0;
+    double total = 0.0;
+    long peak = 0;
+
+    names[count] = "parse";
+    stats[count++] = parse;
+    for(int32_t i = 0; i < pipeline->count; i++){
+        names[count] = pipeline->passes[i].name;
+        stats[count++] = &pipeline->passes[i].stats;
+    }
+    names[count] = "codegen";
+    stats[count++] = codegen;
+    names[count] = "gcc";
+    stats[count++] = gcc;
+
+    int32_t json = format == BFCC_REPORT_JSON;
+    int32_t first = 1;
+    if(json){
+        fprintf(output, "{\n  \"stages\": [");
+    }else{
+        fprintf(output, "%-10s %6s %10s %10s %10s %10s\n", "stage", "runs",
+            "time ms", "ops in", "ops out", "peak KB");
+    }
+    for(int32_t i = 0; i < count; i++){
+        const bfopt_stats_t *st = stats[i];
+        if(!st->runs){
+            continue;
+        }
+        int32_t has_out = st != codegen && st != gcc;
+        total += st->seconds;
+        peak = st->peak_kb > peak ? st->peak_kb : peak;
+        if(json){
+            fprintf(output, "%s\n    {\"name\": \"%s\", \"runs\": %d, \"ms\": %.3f, "
+                "\"ops_in\": %zu, ", first ? "" : ",", names[i], st->runs,
+                st->seconds * 1e3, st->ops_in);
+            if(has_out){
+                fprintf(output, "\"ops_out\": %zu, ", st->ops_out);
+            }else{
+                fprintf(output, "\"ops_out\": null, ");
+            }
+            fprintf(output, "\"peak_kb\": %ld}", st->peak_kb);
+        }else{
+            fprintf(output, "%-10s %6d %10.3f %10zu ", names[i], st->runs,
+                st->seconds * 1e3, st->ops_in);
+            if(has_out){
+                fprintf(output, "%10zu", st->ops_out);
+            }else{
+                fprintf(output, "%10s", "-");
+            }
+            fprintf(output, " %10ld\n", st->peak_kb);
+        }
+        first = 0;
+    }
+
+    if(json){
+        fprintf(output, "\n  ],\n  \"total_ms\": %.3f,\n  \"peak_kb\": %ld,\n"
+            "  \"filters\": [", total * 1e3, peak);
+    }else{
+        fprintf(output, "%-10s %6s %10.3f %10s %10s %10ld\n\n%-40s %10s\n", "total",
+            "", total * 1e3, "", "", peak, "filter", "hits");
+    }
+    for(size_t i = 0; i < filters->count; i++){
+        const bfopt_filter_t *f = &filters->filters[i];
+        if(json){
+            fprintf(output, "%s\n    {\"name\": \"", i ? "," : "");
+            for(const char *c = f->origin ? f->origin : "built in"; *c; c++){
+                if(*c == '"' || *c == '\\'){
+                    fputc('\\', output);
+                }
+                fputc(*c, output);
+            }
+            fprintf(output, "\", \"hits\": %zu}", f->hits);
+        }else{
+            fprintf(output, "%-40s %10zu\n", f->origin ? f->origin : "built in", f->hits);
+        }
+    }
+    if(json){
+        fprintf(output, "%s]\n}\n", filters->count ? "\n  " : "");
+    }
+}
+
+static bfir_t *bfcc_pass_eval(bfir_t *ir, void *data){
+    //Runs whatever doesn't depend on input now.
+    bfcc_eval_t *eval = data;
+    bfeval_free(&eval->prefix);
+    bfeval_prefix(ir, &eval->prefix, BFEVAL_STEPS);
+    return bfeval_resume(ir, &eval->prefix, eval->bake);
+}
+
+static bfir_t *bfcc_pass_fold(bfir_t *ir, void *data){
+    //Prints text the program can work out ahead of time in single writes.
+    bfcc_eval_t *eval = data;
+    if(!eval->bake){
+        return ir;
+    }
+    return bfopt_fold_output(ir, eval->prefix.tape, eval->prefix.cells);
+}
+
 int main(int argc, char **argv){
     char *filters[] = {
         "filters/zero.flt"
@@ -926,35 +1570,56 @@ int main(int argc, char **argv){
     size_t filter_length = sizeof(filters) / sizeof(filters[0]);
     char *output_fname, *output_fdup;
     int32_t verbose = 0;
-    int32_t opt_level;
-    int32_t output_mode = -1;
-    void (*codegen)(FILE *, list_t *, char *);
-
-    /* If we compiled the compiler 64-bit, we probably want to compile brainfuck
-     * to 64-bit also, and likewise for 32-bit */
-#ifdef __LP64__
+    int32_t opt_level = BFOPT_MAX_LEVEL;
+    char **pass_flags = alloca(argc * sizeof(char *));
+    int32_t pass_flag_count = 0;
+    int32_t output_mode;
+    int32_t flush = BFCC_FLUSH_INPUT;
+    size_t origin = 0;
+    long level;
+    char *end;
+    void (*codegen)(FILE *, bfir_t *, const bfeval_t *, int32_t, size_t, char *);
+
+    /* On x86-64 Linux bfcc writes the executable itself. Otherwise, if we
+     * compiled the compiler 64-bit, we probably want to compile brainfuck to
+     * 64-bit also, and likewise for 32-bit */
+#if defined(__x86_64__) && defined(__linux__)
+    codegen = bfelf_write;
+    output_mode = BFCCOUT_ELF;
+#elif defined(__LP64__)
     codegen = bfcc_gen64;
+    output_mode = BFCCOUT_64BIT;
 #else
     codegen = bfcc_gen32;
-#endif
-#if 1
-    /* XXX Get rid of this when bfcc_gen64 is finished */
-    codegen = bfcc_gen32;
+    output_mode = BFCCOUT_32BIT;
 #endif
 
     struct option long_options[] = {
-        {"verbose", no_argument, NULL, 'v'},
+        {"verbose", optional_argument, NULL, 'v'},
         {"m32", no_argument, NULL, 'l'},
         {"m64", no_argument, NULL, 'q'},
-        {"bytecode", no_argument, NULL, 'b'}
+        {"bytecode", no_argument, NULL, 'b'},
+        {"binary", no_argument, NULL, 'B'},
+        {"elf", no_argument, NULL, 'e'},
+        {"flush", required_argument, NULL, 'F'},
+        {"origin", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}
     };
     int option_index = 0;
 
     char c;
-    while((c = getopt_long_only(argc, argv, "vbO:", long_options, &option_index)) != -1){
+    while((c = getopt_long_only(argc, argv, "vbO:f:", long_options, &option_index)) != -1){
         switch(c){
             case 'v':
-                verbose = 1;
+                /* --verbose=json for the report in JSON on stdout */
+                if(!optarg || !strcmp(optarg, "text")){
+                    verbose = BFCC_REPORT_TEXT;
+                }else if(!strcmp(optarg, "json")){
+                    verbose = BFCC_REPORT_JSON;
+                }else{
+                    fprintf(stderr, "Unknown report format: %s\n", optarg);
+                    exit(1);
+                }
                 break;
             case 'l':
                 /* l option forces codegen = m32 */
@@ -970,8 +1635,49 @@ int main(int argc, char **argv){
                 codegen = bfcc_codegen;
                 output_mode = BFCCOUT_BYTECODE;
                 break;
+            case 'B':
+                /* Packed binary bytecode, mmap'd and run in place by bfi */
+                codegen = bfbin_write;
+                output_mode = BFCCOUT_BINARY;
+                break;
+            case 'e':
+                /* Static x86-64 executable, no assembler or linker needed */
+                codegen = bfelf_write;
+                output_mode = BFCCOUT_ELF;
+                break;
+            case 'F':
+                /* When the executable writes out its buffered output */
+                if(!strcmp(optarg, "exit")){
+                    flush = BFCC_FLUSH_EXIT;
+                }else if(!strcmp(optarg, "input")){
+                    flush = BFCC_FLUSH_INPUT;
+                }else if(!strcmp(optarg, "newline")){
+                    flush = BFCC_FLUSH_NEWLINE;
+                }else{
+                    fprintf(stderr, "Unknown flush policy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                /* Cells the executable's tape keeps left of the start */
+                origin = strtoull(optarg, &end, 10);
+                if(*end || optarg[0] == '-'){
+                    fprintf(stderr, "Bad origin: %s\n", optarg);
+                    exit(1);
+                }
+                break;
             case 'O':
-                opt_level = (int32_t)atoi(optarg);
+                level = strtol(optarg, &end, 10);
+                if(*end || end == optarg || level < 0 || level > BFOPT_MAX_LEVEL){
+                    fprintf(stderr, "Bad optimization level: %s\n", optarg);
+                    exit(1);
+                }
+                opt_level = (int32_t)level;
+                break;
+            case 'f':
+                /* -fPASS or -fno-PASS, applied once the pipeline exists so
+                 * they win over -O wherever they appear */
+                pass_flags[pass_flag_count++] = optarg;
                 break;
         }
     }
@@ -991,6 +1697,10 @@ int main(int argc, char **argv){
     intptr_t pi = (intptr_t)(p - output_fname);
     if(output_mode == BFCCOUT_BYTECODE){
         strcpy(output_fname + pi, ".bc");
+    }else if(output_mode == BFCCOUT_BINARY){
+        strcpy(output_fname + pi, ".bfb");
+    }else if(output_mode == BFCCOUT_ELF){
+        output_fname[pi] = '\0';
     }else{
         strcpy(output_fname + pi, ".s");
     }
@@ -1013,49 +1723,86 @@ int main(int argc, char **argv){
     program[f_len-1] = EOF;
     fclose(input);
 
-    list_t list;
-    list_init(&list);
+    bfir_t ir;
+    bfir_init(&ir);
 
-    bfcc_parse(program, &list);
-    bfopt_combine_arith(&list);
+    bfopt_stats_t parse_stats, codegen_stats, gcc_stats;
+    memset(&parse_stats, 0, sizeof(parse_stats));
+    memset(&codegen_stats, 0, sizeof(codegen_stats));
+    memset(&gcc_stats, 0, sizeof(gcc_stats));
+    double t0 = bfopt_clock();
+    bfcc_parse(program, &ir);
+    bfopt_stats_add(&parse_stats, 0, ir.length, bfopt_clock() - t0);
+    free(program);
 
+    bfopt_filters_t filter_set;
+    bfopt_filters_init(&filter_set);
     for(int i = 0; i<filter_length; i++){
-        apply_filter_file(filters[i], &list);
+        bfopt_filters_load(&filter_set, filters[i]);
+    }
+
+    /* Native code starts from the tape and output eval works out; bytecode
+     * gets them back as code, and can't hold the text fold writes out. */
+    bfcc_eval_t eval;
+    eval.bake = output_mode != BFCCOUT_BYTECODE && output_mode != BFCCOUT_BINARY;
+    bfeval_init(&eval.prefix);
+
+    bfopt_pipeline_t pipeline;
+    bfopt_pipeline_init(&pipeline, opt_level, &filter_set);
+    bfopt_pipeline_add(&pipeline, "eval", 3, 0, bfcc_pass_eval, &eval);
+    bfopt_pipeline_add(&pipeline, "fold", 3, 0, bfcc_pass_fold, &eval);
+    for(int i = 0; i < pass_flag_count; i++){
+        char *name = pass_flags[i];
+        int32_t enabled = strncmp(name, "no-", 3) != 0;
+        if(!bfopt_pipeline_set(&pipeline, enabled ? name : name + 3, enabled)){
+            fprintf(stderr, "Unknown pass: %s\n", name);
+            exit(1);
+        }
     }
+    bfopt_pipeline_run(&pipeline, &ir);
+    bfeval_t prefix = eval.prefix;
 
     FILE *output = fopen(output_fname, "w");
     if(!output){
         CriticalError("Could not open file");
     }
 
-    codegen(output, &list, output_fname);
+    t0 = bfopt_clock();
+    codegen(output, &ir, &prefix, flush, origin, output_fname);
     fclose(output);
-    list_clear(&list, 1);
+    bfopt_stats_add(&codegen_stats, ir.length, ir.length, bfopt_clock() - t0);
+    bfir_free(&ir);
+    bfeval_free(&prefix);
 
     const char *gcc_args[] = {
         "/usr/bin/gcc",
         "-o", 
         output_fdup,
         output_fname,
-        "-m32",         /* XXX Get rid of this when bfcc_gen64 is up */
+        "-m64",
         NULL
     };
-    if(output_mode == BFCCOUT_32BIT){
-        gcc_args[4] = "-m32";
-    }else if(output_mode == BFCCOUT_64BIT){
-        gcc_args[4]=  "-m64";
-    }else if(output_mode == BFCCOUT_BYTECODE){
-        return 0;
+    if(output_mode == BFCCOUT_32BIT || output_mode == BFCCOUT_64BIT){
+        if(output_mode == BFCCOUT_32BIT){
+            gcc_args[4] = "-m32";
+        }
+        t0 = bfopt_clock();
+        exec_and_block(gcc_args[0], gcc_args, (const char **)environ);
+        bfopt_stats_add(&gcc_stats, 0, 0, bfopt_clock() - t0);
+
+        const char *rm_args[] = {
+            "/bin/rm",
+            output_fname,
+            NULL
+        };
+        exec_and_block(rm_args[0], rm_args, (const char **)environ);
     }
-    exec_and_block(gcc_args[0], gcc_args, (const char **)environ);
-
-    const char *rm_args[] = {
-        "/bin/rm",
-        output_fname,
-        NULL
-    };
-    exec_and_block(rm_args[0], rm_args, (const char **)environ);
 
+    if(verbose){
+        bfcc_report(verbose == BFCC_REPORT_JSON ? stdout : stderr, verbose,
+            &parse_stats, &pipeline, &filter_set, &codegen_stats, &gcc_stats);
+    }
+    bfopt_filters_free(&filter_set);
     return 0;
 }
 
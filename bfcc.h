@@ -1,12 +1,18 @@
 /*Ken Sheedlo
  *brainfuck compiler includes and defs */
 
+#ifndef BFCC_H
+#define BFCC_H
+
 #include<alloca.h>
 #include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
 #include<getopt.h>
+#include<inttypes.h>
+#include<signal.h>
+#include<sys/mman.h>
 #include<sys/types.h>
 #include<sys/wait.h>
 #include<unistd.h>
@@ -14,36 +20,128 @@
 #include "error_handling.h"
 #include "list.h"
 #include "bfop.h"
+#include "bfopt.h"
+#include "bfbin.h"
+#include "bfelf.h"
+#include "bfeval.h"
 
 #define BFCCOUT_32BIT       0
 #define BFCCOUT_64BIT       1
 #define BFCCOUT_BYTECODE    2
+#define BFCCOUT_BINARY      3
+#define BFCCOUT_ELF         4
+
+/* --verbose report formats */
+#define BFCC_REPORT_TEXT    1
+#define BFCC_REPORT_JSON    2
+
+/* The assembly backends' I/O buffers */
+#define BFCC_OUTBUF_SIZE (1 << 16)
+#define BFCC_INBUF_SIZE (1 << 16)
+
+/* The assembly backends' tapes, reserved like bfi's bftape: zero filled as
+ * pages are touched, between guards where a touch reports ERR_BOUNDS before
+ * the tape and ERR_MEM past it. If the reservation is refused the program
+ * falls back to a small calloc'd tape. */
+#define BFCC_TAPE_SIZE64 ((int64_t)1 << 36)
+#define BFCC_GUARD64 ((int64_t)1 << 32)
+#define BFCC_TAPE_SIZE32 (1 << 28)
+#define BFCC_GUARD32 (1 << 24)
+
+/* Pointer/value register pairs gen32 can keep at once */
+#define GEN32_SLOTS 3
+
+/* gen32_loop_heads label kinds */
+#define GEN32_UNBALANCED 1
+#define GEN32_BALANCED 2
+
+/* How far bfcc_gen32 has got with a label */
+#define GEN32_PENDING 1     /* forward branches to it have been seen */
+#define GEN32_PASSED 2      /* its state is settled */
+
+/* What gen32's registers hold. A slot's pointer register points at the
+ * cell at locs, and its value register, if valid, holds that cell. A dirty
+ * value hasn't been written back yet, so memory can't be trusted for it. */
+typedef struct {
+    int32_t ptr_valid[GEN32_SLOTS];
+    int32_t val_valid[GEN32_SLOTS];
+    int32_t dirty[GEN32_SLOTS];
+    int32_t locs[GEN32_SLOTS];      /* only meaningful relative to curr's */
+    int32_t stamp[GEN32_SLOTS];     /* last use, for LRU eviction */
+    int32_t clock;
+    int32_t curr;                   /* slot holding the data pointer */
+} gen32_cache_t;
+
+/* Cell values gen64 can keep in registers at once */
+#define GEN64_SLOTS 5
 
 extern char **environ;
 
-/*Function definitions. */
-list_t *bfcc_parse(char *program, list_t *parse_lst);
+typedef struct {
+    int32_t valid[GEN64_SLOTS];
+    int32_t offs[GEN64_SLOTS];     /* cell offset from the data pointer */
+    int32_t stamp[GEN64_SLOTS];    /* last use, for LRU eviction */
+    int32_t clock;
+} gen64_cache_t;
 
-void bfcc_codegen(FILE *output, list_t *parse_lst, char *filename);
+/* The compile-time evaluation passes' shared state */
+typedef struct {
+    bfeval_t prefix;
+    int32_t bake;           /* the backend starts from prefix itself */
+} bfcc_eval_t;
 
-void bfcc_gen32(FILE *output, list_t *parse_lst, char *filename);
+/*Function definitions. */
+void bfcc_codegen(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename);
 
-void bfcc_gen64(FILE *output, list_t *parse_lst, char *filename);
+void bfcc_gen32(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename);
 
-list_t *bfopt_combine_arith(list_t *parse_lst);
+void bfcc_gen64(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename);
 
-list_t *bfopt_make_zeros(list_t *parse_lst);
+void bfcc_emit_runtime32(FILE *output, int32_t flush);
 
-list_t *bfopt_apply_filter(list_t *parse_lst, list_t *pattern, list_t *replace);
+void bfcc_emit_runtime64(FILE *output, int32_t flush);
 
-/*Compares op1, op2 for structural equality.*/
-int32_t bfop_structural_eq(const void *op1, const void *op2);
+void bfcc_emit_prefix(FILE *output, const bfeval_t *prefix);
 
-void load_filter(FILE *input, list_t *pattern, list_t *replace);
+void bfcc_emit_consts(FILE *output, const bfir_t *ir);
 
-void apply_filter_file(char *filename, list_t *parse_lst);
+void bfcc_report(FILE *output, int32_t format, const bfopt_stats_t *parse,
+        const bfopt_pipeline_t *pipeline, const bfopt_filters_t *filters,
+        const bfopt_stats_t *codegen, const bfopt_stats_t *gcc);
 
 void exec_and_block(const char *filename, const char *argv[], const char *envp[]);
 
-int32_t gen32_find_bestp(int32_t curr, int32_t diff, int32_t *ptrs, int32_t *refresh);
+int32_t gen32_find_slot(gen32_cache_t *cache, int32_t loc);
+
+int32_t gen32_find_bestp(FILE *output, gen32_cache_t *cache, int32_t loc, int32_t *refresh);
+
+void gen32_load(FILE *output, gen32_cache_t *cache, int32_t slot);
+
+void gen32_store(FILE *output, gen32_cache_t *cache, int32_t slot);
+
+void gen32_flush(FILE *output, gen32_cache_t *cache);
+
+void gen32_switch(FILE *output, gen32_cache_t *cache, int32_t slot);
+
+void gen32_join(FILE *output, gen32_cache_t *cache, const gen32_cache_t *other);
+
+void gen32_meet(gen32_cache_t *cache, const gen32_cache_t *other);
+
+void gen32_reconcile(FILE *output, gen32_cache_t *cache, const gen32_cache_t *target);
+
+int32_t *gen32_loop_heads(const bfir_t *ir, int32_t labels);
+
+int32_t gen64_find_slot(gen64_cache_t *cache, int32_t offset);
+
+int32_t gen64_alloc_slot(gen64_cache_t *cache, int32_t offset);
+
+void gen64_invalidate(gen64_cache_t *cache);
+
+void gen64_move(gen64_cache_t *cache, int32_t diff);
+
+int32_t gen64_load(FILE *output, gen64_cache_t *cache, char **val_regs, int32_t offset);
 
+#endif
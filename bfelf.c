@@ -0,0 +1,461 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Static x86-64 ELF executable writer */
+
+#include<sys/stat.h>
+
+#include "bfelf.h"
+
+#define EMIT BFX64_EMIT
+
+static const char bfelf_bounds_msg[] = "Program failed due to errors: ERR_BOUNDS\n";
+static const char bfelf_mem_msg[] = "Program failed due to errors: ERR_MEM\n";
+
+static void bfelf_rel8(bfx64_buf_t *buf, size_t at, size_t target){
+    buf->buf[at] = (uint8_t)(int8_t)(target - (at + 1));
+}
+
+static void bfelf_call(bfx64_buf_t *buf, uint8_t opcode, size_t target){
+    /* call/jmp rel32 to an offset already emitted */
+    bfx64_byte(buf, opcode);
+    bfx64_imm32(buf, target - (buf->length + 4));
+}
+
+static void bfelf_jcc(bfx64_buf_t *buf, uint8_t cc, size_t target){
+    /* jcc rel32 to an offset already emitted */
+    EMIT(buf, 0x0F, cc);
+    bfx64_imm32(buf, target - (buf->length + 4));
+}
+
+static void bfelf_imm64(bfx64_buf_t *buf, int64_t imm){
+    bfx64_emit(buf, (uint8_t *)&imm, sizeof(int64_t));
+}
+
+static size_t bfelf_emit_fail(bfx64_buf_t *buf, uint32_t code_va, size_t flush_at,
+        const char *msg, size_t length, uint8_t status){
+    /* Flush, report msg on stderr and exit with status. Returns the
+     * routine's offset. */
+    size_t fail = buf->length, at;
+    bfelf_call(buf, 0xE8, flush_at);
+    EMIT(buf, 0xBF, 0x02, 0x00, 0x00, 0x00);            /* mov edi, 2 */
+    EMIT(buf, 0xBE);                                    /* mov esi, msg */
+    at = buf->length;
+    bfx64_imm32(buf, 0);
+    EMIT(buf, 0xBA);                                    /* mov edx, len */
+    bfx64_imm32(buf, length);
+    EMIT(buf, 0xB8, 0x01, 0x00, 0x00, 0x00, 0x0F, 0x05);/* write */
+    EMIT(buf, 0xBF, status, 0x00, 0x00, 0x00);          /* mov edi, status */
+    EMIT(buf, 0xB8, 0x3C, 0x00, 0x00, 0x00, 0x0F, 0x05);/* exit */
+    bfx64_patch32(buf, at, code_va + buf->length);
+    bfx64_emit(buf, (const uint8_t *)msg, length);
+    return fail;
+}
+
+typedef struct {
+    size_t start;
+    size_t call;
+    size_t put;
+    size_t get;
+    size_t write;
+    size_t bounds;
+    size_t fault;
+    size_t restorer;
+} bfelf_runtime_t;
+
+static void bfelf_emit_runtime(bfx64_buf_t *buf, bfelf_runtime_t *rt, uint32_t code_va,
+        const bfeval_t *prefix, int32_t flush, size_t origin){
+    /* The runtime the generated code calls through its table. Output is
+     * collected in a static buffer and written when it fills, at exit, and
+     * as the flush policy asks. Input is read a buffer at a time.
+     * Everything talks to the kernel directly. */
+    size_t loop, done, at;
+
+    /* flush: write(1, outbuf, outlen) until it is all out, then outlen = 0 */
+    size_t flush_at = buf->length;
+    EMIT(buf, 0xBE);                                    /* mov esi, OUTBUF */
+    bfx64_imm32(buf, BFELF_OUTBUF_VA);
+    EMIT(buf, 0x8B, 0x14, 0x25);                        /* mov edx, [OUTLEN] */
+    bfx64_imm32(buf, BFELF_OUTLEN_VA);
+    loop = buf->length;
+    EMIT(buf, 0x85, 0xD2, 0x7E, 0x00);                  /* test edx, edx; jle done */
+    done = buf->length - 1;
+    EMIT(buf, 0xBF, 0x01, 0x00, 0x00, 0x00);            /* mov edi, 1 */
+    EMIT(buf, 0xB8, 0x01, 0x00, 0x00, 0x00);            /* mov eax, SYS_write */
+    EMIT(buf, 0x0F, 0x05);                              /* syscall */
+    EMIT(buf, 0x48, 0x85, 0xC0, 0x7E, 0x00);            /* test rax, rax; jle done */
+    at = buf->length - 1;
+    EMIT(buf, 0x48, 0x01, 0xC6, 0x29, 0xC2);            /* add rsi, rax; sub edx, eax */
+    EMIT(buf, 0xEB, 0x00);                              /* jmp loop */
+    bfelf_rel8(buf, buf->length - 1, loop);
+    bfelf_rel8(buf, done, buf->length);
+    bfelf_rel8(buf, at, buf->length);
+    EMIT(buf, 0xC7, 0x04, 0x25);                        /* mov dword [OUTLEN], 0 */
+    bfx64_imm32(buf, BFELF_OUTLEN_VA);
+    bfx64_imm32(buf, 0);
+    EMIT(buf, 0xC3);
+
+    /* put(c): outbuf[outlen++] = c, flushing when full */
+    rt->put = buf->length;
+    EMIT(buf, 0x8B, 0x0C, 0x25);                        /* mov ecx, [OUTLEN] */
+    bfx64_imm32(buf, BFELF_OUTLEN_VA);
+    EMIT(buf, 0x40, 0x88, 0xB9);                        /* mov [rcx+OUTBUF], dil */
+    bfx64_imm32(buf, BFELF_OUTBUF_VA);
+    EMIT(buf, 0xFF, 0xC1);                              /* inc ecx */
+    EMIT(buf, 0x89, 0x0C, 0x25);                        /* mov [OUTLEN], ecx */
+    bfx64_imm32(buf, BFELF_OUTLEN_VA);
+    EMIT(buf, 0x81, 0xF9);                              /* cmp ecx, OUTBUF_SIZE */
+    bfx64_imm32(buf, BFELF_OUTBUF_SIZE);
+    EMIT(buf, 0x73, 0x00);                              /* jae full */
+    at = buf->length - 1;
+    if(flush == BFCC_FLUSH_NEWLINE){
+        EMIT(buf, 0x40, 0x80, 0xFF, 0x0A, 0x74, 0x00);  /* cmp dil, 10; je full */
+        done = buf->length - 1;
+        EMIT(buf, 0xC3);
+        bfelf_rel8(buf, done, buf->length);
+    }else{
+        EMIT(buf, 0xC3);
+    }
+    bfelf_rel8(buf, at, buf->length);
+    bfelf_call(buf, 0xE9, flush_at);                    /* full: jmp flush */
+
+    /* write(text, length): copy text into outbuf, flushing first if it won't
+     * fit. Text longer than the whole buffer is written out directly. Under
+     * the newline policy copied text is flushed straight away rather than
+     * looked through. */
+    rt->write = buf->length;
+    EMIT(buf, 0x57, 0x56);                              /* push rdi; push rsi */
+    EMIT(buf, 0x8B, 0x04, 0x25);                        /* mov eax, [OUTLEN] */
+    bfx64_imm32(buf, BFELF_OUTLEN_VA);
+    EMIT(buf, 0x01, 0xF0, 0x3D);                        /* add eax, esi; cmp eax, OUTBUF_SIZE */
+    bfx64_imm32(buf, BFELF_OUTBUF_SIZE);
+    EMIT(buf, 0x76, 0x05);                              /* jbe copy */
+    bfelf_call(buf, 0xE8, flush_at);                    /* call flush */
+    EMIT(buf, 0x59, 0x5E);                              /* copy: pop rcx; pop rsi */
+    EMIT(buf, 0x81, 0xF9);                              /* cmp ecx, OUTBUF_SIZE */
+    bfx64_imm32(buf, BFELF_OUTBUF_SIZE);
+    EMIT(buf, 0x77, 0x00);                              /* ja direct */
+    at = buf->length - 1;
+    EMIT(buf, 0x8B, 0x3C, 0x25);                        /* mov edi, [OUTLEN] */
+    bfx64_imm32(buf, BFELF_OUTLEN_VA);
+    EMIT(buf, 0x8D, 0x14, 0x0F);                        /* lea edx, [rdi+rcx] */
+    EMIT(buf, 0x89, 0x14, 0x25);                        /* mov [OUTLEN], edx */
+    bfx64_imm32(buf, BFELF_OUTLEN_VA);
+    EMIT(buf, 0x81, 0xC7);                              /* add edi, OUTBUF */
+    bfx64_imm32(buf, BFELF_OUTBUF_VA);
+    EMIT(buf, 0xF3, 0xA4);                              /* rep movsb */
+    if(flush == BFCC_FLUSH_NEWLINE){
+        bfelf_call(buf, 0xE9, flush_at);                /* jmp flush */
+    }else{
+        EMIT(buf, 0xC3);
+    }
+    bfelf_rel8(buf, at, buf->length);
+    EMIT(buf, 0x89, 0xCA);                              /* direct: mov edx, ecx */
+    loop = buf->length;
+    EMIT(buf, 0xBF, 0x01, 0x00, 0x00, 0x00);            /* mov edi, 1 */
+    EMIT(buf, 0xB8, 0x01, 0x00, 0x00, 0x00);            /* mov eax, SYS_write */
+    EMIT(buf, 0x0F, 0x05);                              /* syscall */
+    EMIT(buf, 0x48, 0x85, 0xC0, 0x7E, 0x00);            /* test rax, rax; jle done */
+    done = buf->length - 1;
+    EMIT(buf, 0x48, 0x01, 0xC6, 0x29, 0xC2);            /* add rsi, rax; sub edx, eax */
+    EMIT(buf, 0x7F, 0x00);                              /* jg loop */
+    bfelf_rel8(buf, buf->length - 1, loop);
+    bfelf_rel8(buf, done, buf->length);
+    EMIT(buf, 0xC3);
+
+    /* get(): the next byte of inbuf, refilling it with one read(0) when it
+     * runs out, flushing first unless the policy says not to. Returns -1
+     * at end of input. */
+    rt->get = buf->length;
+    EMIT(buf, 0x8B, 0x04, 0x25);                        /* mov eax, [INPOS] */
+    bfx64_imm32(buf, BFELF_INPOS_VA);
+    EMIT(buf, 0x3B, 0x04, 0x25);                        /* cmp eax, [INLEN] */
+    bfx64_imm32(buf, BFELF_INLEN_VA);
+    EMIT(buf, 0x72, 0x00);                              /* jb have */
+    size_t have = buf->length - 1;
+    if(flush != BFCC_FLUSH_EXIT){
+        bfelf_call(buf, 0xE8, flush_at);                /* call flush */
+    }
+    EMIT(buf, 0x31, 0xFF);                              /* xor edi, edi */
+    EMIT(buf, 0xBE);                                    /* mov esi, INBUF */
+    bfx64_imm32(buf, BFELF_INBUF_VA);
+    EMIT(buf, 0xBA);                                    /* mov edx, INBUF_SIZE */
+    bfx64_imm32(buf, BFELF_INBUF_SIZE);
+    EMIT(buf, 0x31, 0xC0, 0x0F, 0x05);                  /* xor eax, eax (SYS_read); syscall */
+    EMIT(buf, 0xC7, 0x04, 0x25);                        /* mov dword [INPOS], 0 */
+    bfx64_imm32(buf, BFELF_INPOS_VA);
+    bfx64_imm32(buf, 0);
+    EMIT(buf, 0x48, 0x85, 0xC0, 0x7F, 0x00);            /* test rax, rax; jg fill */
+    at = buf->length - 1;
+    EMIT(buf, 0xC7, 0x04, 0x25);                        /* mov dword [INLEN], 0 */
+    bfx64_imm32(buf, BFELF_INLEN_VA);
+    bfx64_imm32(buf, 0);
+    EMIT(buf, 0xB8, 0xFF, 0xFF, 0xFF, 0xFF, 0xC3);      /* mov eax, -1; ret */
+    bfelf_rel8(buf, at, buf->length);
+    EMIT(buf, 0x89, 0x04, 0x25);                        /* fill: mov [INLEN], eax */
+    bfx64_imm32(buf, BFELF_INLEN_VA);
+    EMIT(buf, 0x31, 0xC0);                              /* xor eax, eax */
+    bfelf_rel8(buf, have, buf->length);
+    EMIT(buf, 0x0F, 0xB6, 0x88);                        /* have: movzx ecx, byte [rax+INBUF] */
+    bfx64_imm32(buf, BFELF_INBUF_VA);
+    EMIT(buf, 0xFF, 0xC0);                              /* inc eax */
+    EMIT(buf, 0x89, 0x04, 0x25);                        /* mov [INPOS], eax */
+    bfx64_imm32(buf, BFELF_INPOS_VA);
+    EMIT(buf, 0x89, 0xC8, 0xC3);                        /* mov eax, ecx; ret */
+
+    /* bounds(rt, mem): flush, report ERR_BOUNDS on stderr and exit. The
+     * program isn't bounds checked, so it's only reached from the fault
+     * handler, as is its ERR_MEM twin. */
+    rt->bounds = bfelf_emit_fail(buf, code_va, flush_at, bfelf_bounds_msg,
+                    sizeof(bfelf_bounds_msg) - 1, ERR_BOUNDS);
+    size_t mem = bfelf_emit_fail(buf, code_va, flush_at, bfelf_mem_msg,
+                    sizeof(bfelf_mem_msg) - 1, ERR_MEM);
+
+    /* fault(sig, info, context): SIGSEGV handler. A touch of either guard
+     * is reported like a failed bounds check; anything else is a real crash,
+     * so it puts back the default action and returns to fault again. */
+    rt->fault = buf->length;
+    EMIT(buf, 0x48, 0x8B, 0x46, 0x10);                  /* mov rax, [rsi+16] (si_addr) */
+    EMIT(buf, 0x48, 0x2B, 0x04, 0x25);                  /* sub rax, [TAPE_AT] */
+    bfx64_imm32(buf, BFELF_TAPE_AT_VA);
+    EMIT(buf, 0x48, 0xB9);                              /* mov rcx, GUARD */
+    bfelf_imm64(buf, BFELF_GUARD);
+    EMIT(buf, 0x48, 0x39, 0xC8);                        /* cmp rax, rcx */
+    bfelf_jcc(buf, 0x82, rt->bounds);                   /* jb bounds */
+    EMIT(buf, 0x48, 0xBA);                              /* mov rdx, GUARD + TAPE */
+    bfelf_imm64(buf, BFELF_GUARD + BFELF_TAPE_SIZE);
+    EMIT(buf, 0x48, 0x29, 0xD0);                        /* sub rax, rdx */
+    EMIT(buf, 0x48, 0x39, 0xC8);                        /* cmp rax, rcx */
+    bfelf_jcc(buf, 0x82, mem);                          /* jb mem */
+    EMIT(buf, 0x48, 0xC7, 0x04, 0x25);                  /* mov qword [SEGV], SIG_DFL */
+    bfx64_imm32(buf, BFELF_SEGV_VA);
+    bfx64_imm32(buf, 0);
+    EMIT(buf, 0xBF, SIGSEGV, 0x00, 0x00, 0x00);         /* mov edi, SIGSEGV */
+    EMIT(buf, 0xBE);                                    /* mov esi, SEGV */
+    bfx64_imm32(buf, BFELF_SEGV_VA);
+    EMIT(buf, 0x31, 0xD2);                              /* xor edx, edx */
+    EMIT(buf, 0x41, 0xBA, 0x08, 0x00, 0x00, 0x00);      /* mov r10d, 8 */
+    EMIT(buf, 0xB8, 0x0D, 0x00, 0x00, 0x00, 0x0F, 0x05);/* rt_sigaction */
+    EMIT(buf, 0xC3);
+
+    /* The handler returns through here */
+    rt->restorer = buf->length;
+    EMIT(buf, 0xB8, 0x0F, 0x00, 0x00, 0x00, 0x0F, 0x05);/* rt_sigreturn */
+
+    /* _start: reserve the tape, write out what the program printed at
+     * compile time, run the rest of it, flush, exit(0). The call to the
+     * program is patched once its offset is known, and the text follows
+     * _start. */
+    rt->start = buf->length;
+    size_t fallback[3], taped;
+    EMIT(buf, 0x31, 0xFF);                              /* xor edi, edi */
+    EMIT(buf, 0x48, 0xBE);                              /* mov rsi, GUARD + TAPE + GUARD */
+    bfelf_imm64(buf, BFELF_GUARD + BFELF_TAPE_SIZE + BFELF_GUARD);
+    EMIT(buf, 0x31, 0xD2);                              /* xor edx, edx (PROT_NONE) */
+    EMIT(buf, 0x41, 0xBA);                              /* mov r10d, flags */
+    bfx64_imm32(buf, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    EMIT(buf, 0x49, 0x83, 0xC8, 0xFF);                  /* or r8, -1 */
+    EMIT(buf, 0x45, 0x31, 0xC9);                        /* xor r9d, r9d */
+    EMIT(buf, 0xB8, 0x09, 0x00, 0x00, 0x00, 0x0F, 0x05);/* mmap */
+    EMIT(buf, 0x48, 0x3D, 0x00, 0xF0, 0xFF, 0xFF);      /* cmp rax, -4096 */
+    EMIT(buf, 0x0F, 0x87);                              /* ja fallback */
+    fallback[0] = buf->length;
+    bfx64_imm32(buf, 0);
+    EMIT(buf, 0x48, 0x89, 0x04, 0x25);                  /* mov [TAPE_AT], rax */
+    bfx64_imm32(buf, BFELF_TAPE_AT_VA);
+    EMIT(buf, 0x48, 0xBB);                              /* mov rbx, GUARD */
+    bfelf_imm64(buf, BFELF_GUARD);
+    EMIT(buf, 0x48, 0x01, 0xC3);                        /* add rbx, rax */
+    EMIT(buf, 0x48, 0x89, 0xDF);                        /* mov rdi, rbx */
+    EMIT(buf, 0x48, 0xBE);                              /* mov rsi, TAPE */
+    bfelf_imm64(buf, BFELF_TAPE_SIZE);
+    EMIT(buf, 0xBA);                                    /* mov edx, PROT_READ | PROT_WRITE */
+    bfx64_imm32(buf, PROT_READ | PROT_WRITE);
+    EMIT(buf, 0xB8, 0x0A, 0x00, 0x00, 0x00, 0x0F, 0x05);/* mprotect */
+    EMIT(buf, 0x85, 0xC0, 0x0F, 0x85);                  /* test eax, eax; jnz fallback */
+    fallback[1] = buf->length;
+    bfx64_imm32(buf, 0);
+    EMIT(buf, 0xBF, SIGSEGV, 0x00, 0x00, 0x00);         /* mov edi, SIGSEGV */
+    EMIT(buf, 0xBE);                                    /* mov esi, SEGV */
+    bfx64_imm32(buf, BFELF_SEGV_VA);
+    EMIT(buf, 0x31, 0xD2);                              /* xor edx, edx */
+    EMIT(buf, 0x41, 0xBA, 0x08, 0x00, 0x00, 0x00);      /* mov r10d, 8 */
+    EMIT(buf, 0xB8, 0x0D, 0x00, 0x00, 0x00, 0x0F, 0x05);/* rt_sigaction */
+    EMIT(buf, 0x85, 0xC0, 0x0F, 0x85);                  /* test eax, eax; jnz fallback */
+    fallback[2] = buf->length;
+    bfx64_imm32(buf, 0);
+    EMIT(buf, 0x48, 0xB8);                              /* mov rax, TAPE */
+    bfelf_imm64(buf, BFELF_TAPE_SIZE);
+    EMIT(buf, 0xEB, 0x00);                              /* jmp taped */
+    taped = buf->length - 1;
+    for(int32_t i = 0; i < 3; i++){
+        bfx64_patch32(buf, fallback[i], buf->length - (fallback[i] + 4));
+    }
+    /* fallback: a plain mapping, unguarded like gen64's calloc'd tape */
+    EMIT(buf, 0x31, 0xFF);                              /* xor edi, edi */
+    EMIT(buf, 0x48, 0xBE);                              /* mov rsi, origin + CELLS */
+    bfelf_imm64(buf, origin + BFEVAL_CELLS);
+    EMIT(buf, 0xBA);                                    /* mov edx, PROT_READ | PROT_WRITE */
+    bfx64_imm32(buf, PROT_READ | PROT_WRITE);
+    EMIT(buf, 0x41, 0xBA);                              /* mov r10d, flags */
+    bfx64_imm32(buf, MAP_PRIVATE | MAP_ANONYMOUS);
+    EMIT(buf, 0x49, 0x83, 0xC8, 0xFF);                  /* or r8, -1 */
+    EMIT(buf, 0x45, 0x31, 0xC9);                        /* xor r9d, r9d */
+    EMIT(buf, 0xB8, 0x09, 0x00, 0x00, 0x00, 0x0F, 0x05);/* mmap */
+    EMIT(buf, 0x48, 0x3D, 0x00, 0xF0, 0xFF, 0xFF);      /* cmp rax, -4096 */
+    bfelf_jcc(buf, 0x87, mem);                          /* ja mem */
+    EMIT(buf, 0x48, 0x89, 0xC3);                        /* mov rbx, rax */
+    EMIT(buf, 0x48, 0xB8);                              /* mov rax, origin + CELLS */
+    bfelf_imm64(buf, origin + BFEVAL_CELLS);
+    bfelf_rel8(buf, taped, buf->length);
+
+    /* taped: rbx is the first cell and rax the tape's size. Its ends go in
+     * the runtime table for the block scans. */
+    EMIT(buf, 0x48, 0x89, 0x1C, 0x25);                  /* mov [RT+BASE], rbx */
+    bfx64_imm32(buf, BFELF_RT_VA + BFX64_RT_BASE);
+    EMIT(buf, 0x48, 0x01, 0xD8);                        /* add rax, rbx */
+    EMIT(buf, 0x48, 0x89, 0x04, 0x25);                  /* mov [RT+END], rax */
+    bfx64_imm32(buf, BFELF_RT_VA + BFX64_RT_END);
+    if(origin){
+        EMIT(buf, 0x48, 0xB8);                          /* mov rax, origin */
+        bfelf_imm64(buf, origin);
+        EMIT(buf, 0x48, 0x01, 0xC3);                    /* add rbx, rax */
+    }
+    if(prefix->cells){
+        EMIT(buf, 0x48, 0x89, 0xDF);                    /* mov rdi, rbx */
+        EMIT(buf, 0xBE);                                /* mov esi, PREFIX */
+        bfx64_imm32(buf, BFELF_PREFIX_VA);
+        EMIT(buf, 0xB9);                                /* mov ecx, cells */
+        bfx64_imm32(buf, prefix->cells);
+        EMIT(buf, 0xF3, 0xA4);                          /* rep movsb */
+    }
+    size_t text = 0;
+    if(prefix->out_length){
+        EMIT(buf, 0xBE);                                /* mov esi, text */
+        text = buf->length;
+        bfx64_imm32(buf, 0);
+        EMIT(buf, 0xBA);                                /* mov edx, len */
+        bfx64_imm32(buf, prefix->out_length);
+        loop = buf->length;
+        EMIT(buf, 0xBF, 0x01, 0x00, 0x00, 0x00);        /* mov edi, 1 */
+        EMIT(buf, 0xB8, 0x01, 0x00, 0x00, 0x00);        /* mov eax, SYS_write */
+        EMIT(buf, 0x0F, 0x05);                          /* syscall */
+        EMIT(buf, 0x48, 0x85, 0xC0, 0x7E, 0x00);        /* test rax, rax; jle done */
+        done = buf->length - 1;
+        EMIT(buf, 0x48, 0x01, 0xC6, 0x29, 0xC2);        /* add rsi, rax; sub edx, eax */
+        EMIT(buf, 0x7F, 0x00);                          /* jg loop */
+        bfelf_rel8(buf, buf->length - 1, loop);
+        bfelf_rel8(buf, done, buf->length);
+    }
+    EMIT(buf, 0x48, 0x89, 0xDF);                        /* mov rdi, rbx */
+    EMIT(buf, 0xBE);                                    /* mov esi, RT */
+    bfx64_imm32(buf, BFELF_RT_VA);
+    EMIT(buf, 0xE8);                                    /* call program */
+    rt->call = buf->length;
+    bfx64_imm32(buf, 0);
+    bfelf_call(buf, 0xE8, flush_at);
+    EMIT(buf, 0x31, 0xFF);                              /* xor edi, edi */
+    EMIT(buf, 0xB8, 0x3C, 0x00, 0x00, 0x00, 0x0F, 0x05);/* exit */
+    if(prefix->out_length){
+        bfx64_patch32(buf, text, code_va + buf->length);
+        bfx64_emit(buf, prefix->out, prefix->out_length);
+    }
+}
+
+void bfelf_write(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename){
+    /* Generate a static x86-64 ELF executable to output. The program starts
+     * from prefix's tape and output, origin cells into the tape, and flushes
+     * its own as flush says. */
+    if(origin >= (size_t)BFELF_TAPE_SIZE){
+        CriticalError("Origin past the end of the tape");
+    }
+    size_t headers = sizeof(Elf64_Ehdr) + 3 * sizeof(Elf64_Phdr);
+    uint32_t code_va = BFELF_TEXT_VA + headers;
+
+    bfvm_code_t code;
+    bfvm_lower(&code, ir);
+
+    bfx64_buf_t buf;
+    bfx64_init(&buf);
+    bfelf_runtime_t rt;
+    bfelf_emit_runtime(&buf, &rt, code_va, prefix, flush, origin);
+    size_t entry = bfx64_compile(&buf, code.insns, code.data, 0, code.length, 0);
+    bfx64_patch32(&buf, rt.call, entry - (rt.call + 4));
+    bfvm_free(&code);
+
+    size_t data_off = (headers + buf.length + BFELF_PAGE - 1) & ~(size_t)(BFELF_PAGE - 1);
+
+    Elf64_Ehdr ehdr;
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = code_va + rt.start;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = 3;
+
+    Elf64_Phdr phdr[3];
+    memset(phdr, 0, sizeof(phdr));
+    phdr[0].p_type = PT_LOAD;
+    phdr[0].p_flags = PF_R | PF_X;
+    phdr[0].p_offset = 0;
+    phdr[0].p_vaddr = phdr[0].p_paddr = BFELF_TEXT_VA;
+    phdr[0].p_filesz = phdr[0].p_memsz = headers + buf.length;
+    phdr[0].p_align = BFELF_PAGE;
+    phdr[1].p_type = PT_LOAD;
+    phdr[1].p_flags = PF_R | PF_W;
+    phdr[1].p_offset = data_off;
+    phdr[1].p_vaddr = phdr[1].p_paddr = BFELF_DATA_VA;
+    phdr[1].p_filesz = BFELF_DATA_FILESZ;
+    if(prefix->cells){
+        phdr[1].p_filesz = BFELF_PREFIX_VA - BFELF_DATA_VA + prefix->cells;
+    }
+    phdr[1].p_memsz = BFELF_INBUF_VA + BFELF_INBUF_SIZE - BFELF_DATA_VA;
+    phdr[1].p_align = BFELF_PAGE;
+    phdr[2].p_type = PT_GNU_STACK;
+    phdr[2].p_flags = PF_R | PF_W;
+
+    /* Runtime table, in the layout bfx64 expects with the tape's ends filled
+     * in at startup, then outlen and inlen sharing a word, then inpos, the
+     * tape mapping's start, and the kernel's struct sigaction for the fault
+     * handler */
+    uint64_t data[BFELF_DATA_FILESZ / sizeof(uint64_t)] = {
+        0,
+        0,
+        code_va + rt.bounds,
+        code_va + rt.put,
+        code_va + rt.get,
+        code_va + rt.write,
+        0,
+        0,
+        0,
+        code_va + rt.fault,
+        SA_SIGINFO | BFELF_SA_RESTORER,
+        code_va + rt.restorer,
+        0
+    };
+
+    fwrite(&ehdr, sizeof(ehdr), 1, output);
+    fwrite(phdr, sizeof(phdr), 1, output);
+    fwrite(buf.buf, 1, buf.length, output);
+    for(size_t i = headers + buf.length; i < data_off; i++){
+        fputc(0, output);
+    }
+    fwrite(data, sizeof(data), 1, output);
+    if(prefix->cells){
+        for(size_t i = sizeof(data); i < BFELF_PREFIX_VA - BFELF_DATA_VA; i++){
+            fputc(0, output);
+        }
+        fwrite(prefix->tape, 1, prefix->cells, output);
+    }
+    fchmod(fileno(output), 0755);
+
+    bfx64_free(&buf);
+}
@@ -0,0 +1,73 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Static x86-64 ELF executable writer */
+
+#ifndef BFELF_H
+#define BFELF_H
+
+#include<elf.h>
+#include<signal.h>
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<sys/mman.h>
+
+#include "error_handling.h"
+#include "bfop.h"
+#include "bfir.h"
+#include "bfvm.h"
+#include "bfx64.h"
+#include "bfeval.h"
+
+/* Executable layout. Everything is at a fixed address, so the runtime and the
+ * program reach their data with 32-bit absolute operands.
+ *
+ *   BFELF_TEXT_VA   ELF and program headers, runtime, program     r-x
+ *   BFELF_DATA_VA   runtime table, output length, input position, rw-
+ *                   tape mapping, SIGSEGV action
+ *                   baked tape prefix
+ *                   output buffer, input buffer                   rw- (bss)
+ *
+ * The tape itself is reserved at startup like bfi's bftape: zero filled as
+ * pages are touched, between guards where a touch reports ERR_BOUNDS before
+ * the tape and ERR_MEM past it, so the program isn't bounds checked. The
+ * baked prefix is copied onto it. If the reservation is refused the program
+ * falls back to a plain mapping of origin + BFEVAL_CELLS cells.
+ */
+#define BFELF_TEXT_VA 0x400000
+#define BFELF_DATA_VA 0x10000000
+#define BFELF_PAGE 4096
+
+#define BFELF_RT_VA BFELF_DATA_VA
+#define BFELF_OUTLEN_VA (BFELF_DATA_VA + 48)
+#define BFELF_INLEN_VA (BFELF_DATA_VA + 52)
+#define BFELF_INPOS_VA (BFELF_DATA_VA + 56)
+#define BFELF_TAPE_AT_VA (BFELF_DATA_VA + 64)
+#define BFELF_SEGV_VA (BFELF_DATA_VA + 72)
+#define BFELF_DATA_FILESZ 104
+#define BFELF_PREFIX_VA (BFELF_DATA_VA + BFELF_PAGE)
+#define BFELF_PREFIX_SIZE ((BFEVAL_CELLS + BFELF_PAGE - 1) & ~(BFELF_PAGE - 1))
+#define BFELF_OUTBUF_VA (BFELF_PREFIX_VA + BFELF_PREFIX_SIZE)
+#define BFELF_OUTBUF_SIZE (1 << 16)
+#define BFELF_INBUF_VA (BFELF_OUTBUF_VA + BFELF_OUTBUF_SIZE)
+#define BFELF_INBUF_SIZE (1 << 16)
+
+/* The same tape and guards as gen64's */
+#define BFELF_TAPE_SIZE ((int64_t)1 << 36)
+#define BFELF_GUARD ((int64_t)1 << 32)
+
+/* The kernel's flag for a handler that returns through its own restorer,
+ * which glibc doesn't export */
+#define BFELF_SA_RESTORER 0x04000000
+
+/* When generated executables write out what they've printed, besides when
+ * the buffer fills and at exit */
+#define BFCC_FLUSH_EXIT 0       /* never */
+#define BFCC_FLUSH_INPUT 1      /* before blocking for input */
+#define BFCC_FLUSH_NEWLINE 2    /* before blocking for input and after '\n' */
+
+void bfelf_write(FILE *output, bfir_t *ir, const bfeval_t *prefix, int32_t flush,
+        size_t origin, char *filename);
+
+#endif
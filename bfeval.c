@@ -0,0 +1,210 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Compile-time evaluation of the input-independent program prefix */
+
+#include "bfeval.h"
+
+#define IN_TAPE(i) ((i) >= 0 && (i) < BFEVAL_CELLS)
+
+static void bfeval_put(bfeval_t *ev, uint8_t c){
+    if(ev->out_length == ev->out_capacity){
+        ev->out_capacity = ev->out_capacity ? ev->out_capacity * 2 : 256;
+        ev->out = realloc(ev->out, ev->out_capacity);
+        if(!ev->out){
+            CriticalError("Failed to allocate memory");
+        }
+    }
+    ev->out[ev->out_length++] = c;
+}
+
+void bfeval_init(bfeval_t *ev){
+    /* A program that hasn't run anything yet: a blank tape, the pointer at
+     * its start, nothing printed. */
+    memset(ev, 0, sizeof(bfeval_t));
+    ev->tape = calloc(BFEVAL_CELLS, sizeof(uint8_t));
+    if(!ev->tape){
+        CriticalError("Failed to allocate memory");
+    }
+}
+
+size_t bfeval_prefix(const bfir_t *ir, bfeval_t *ev, size_t max_steps){
+    /* Runs ir on a fresh tape until it is about to read input, step off the
+     * first BFEVAL_CELLS cells, or run past max_steps ops, and records where
+     * it got to in ev. An op that would leave the tape isn't run, so the
+     * program fails (or grows its tape) at runtime exactly as it would have.
+     * Returns the number of ops run. */
+    int32_t max_label = -1;
+    for(size_t i = 0; i < ir->length; i++){
+        if(ir->ops[i].opcode == LABEL && ir->ops[i].arg > max_label){
+            max_label = ir->ops[i].arg;
+        }
+    }
+    size_t *targets = malloc((max_label + 1) * sizeof(size_t));
+    bfeval_init(ev);
+    if(!targets){
+        CriticalError("Failed to allocate memory");
+    }
+    for(size_t i = 0; i < ir->length; i++){
+        if(ir->ops[i].opcode == LABEL){
+            targets[ir->ops[i].arg] = i;
+        }
+    }
+
+    uint8_t *tape = ev->tape;
+    int32_t ptr = 0;
+    int64_t at;
+    size_t pc = 0, steps = 0;
+    for(; pc < ir->length && steps < max_steps; pc++, steps++){
+        const bfop_t *op = &ir->ops[pc];
+        switch(bfop_type(op->opcode)){
+            case T_PTR:
+                at = (int64_t)ptr + bfopt_delta(op);
+                if(!IN_TAPE(at)){
+                    goto done;
+                }
+                ptr = at;
+                continue;
+            case T_ARITH:
+            case T_ZERO:
+            case T_IO:
+                at = (int64_t)ptr + op->off;
+                if(!IN_TAPE(at) || op->opcode == GET){
+                    goto done;
+                }
+                if(op->opcode == ZERO){
+                    tape[at] = 0;
+                }else if(op->opcode == PUT){
+                    bfeval_put(ev, tape[at]);
+                }else{
+                    tape[at] += bfopt_delta(op);
+                }
+                continue;
+        }
+        switch(op->opcode){
+            case MUL:
+                if(tape[ptr]){
+                    at = (int64_t)ptr + op->off;
+                    if(!IN_TAPE(at)){
+                        goto done;
+                    }
+                    tape[at] += tape[ptr] * op->arg;
+                }
+                break;
+            case SCAN:
+                at = ptr;
+                while(IN_TAPE(at) && tape[at]){
+                    at += op->arg;
+                }
+                if(!IN_TAPE(at)){
+                    goto done;
+                }
+                ptr = at;
+                break;
+            case JZ:
+                if(!tape[ptr]){
+                    pc = targets[op->arg];
+                }
+                break;
+            case JNZ:
+                if(tape[ptr]){
+                    pc = targets[op->arg];
+                }
+                break;
+        }
+    }
+done:
+    ev->ptr = ptr;
+    ev->resume = pc;
+    for(size_t i = 0; i < BFEVAL_CELLS; i++){
+        if(tape[i]){
+            ev->cells = i + 1;
+        }
+    }
+    free(targets);
+    return steps;
+}
+
+bfir_t *bfeval_resume(bfir_t *ir, bfeval_t *ev, int32_t bake){
+    /* Rewrites ir to pick up where ev stopped. If bake is set the backend
+     * starts the program from ev's tape and prints ev's output itself;
+     * otherwise both are recreated by straight-line code at the top, the
+     * output built up in cell 0 and printed a byte at a time, then the tape
+     * set with offset ADDs, and ev is left empty. The pointer is then moved
+     * into place. Ops before the resume point are dropped if it isn't in a
+     * loop; if it is, they stay for later trips round the loop and a branch
+     * that is always taken, since the value under the pointer is known,
+     * jumps over them to a new label. */
+    if(ev->resume == 0){
+        return ir;
+    }
+
+    int32_t depth = 0, label = -1;
+    for(size_t i = 0; i < ir->length; i++){
+        const bfop_t *op = &ir->ops[i];
+        if(op->opcode == LABEL && op->arg > label){
+            label = op->arg;
+        }
+        if(i < ev->resume && op->opcode == JZ){
+            depth++;
+        }else if(i < ev->resume && op->opcode == JNZ){
+            depth--;
+        }
+    }
+    label++;
+    int32_t finished = ev->resume == ir->length;
+    int32_t taken = ev->tape[ev->ptr] ? JNZ : JZ;
+
+    bfir_t out;
+    bfir_init(&out);
+    bfir_reserve(&out, ir->length + 8);
+    if(!bake){
+        uint8_t prev = 0;
+        for(size_t i = 0; i < ev->out_length; i++){
+            int32_t delta = (int8_t)(ev->out[i] - prev);
+            if(delta){
+                bfopt_set_delta(bfir_push(&out, ADD, 0), T_ARITH, delta);
+            }
+            bfir_push(&out, PUT, 0);
+            prev = ev->out[i];
+        }
+        if(prev){
+            bfir_push(&out, ZERO, 0);
+        }
+        for(size_t i = 0; !finished && i < ev->cells; i++){
+            if(ev->tape[i]){
+                bfop_t *op = bfir_push(&out, ADD, 0);
+                bfopt_set_delta(op, T_ARITH, (int8_t)ev->tape[i]);
+                op->off = i;
+            }
+        }
+        ev->out_length = 0;
+        ev->cells = 0;
+    }
+
+    if(!finished){
+        if(ev->ptr){
+            bfopt_set_delta(bfir_push(&out, INC, 0), T_PTR, ev->ptr);
+        }
+        size_t from = ev->resume;
+        if(depth){
+            bfir_push(&out, taken, label);
+            from = 0;
+        }
+        for(size_t i = from; i < ir->length; i++){
+            if(depth && i == ev->resume){
+                bfir_push(&out, LABEL, label);
+            }
+            *bfir_push(&out, 0, 0) = ir->ops[i];
+        }
+    }
+
+    bfir_swap(ir, &out);
+    bfir_free(&out);
+    return ir;
+}
+
+void bfeval_free(bfeval_t *ev){
+    free(ev->tape);
+    free(ev->out);
+    memset(ev, 0, sizeof(bfeval_t));
+}
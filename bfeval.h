@@ -0,0 +1,46 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Compile-time evaluation of the input-independent program prefix */
+
+#ifndef BFEVAL_H
+#define BFEVAL_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include "error_handling.h"
+#include "bfop.h"
+#include "bfir.h"
+#include "bfopt.h"
+
+/* Most ops bfeval_prefix will run before giving up */
+#define BFEVAL_STEPS (1 << 24)
+
+/* Cells the evaluator may touch. This is the smallest tape any backend
+ * gives a program (the gcc backends' 30000), so the baked tape always fits */
+#define BFEVAL_CELLS 30000
+
+/* Where a program stands after running everything that doesn't depend on
+ * input: the tape, the pointer, what it printed, and the index of the first
+ * op it didn't run. resume == length means it ran to completion. */
+typedef struct {
+    uint8_t *tape;
+    size_t cells;           /* tape[cells, BFEVAL_CELLS) is all zero */
+    int32_t ptr;
+    uint8_t *out;
+    size_t out_length;
+    size_t out_capacity;
+    size_t resume;
+} bfeval_t;
+
+void bfeval_init(bfeval_t *ev);
+
+size_t bfeval_prefix(const bfir_t *ir, bfeval_t *ev, size_t max_steps);
+
+bfir_t *bfeval_resume(bfir_t *ir, bfeval_t *ev, int32_t bake);
+
+void bfeval_free(bfeval_t *ev);
+
+#endif
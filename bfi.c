@@ -2,8 +2,21 @@
  * Brainfuck Interpreter */
 
 #include "bfi.h"
+#include "bfio.h"
+#include "bfvm.h"
+#include "bfjit.h"
+#include "bftier.h"
+#include "bftape.h"
 
-uint8_t *bf_interpret(uint8_t *mem, bfstate_t *state){
+/* The interpreters come in two flavours. On a calloc'd tape every move is
+ * checked and a step off the end grows the tape. On a guarded tape moves
+ * aren't checked at all: a stray touch lands in a guard page and bftape's
+ * fault handler reports it. Each loop is written once and inlined twice
+ * with checked fixed at 1 or 0, so the unchecked copy has no tests left. */
+#define BF_INLINE static inline __attribute__((always_inline))
+
+BF_INLINE uint8_t *bf_interpret_loop(uint8_t *mem, bfstate_t *state,
+                                        const int32_t checked){
     char input;
     int32_t level;
     char *program = state->pc;
@@ -11,31 +24,22 @@ uint8_t *bf_interpret(uint8_t *mem, bfstate_t *state){
     while((input = *program++) != EOF){
         switch(input){
             case '>':
-                if(++mem >= (state->base + state->mem_size)){
-                    //Allocate moar memory plz
-                    int32_t new_size = 2*state->mem_size;
-                    uint8_t *new_base = calloc(new_size, sizeof(uint8_t));
-                    if(!new_base){
-                        fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_MEM");
-                        exit(ERR_MEM);
-                    }
-                    memcpy(new_base, state->base, state->mem_size);
-                    free(state->base);
-                    mem = new_base + state->mem_size;
-                    state->base = new_base;
-                    state->mem_size = new_size;
+                mem++;
+                if(checked && mem >= state->base + state->mem_size){
+                    mem = bf_grow_tape(mem, state);
                 }
                 break;
-            case '<': 
-                if(--mem < state->base){
+            case '<':
+                mem--;
+                if(checked && mem < state->base){
                     fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_BOUNDS");
                     exit(ERR_BOUNDS);
                 }
                 break;
             case '+': ++*mem;break;
             case '-': --*mem;break;
-            case '.': fputc(*mem, stdout);break;
-            case ',': *mem = fgetc(stdin);break;
+            case '.': bfio_put(*mem);break;
+            case ',': *mem = bfio_get();break;
             case '[':
                 if(*mem){
                     do{
@@ -66,15 +70,116 @@ uint8_t *bf_interpret(uint8_t *mem, bfstate_t *state){
     return mem;
 }
 
+uint8_t *bf_interpret(uint8_t *mem, bfstate_t *state){
+    if(state->guarded){
+        return bf_interpret_loop(mem, state, 0);
+    }
+    return bf_interpret_loop(mem, state, 1);
+}
+
+int32_t *bf_match_brackets(const char *program){
+    /* Builds the jump table for the program. For every '[' and ']' the table
+     * holds the index of its partner; other entries are unused. Exits with
+     * ERR_SYNTAX on mismatched brackets. */
+    size_t length = 0, depth = 0;
+    while(program[length] != EOF){
+        length++;
+    }
+
+    int32_t *jumps = malloc((length + 1) * sizeof(int32_t));
+    int32_t *stack = malloc((length + 1) * sizeof(int32_t));
+    if(!jumps || !stack){
+        fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_MEM");
+        exit(ERR_MEM);
+    }
+
+    for(size_t i = 0; i < length; i++){
+        if(program[i] == '['){
+            stack[depth++] = i;
+        }else if(program[i] == ']'){
+            if(depth == 0){
+                fprintf(stderr, "%s: %s\n", "Mismatched []", "ERR_SYNTAX");
+                exit(ERR_SYNTAX);
+            }
+            int32_t open = stack[--depth];
+            jumps[open] = i;
+            jumps[i] = open;
+        }
+    }
+    if(depth != 0){
+        fprintf(stderr, "%s: %s\n", "Mismatched []", "ERR_SYNTAX");
+        exit(ERR_SYNTAX);
+    }
+
+    free(stack);
+    return jumps;
+}
+
+BF_INLINE uint8_t *bf_interpret_flat_loop(uint8_t *mem, bfstate_t *state,
+                                        const int32_t *jumps, const int32_t checked){
+    /* Non-recursive interpreter. Brackets jump straight to their partner
+     * through the precomputed table, so loops cost O(1) to enter, skip or
+     * repeat and the C stack never grows with nesting depth. */
+    const char *program = state->pc;
+    const char *pc = program;
+    char input;
+
+    while((input = *pc) != EOF){
+        switch(input){
+            case '>':
+                mem++;
+                if(checked && mem >= state->base + state->mem_size){
+                    mem = bf_grow_tape(mem, state);
+                }
+                break;
+            case '<':
+                mem--;
+                if(checked && mem < state->base){
+                    fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_BOUNDS");
+                    exit(ERR_BOUNDS);
+                }
+                break;
+            case '+': ++*mem;break;
+            case '-': --*mem;break;
+            case '.': bfio_put(*mem);break;
+            case ',': *mem = bfio_get();break;
+            case '[':
+                if(!*mem){
+                    pc = program + jumps[pc - program];
+                }
+                break;
+            case ']':
+                if(*mem){
+                    pc = program + jumps[pc - program];
+                }
+                break;
+        }
+        pc++;
+    }
+    state->pc = (char *)pc;
+    return mem;
+}
+
+uint8_t *bf_interpret_flat(uint8_t *mem, bfstate_t *state, const int32_t *jumps){
+    if(state->guarded){
+        return bf_interpret_flat_loop(mem, state, jumps, 0);
+    }
+    return bf_interpret_flat_loop(mem, state, jumps, 1);
+}
+
 int main(int argc, char **argv){
     char c;
     FILE *input = stdin;
-    char *program;
+    char *program = NULL;
     int32_t st_flags = 0;
     int32_t verbose = 0;
+    int32_t stream = 0;
+    int32_t engine = ENGINE_RECURSIVE;
+    size_t origin = 0;
+    char *end;
     struct timeval t1, t2;
 
-    while((c = getopt(argc, argv, "Vvh")) != -1){
+    while((c = getopt(argc, argv, "Vvhse:o:")) != -1){
         switch(c){
             case 'V':
                 printf("bfi 1.0 - a tiny brainfuck interpreter\n");
@@ -83,9 +188,46 @@ int main(int argc, char **argv){
             case 'v':
                 verbose = 1;
                 break;
+            case 's':
+                stream = 1;
+                break;
+            case 'o':
+                /* Cells left of where the program starts */
+                origin = strtoull(optarg, &end, 10);
+                if(*end || optarg[0] == '-'){
+                    fprintf(stderr, "Bad origin: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if(!strcmp(optarg, "recursive")){
+                    engine = ENGINE_RECURSIVE;
+                }else if(!strcmp(optarg, "flat")){
+                    engine = ENGINE_FLAT;
+                }else if(!strcmp(optarg, "ir")){
+                    engine = ENGINE_IR;
+#ifdef __x86_64__
+                }else if(!strcmp(optarg, "jit")){
+                    engine = ENGINE_JIT;
+                }else if(!strcmp(optarg, "tiered")){
+                    engine = ENGINE_TIERED;
+#endif
+                }else{
+                    fprintf(stderr, "Unknown engine: %s\n", optarg);
+                    return 1;
+                }
+                break;
             case 'h':
                 printf("Usage: ./bfi FILE to read from FILE\n");
                 printf("       ./bfi      to read from stdin\n");
+                printf("       ./bfi FILE.bc to run bytecode from bfcc --bytecode\n");
+                printf("       ./bfi FILE.bfb to run binary bytecode from bfcc --binary\n");
+                printf("Options: -e ENGINE  recursive (default), flat, ir, jit,\n");
+                printf("                    tiered\n");
+                printf("         -s         stream: splice output into a pipe and map\n");
+                printf("                    input from a file\n");
+                printf("         -o CELLS   start CELLS cells into the tape, so the\n");
+                printf("                    program can move that far left\n");
                 return 0;
         }
     }
@@ -96,6 +238,32 @@ int main(int argc, char **argv){
             fprintf(stderr, "Could not open file: %s\n", argv[optind]);
             return 1;
         }
+        size_t name_len = strlen(argv[optind]);
+        if(name_len >= 3 && !strcmp(argv[optind] + name_len - 3, ".bc")){
+            st_flags |= BYTECODE_INPUT;
+        }else if(name_len >= 4 && !strcmp(argv[optind] + name_len - 4, ".bfb")){
+            st_flags |= BINARY_INPUT;
+        }
+    }
+
+    bfir_t ir;
+    bfir_init(&ir);
+    bfbin_image_t image;
+    if(st_flags & BINARY_INPUT){
+        /* Mapped and executed in place, nothing to parse */
+        fclose(input);
+        if(bfbin_map(argv[optind], &image)){
+            return 1;
+        }
+    }else if(st_flags & BYTECODE_INPUT){
+        /* Precompiled by bfcc --bytecode, so there's nothing to optimize and
+         * only the IR engine can run it. */
+        load_bytecode(input, &ir);
+        fclose(input);
+        if(engine != ENGINE_JIT && engine != ENGINE_TIERED){
+            engine = ENGINE_IR;
+        }
+    }else if(input != stdin){
         //XXX
         fseek(input, 0L, SEEK_END);
         int32_t f_len = ftell(input) + 1;
@@ -143,19 +311,78 @@ int main(int argc, char **argv){
         }while(c != EOF);
     }
 
-    uint8_t *membuf = calloc(MEM_SIZE, sizeof(uint8_t));
-    if(!membuf){
-        fprintf(stderr, "Memory allocation failure.\n");
+    /* A guarded tape if the system allows the reservation, otherwise one
+     * that doubles as the program walks off the end. Either way the program
+     * starts origin cells in, so it can go that far left of where it began
+     * before it runs off the start. */
+    bfstate_t state;
+    state.pc = program;
+    state.guarded = 0;
+    if(!bftape_map(&state)){
+        state.base = calloc(origin + MEM_SIZE, sizeof(uint8_t));
+        state.mem_size = origin + MEM_SIZE;
+        if(!state.base){
+            fprintf(stderr, "Memory allocation failure.\n");
+            return 1;
+        }
+    }else if(origin >= state.mem_size){
+        fprintf(stderr, "Origin past the end of the tape: %zu\n", origin);
         return 1;
     }
+    uint8_t *membuf = state.base + origin;
 
-    bfstate_t state;
-    state.pc = program;
-    state.base = membuf;
-    state.mem_size = MEM_SIZE;
+    int32_t *jumps = NULL;
+    bfvm_code_t code = {NULL, 0, 0};
+    if(st_flags & BINARY_INPUT){
+        /* Already compiled */
+    }else if(engine == ENGINE_FLAT){
+        jumps = bf_match_brackets(program);
+    }else if(engine == ENGINE_IR || engine == ENGINE_JIT
+                || engine == ENGINE_TIERED){
+        if(!(st_flags & BYTECODE_INPUT)){
+            /* Same front end as bfcc. The zero filter is built in so bfi
+             * does not depend on the filters directory being reachable. */
+            bfopt_pipeline_t pipeline;
+            bfopt_pipeline_init(&pipeline, BFOPT_MAX_LEVEL, NULL);
+            bfcc_parse(program, &ir);
+            bfopt_pipeline_run(&pipeline, &ir);
+            /* The tape starts out blank, so whatever the program prints from
+             * cells it has only set itself goes out in single writes */
+            static const uint8_t blank = 0;
+            bfopt_fold_output(&ir, &blank, 0);
+        }
+        bfvm_lower(&code, &ir);
+    }
+
+    bfjit_code_t jit = {NULL, 0, NULL};
+    bftier_t tier;
+    if(engine == ENGINE_JIT){
+        bfjit_compile(&jit, &code, !state.guarded);
+    }else if(engine == ENGINE_TIERED){
+        bftier_init(&tier, &code, !state.guarded);
+    }
 
+    /* Whatever the program printed has to get out however it ends, even
+     * through an exit() on error */
+    atexit(bfio_flush);
+    if(stream){
+        bfio_stream();
+    }
     gettimeofday(&t1, NULL);
-    bf_interpret(membuf, &state);
+    if(st_flags & BINARY_INPUT){
+        bfvm_run_image(&image, membuf, &state);
+    }else if(engine == ENGINE_FLAT){
+        bf_interpret_flat(membuf, &state, jumps);
+    }else if(engine == ENGINE_IR){
+        bfvm_run(&code, membuf, &state);
+    }else if(engine == ENGINE_JIT){
+        bfjit_run(&jit, membuf, &state);
+    }else if(engine == ENGINE_TIERED){
+        bftier_run(&tier, membuf, &state);
+    }else{
+        bf_interpret(membuf, &state);
+    }
+    bfio_flush();
     gettimeofday(&t2, NULL);
 
     if(verbose){
@@ -164,8 +391,26 @@ int main(int argc, char **argv){
         fprintf(stderr, "Time elapsed: %ld us\n", elapsed);
     }
 
+    if(engine == ENGINE_TIERED){
+        bftier_free(&tier);
+        if(verbose){
+            fprintf(stderr, "Loops compiled: %zu\n", tier.compiled);
+        }
+    }
+
+    if(st_flags & BINARY_INPUT){
+        bfbin_unmap(&image);
+    }
+    free(jumps);
+    bfjit_free(&jit);
+    bfvm_free(&code);
+    bfir_free(&ir);    /* code borrowed its data pool */
     free(program);
-    free(state.base);
+    if(state.guarded){
+        bftape_unmap(&state);
+    }else{
+        free(state.base);
+    }
     return 0;
 }
 
@@ -10,6 +10,9 @@
  *
  * (there's no way that can be right) */
 
+#ifndef BFI_H
+#define BFI_H
+
 #include<stdio.h>
 #include<stdint.h>
 #include<stdlib.h>
@@ -20,15 +23,32 @@
 #define MEM_SIZE 30000
 #define MAX_PROGBUF 1048576
 #define FILE_INPUT 1
+#define BYTECODE_INPUT 2
+#define BINARY_INPUT 4
 
 /*Error definitions. */
 #define ERR_BOUNDS 1
 #define ERR_MEM 2
+#define ERR_SYNTAX 3
+
+/*Execution engines. */
+#define ENGINE_RECURSIVE 0
+#define ENGINE_FLAT 1
+#define ENGINE_IR 2
+#define ENGINE_JIT 3
+#define ENGINE_TIERED 4
 
 typedef struct {
     char *pc;
     uint8_t *base;
     size_t mem_size;
+    int32_t guarded;    /* base is a bftape mapping, which never grows */
 } bfstate_t;
 
 uint8_t *bf_interpret(uint8_t *mem, bfstate_t *state);
+
+int32_t *bf_match_brackets(const char *program);
+
+uint8_t *bf_interpret_flat(uint8_t *mem, bfstate_t *state, const int32_t *jumps);
+
+#endif
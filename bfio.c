@@ -0,0 +1,165 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * Buffered program I/O implementation */
+
+#define _GNU_SOURCE     /* vmsplice, F_SETPIPE_SZ */
+
+#include<errno.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/uio.h>
+#include<unistd.h>
+
+#include "bfio.h"
+
+static uint8_t bfio_outbuf[BFIO_OUTBUF_SIZE];
+static uint8_t bfio_inbuf[BFIO_INBUF_SIZE];
+
+bfio_t bfio = {
+    .out = bfio_outbuf,
+    .out_size = BFIO_OUTBUF_SIZE,
+    .in = bfio_inbuf,
+    .in_buf = bfio_inbuf,
+    .in_size = BFIO_INBUF_SIZE
+};
+
+static void bfio_write_all(const uint8_t *text, size_t length){
+    /* Anything that can't be written, like a closed pipe, is dropped as
+     * stdio would */
+    while(length){
+        ssize_t done = write(STDOUT_FILENO, text, length);
+        if(done < 0 && errno == EINTR){
+            continue;
+        }
+        if(done <= 0){
+            return;
+        }
+        text += done;
+        length -= done;
+    }
+}
+
+static int32_t bfio_splice_all(const uint8_t *text, size_t length){
+    /* Hands text's pages to the pipe on stdout. Returns 0 if the pipe
+     * stopped taking them, with the rest written as usual. */
+    struct iovec iov = {(void *)text, length};
+    while(iov.iov_len){
+        ssize_t done = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+        if(done < 0 && errno == EINTR){
+            continue;
+        }
+        if(done <= 0){
+            bfio_write_all(iov.iov_base, iov.iov_len);
+            return 0;
+        }
+        iov.iov_base = (uint8_t *)iov.iov_base + done;
+        iov.iov_len -= done;
+    }
+    return 1;
+}
+
+static void *bfio_map_pages(size_t size){
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+void bfio_stream(void){
+    /* Switches to streaming mode where stdin and stdout allow it, and
+     * quietly keeps the plain buffers where they don't. Call it before the
+     * program does any I/O. The pipe on stdout mustn't be resized, or read
+     * by splicing it on elsewhere, while it runs. */
+    struct stat st;
+    if(!fstat(STDOUT_FILENO, &st) && S_ISFIFO(st.st_mode)){
+        int size = fcntl(STDOUT_FILENO, F_SETPIPE_SZ, BFIO_STREAM_SIZE);
+        if(size < 0){
+            size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+        }
+        uint8_t *pair = size > 0 ? bfio_map_pages(2 * (size_t)size) : NULL;
+        if(pair){
+            bfio.halves[0] = pair;
+            bfio.halves[1] = pair + size;
+            bfio.half = 0;
+            bfio.out = pair;
+            bfio.out_size = size;
+        }
+    }
+
+    off_t at;
+    if(!fstat(STDIN_FILENO, &st) && S_ISREG(st.st_mode)
+            && (at = lseek(STDIN_FILENO, 0, SEEK_CUR)) >= 0 && st.st_size > at){
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if(map != MAP_FAILED){
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            bfio.in = (uint8_t *)map + at;
+            bfio.in_pos = 0;
+            bfio.in_length = st.st_size - at;
+            bfio.mapped = 1;
+            return;
+        }
+    }
+    if(!fstat(STDIN_FILENO, &st) && S_ISFIFO(st.st_mode)){
+        fcntl(STDIN_FILENO, F_SETPIPE_SZ, BFIO_STREAM_SIZE);
+    }
+    uint8_t *buf = bfio_map_pages(BFIO_STREAM_SIZE);
+    if(buf){
+        bfio.in = bfio.in_buf = buf;
+        bfio.in_size = BFIO_STREAM_SIZE;
+    }
+}
+
+void bfio_flush(void){
+    /* A full half is spliced, and the other one takes over. If the pipe
+     * stops taking pages, the rest of the run copies through the plain
+     * buffer: the pipe may still hold pages of either half, so neither can
+     * be written again. */
+    if(bfio.halves[0] && bfio.out_length == bfio.out_size){
+        if(bfio_splice_all(bfio.out, bfio.out_length)){
+            bfio.half ^= 1;
+            bfio.out = bfio.halves[bfio.half];
+        }else{
+            bfio.halves[0] = bfio.halves[1] = NULL;
+            bfio.out = bfio_outbuf;
+            bfio.out_size = BFIO_OUTBUF_SIZE;
+        }
+    }else{
+        bfio_write_all(bfio.out, bfio.out_length);
+    }
+    bfio.out_length = 0;
+}
+
+int bfio_fill(void){
+    /* bfio_get's slow path: the buffer is used up, so anything the program
+     * has printed goes out before it blocks for the next block of input.
+     * A mapped stdin has nothing more to give. */
+    if(bfio.mapped){
+        return EOF;
+    }
+    bfio_flush();
+    ssize_t got;
+    do{
+        got = read(STDIN_FILENO, bfio.in_buf, bfio.in_size);
+    }while(got < 0 && errno == EINTR);
+    bfio.in_pos = 0;
+    bfio.in_length = got > 0 ? got : 0;
+    if(!bfio.in_length){
+        return EOF;
+    }
+    return bfio.in[bfio.in_pos++];
+}
+
+void bfio_write(const uint8_t *text, size_t length){
+    //Copies text into the buffer a bufferful at a time.
+    while(length){
+        size_t room = bfio.out_size - bfio.out_length;
+        size_t count = length < room ? length : room;
+        memcpy(bfio.out + bfio.out_length, text, count);
+        bfio.out_length += count;
+        text += count;
+        length -= count;
+        if(bfio.out_length == bfio.out_size){
+            bfio_flush();
+        }
+    }
+}
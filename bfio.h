@@ -0,0 +1,70 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * Buffered program I/O */
+
+#ifndef BFIO_H
+#define BFIO_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#define BFIO_OUTBUF_SIZE (1 << 16)
+#define BFIO_INBUF_SIZE (1 << 16)
+
+/* Pipe size and input block streaming mode asks for */
+#define BFIO_STREAM_SIZE (1 << 20)
+
+/* What every engine's ',' and '.' go through instead of stdio. Output
+ * collects in out and goes to fd 1 when it fills, before the program waits
+ * for input, and at exit; input comes from fd 0 a block at a time. There is
+ * one program running, so there is one of these.
+ *
+ * In streaming mode a pipe on stdout is sized to out_size and out is one
+ * half of a page-aligned pair. Full halves are handed to the pipe with
+ * vmsplice rather than copied, and filling switches to the other half,
+ * which the pipe can't still be holding once a whole half has gone in
+ * after it. Anything less than a half is written as usual, and if the
+ * pipe stops taking pages output goes back to the plain buffer. A regular
+ * file on stdin is mapped and in points straight into it. */
+typedef struct {
+    uint8_t *out;
+    size_t out_length;
+    size_t out_size;
+    const uint8_t *in;
+    size_t in_pos;
+    size_t in_length;
+    uint8_t *in_buf;
+    size_t in_size;
+    uint8_t *halves[2];     /* both NULL unless output is spliced */
+    int32_t half;
+    int32_t mapped;         /* in is all of stdin */
+} bfio_t;
+
+extern bfio_t bfio;
+
+void bfio_stream(void);
+
+void bfio_flush(void);
+
+int bfio_fill(void);
+
+void bfio_write(const uint8_t *text, size_t length);
+
+static inline void bfio_put(int c){
+    bfio.out[bfio.out_length++] = (uint8_t)c;
+    if(bfio.out_length == bfio.out_size){
+        bfio_flush();
+    }
+}
+
+static inline int bfio_get(void){
+    //The next input byte, or EOF.
+    if(bfio.in_pos == bfio.in_length){
+        return bfio_fill();
+    }
+    return bfio.in[bfio.in_pos++];
+}
+
+#endif
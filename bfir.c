@@ -0,0 +1,74 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Contiguous intermediate representation */
+
+#include "bfir.h"
+
+void bfir_init(bfir_t *ir){
+    ir->ops = NULL;
+    ir->length = 0;
+    ir->capacity = 0;
+    ir->data = NULL;
+    ir->data_length = 0;
+    ir->data_capacity = 0;
+}
+
+void bfir_free(bfir_t *ir){
+    free(ir->ops);
+    free(ir->data);
+    bfir_init(ir);
+}
+
+void bfir_reserve(bfir_t *ir, size_t capacity){
+    if(capacity <= ir->capacity){
+        return;
+    }
+    size_t new_capacity = ir->capacity ? ir->capacity : 64;
+    while(new_capacity < capacity){
+        new_capacity *= 2;
+    }
+    bfop_t *ops = realloc(ir->ops, new_capacity * sizeof(bfop_t));
+    if(!ops){
+        CriticalError("Failed to allocate memory");
+    }
+    ir->ops = ops;
+    ir->capacity = new_capacity;
+}
+
+bfop_t *bfir_push(bfir_t *ir, int32_t opcode, int32_t arg){
+    //Appends an op and returns it. The pointer is good until the next push.
+    if(ir->length == ir->capacity){
+        bfir_reserve(ir, ir->length + 1);
+    }
+    bfop_t *op = &ir->ops[ir->length++];
+    op->opcode = opcode;
+    op->arg = arg;
+    op->off = 0;
+    return op;
+}
+
+void bfir_push_data(bfir_t *ir, uint8_t byte){
+    if(ir->data_length == ir->data_capacity){
+        ir->data_capacity = ir->data_capacity ? ir->data_capacity * 2 : 64;
+        ir->data = realloc(ir->data, ir->data_capacity);
+        if(!ir->data){
+            CriticalError("Failed to allocate memory");
+        }
+    }
+    ir->data[ir->data_length++] = byte;
+}
+
+void bfir_swap(bfir_t *lhs, bfir_t *rhs){
+    bfir_t tmp = *lhs;
+    *lhs = *rhs;
+    *rhs = tmp;
+}
+
+void bfir_print(FILE *output, const bfir_t *ir){
+    fprintf(output, "[");
+    for(size_t i = 0; i < ir->length; i++){
+        fprintf(output, i ? ", " : " ");
+        bfop_print(output, &ir->ops[i]);
+    }
+    fprintf(output, " ]\n");
+}
@@ -0,0 +1,44 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Contiguous intermediate representation */
+
+#ifndef BFIR_H
+#define BFIR_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include "error_handling.h"
+#include "bfop.h"
+
+/* A program as one packed array of ops. The array is the arena: it grows by
+ * doubling, ops are addressed by index, and the whole program is released
+ * with a single bfir_free. Passes that only shrink the program rewrite it in
+ * place; the rest build a second bfir_t and bfir_swap it in. Bytes that ops
+ * refer to, like WRITE_CONST's text, live in a separate data pool. */
+typedef struct {
+    bfop_t *ops;
+    size_t length;
+    size_t capacity;
+    uint8_t *data;
+    size_t data_length;
+    size_t data_capacity;
+} bfir_t;
+
+void bfir_init(bfir_t *ir);
+
+void bfir_free(bfir_t *ir);
+
+void bfir_reserve(bfir_t *ir, size_t capacity);
+
+bfop_t *bfir_push(bfir_t *ir, int32_t opcode, int32_t arg);
+
+void bfir_push_data(bfir_t *ir, uint8_t byte);
+
+void bfir_swap(bfir_t *lhs, bfir_t *rhs);
+
+void bfir_print(FILE *output, const bfir_t *ir);
+
+#endif
@@ -0,0 +1,93 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * In-process x86-64 JIT implementation */
+
+#include<sys/mman.h>
+#include<unistd.h>
+
+#include "bfjit.h"
+
+_Static_assert(offsetof(bfjit_rt_t, base) == BFX64_RT_BASE, "rt layout");
+_Static_assert(offsetof(bfjit_rt_t, end) == BFX64_RT_END, "rt layout");
+_Static_assert(offsetof(bfjit_rt_t, bounds) == BFX64_RT_BOUNDS, "rt layout");
+_Static_assert(offsetof(bfjit_rt_t, put) == BFX64_RT_PUT, "rt layout");
+_Static_assert(offsetof(bfjit_rt_t, get) == BFX64_RT_GET, "rt layout");
+_Static_assert(offsetof(bfjit_rt_t, write) == BFX64_RT_WRITE, "rt layout");
+
+static uint8_t *bfjit_bounds(void *rtp, uint8_t *mem){
+    /* Called from generated code when the data pointer leaves the tape. */
+    bfjit_rt_t *rt = (bfjit_rt_t *)rtp;
+    if(mem < rt->base){
+        fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_BOUNDS");
+        exit(ERR_BOUNDS);
+    }
+    mem = bf_grow_tape(mem, rt->state);
+    rt->base = rt->state->base;
+    rt->end = rt->state->base + rt->state->mem_size;
+    return mem;
+}
+
+static void bfjit_put(int c){
+    bfio_put(c);
+}
+
+static int bfjit_get(void){
+    return bfio_get();
+}
+
+static void bfjit_write(const uint8_t *text, size_t length){
+    bfio_write(text, length);
+}
+
+void bfjit_rt_init(bfjit_rt_t *rt, bfstate_t *state){
+    rt->base = state->base;
+    rt->end = state->base + state->mem_size;
+    rt->bounds = bfjit_bounds;
+    rt->put = bfjit_put;
+    rt->get = bfjit_get;
+    rt->write = bfjit_write;
+    rt->state = state;
+}
+
+void *bfjit_install(bfx64_buf_t *buf, size_t *map_size){
+    /* Copies emitted code into its own mapping and flips it to read/exec, so
+     * no page is ever writable and executable at the same time. */
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (buf->length + page - 1) & ~(page - 1);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED){
+        CriticalError("Failed to map JIT code");
+    }
+    memcpy(map, buf->buf, buf->length);
+    if(mprotect(map, size, PROT_READ | PROT_EXEC)){
+        CriticalError("Failed to protect JIT code");
+    }
+    *map_size = size;
+    return map;
+}
+
+void bfjit_compile(bfjit_code_t *jit, const bfvm_code_t *code, int32_t checked){
+    bfx64_buf_t buf;
+    bfx64_init(&buf);
+    size_t entry = bfx64_compile(&buf, code->insns, code->data, 0, code->length,
+                    checked);
+    jit->map = bfjit_install(&buf, &jit->map_size);
+    jit->entry = (bfjit_fn_t)((uint8_t *)jit->map + entry);
+    bfx64_free(&buf);
+}
+
+void bfjit_free(bfjit_code_t *jit){
+    if(jit->map){
+        munmap(jit->map, jit->map_size);
+    }
+    jit->map = NULL;
+    jit->map_size = 0;
+    jit->entry = NULL;
+}
+
+uint8_t *bfjit_run(bfjit_code_t *jit, uint8_t *mem, bfstate_t *state){
+    bfjit_rt_t rt;
+    bfjit_rt_init(&rt, state);
+    return jit->entry(mem, &rt);
+}
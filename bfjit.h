@@ -0,0 +1,47 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * In-process x86-64 JIT */
+
+#ifndef BFJIT_H
+#define BFJIT_H
+
+#include<stddef.h>
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#include "bfi.h"
+#include "bfvm.h"
+#include "bfx64.h"
+
+/* Runtime table handed to generated code in r12. The first six fields must
+ * match the BFX64_RT_* offsets. */
+typedef struct {
+    uint8_t *base;
+    uint8_t *end;
+    uint8_t *(*bounds)(void *rt, uint8_t *mem);
+    void (*put)(int c);
+    int (*get)(void);
+    void (*write)(const uint8_t *text, size_t length);
+    bfstate_t *state;
+} bfjit_rt_t;
+
+typedef uint8_t *(*bfjit_fn_t)(uint8_t *mem, void *rt);
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    bfjit_fn_t entry;
+} bfjit_code_t;
+
+void bfjit_rt_init(bfjit_rt_t *rt, bfstate_t *state);
+
+void *bfjit_install(bfx64_buf_t *buf, size_t *map_size);
+
+void bfjit_compile(bfjit_code_t *jit, const bfvm_code_t *code, int32_t checked);
+
+void bfjit_free(bfjit_code_t *jit);
+
+uint8_t *bfjit_run(bfjit_code_t *jit, uint8_t *mem, bfstate_t *state);
+
+#endif
@@ -13,6 +13,7 @@ bfop_t *bfop_new(int32_t opcode, int32_t arg){
 
     op->opcode = opcode;
     op->arg = arg;
+    op->off = 0;
 
     return op;
 }
@@ -38,6 +39,12 @@ int32_t bfop_type(int32_t opcode){
             return T_BRANCH;
         case ZERO:
             return T_ZERO;
+        case MUL:
+            return T_MUL;
+        case SCAN:
+            return T_SCAN;
+        case WRITE_CONST:
+            return T_WRITE;
     }
     return -1; /*Something bad happened */
 }
@@ -59,9 +66,16 @@ void bfop_print(FILE *output, const bfop_t *op){
         case JNZ:code = "JNZ";break;
         case JZ:code = "JZ";break;
         case ZERO:code = "ZERO";break;
+        case MUL:code = "MUL";break;
+        case SCAN:code = "SCAN";break;
+        case WRITE_CONST:code = "WRITE_CONST";break;
 
     }
-    fprintf(output, "{ opcode: %s, arg: %d }", code, op->arg);
+    if(op->off){
+        fprintf(output, "{ opcode: %s, arg: %d, off: %d }", code, op->arg, op->off);
+    }else{
+        fprintf(output, "{ opcode: %s, arg: %d }", code, op->arg);
+    }
 }
 
 void generic_bfop_print(FILE *output, const void *op){
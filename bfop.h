@@ -2,6 +2,9 @@
  * Brainfuck Compiler
  * Brainfuck Operation definitions and headers.*/
 
+#ifndef BFOP_H
+#define BFOP_H
+
 #include<stdlib.h>
 #include<stdint.h>
 #include "error_handling.h"
@@ -21,6 +24,9 @@
 #define JNZ 11
 #define JZ 12
 #define ZERO 13
+#define MUL 14
+#define SCAN 15
+#define WRITE_CONST 16
 
 /* Command type constants */
 #define T_PTR 0
@@ -28,11 +34,17 @@
 #define T_IO 2
 #define T_BRANCH 3
 #define T_ZERO 4
+#define T_MUL 5
+#define T_SCAN 6
+#define T_WRITE 7
 
 /* Application-specific data structures. */
 typedef struct {
     int32_t arg;    /* May or may not be req. depending on opcode */
     int32_t opcode;
+    int32_t off;    /* Cell offset from the data ptr: where arithmetic, ZERO
+                     * and I/O apply, and MUL's target. WRITE_CONST keeps its
+                     * length here, and arg indexes the IR's data pool */
 } bfop_t;
 
 bfop_t *bfop_new(int32_t opcode, int32_t arg);
@@ -43,3 +55,4 @@ void bfop_print(FILE *output, const bfop_t *op);
 
 void generic_bfop_print(FILE *output, const void *op);
 
+#endif
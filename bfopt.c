@@ -0,0 +1,1714 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Parser and optimization passes, shared by bfcc and bfi */
+
+#include "bfopt.h"
+
+bfir_t *bfcc_parse(char *program, bfir_t *ir){
+    /*Produces the initial IR for the program, appending to ir. Loops get a
+     * pair of labels each: [ is JZ L+1; L: and ] is JNZ L; L+1: */
+    char input;
+    int32_t label_ct = 0;
+    size_t depth = 0, stack_size = 64;
+    int32_t *loop_stack = malloc(stack_size * sizeof(int32_t));
+    if(!loop_stack){
+        CriticalError("Failed to allocate memory");
+    }
+
+    while((input = *program++) != EOF){
+        switch(input){
+            case '>':
+                bfir_push(ir, INC, 0);
+                break;
+            case '<':
+                bfir_push(ir, DEC, 0);
+                break;
+            case '+':
+                bfir_push(ir, ADD, 0);
+                break;
+            case '-':
+                bfir_push(ir, SUB, 0);
+                break;
+            case '.':
+                bfir_push(ir, PUT, 0);
+                break;
+            case ',':
+                bfir_push(ir, GET, 0);
+                break;
+            case '[':
+                bfir_push(ir, JZ, label_ct + 1);
+                bfir_push(ir, LABEL, label_ct);
+                if(depth == stack_size){
+                    stack_size *= 2;
+                    loop_stack = realloc(loop_stack, stack_size * sizeof(int32_t));
+                    if(!loop_stack){
+                        CriticalError("Failed to allocate memory");
+                    }
+                }
+                loop_stack[depth++] = label_ct;
+                label_ct += 2;
+                break;
+            case ']':
+                //Try to pop from the stack. If it's empty, you dun goofed
+                if(depth == 0){
+                    fprintf(stderr, "Error: mismatched []\n");
+                    exit(1);
+                }
+                depth--;
+                bfir_push(ir, JNZ, loop_stack[depth]);
+                bfir_push(ir, LABEL, loop_stack[depth] + 1);
+                break;
+        }
+    }
+
+    if(depth != 0){
+        fprintf(stderr, "Error: mismatched []\n");
+        exit(1);
+    }
+    free(loop_stack);
+
+    return ir;
+}
+
+int32_t bfopt_delta(const bfop_t *op){
+    //Signed pointer or cell delta of a T_PTR or T_ARITH op.
+    switch(op->opcode){
+        case INC:
+        case ADD:
+            return 1;
+        case DEC:
+        case SUB:
+            return -1;
+        case INCV:
+        case ADDV:
+            return op->arg;
+        case DECV:
+        case SUBV:
+            return -(op->arg);
+    }
+    return 0;
+}
+
+void bfopt_set_delta(bfop_t *op, int32_t type, int32_t delta){
+    /* Rewrites op to move or add delta in canonical form: the one-step op
+     * for +-1, otherwise the V op going the right way with a positive arg. */
+    int32_t up = type == T_PTR ? INC : ADD;
+    int32_t upv = type == T_PTR ? INCV : ADDV;
+    int32_t down = type == T_PTR ? DEC : SUB;
+    int32_t downv = type == T_PTR ? DECV : SUBV;
+
+    op->arg = 0;
+    if(delta == 1){
+        op->opcode = up;
+    }else if(delta == -1){
+        op->opcode = down;
+    }else if(delta > 0){
+        op->opcode = upv;
+        op->arg = delta;
+    }else{
+        op->opcode = downv;
+        op->arg = -delta;
+    }
+}
+
+bfir_t *bfopt_combine_arith(bfir_t *ir){
+    /* Combine runs of pointer moves and of arithmetic into single ops, in
+     * place. The output is treated as a stack, so when a pair cancels out
+     * the ops on either side of it get a chance to merge too. */
+    size_t out = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t op = ir->ops[i];
+        int32_t type = bfop_type(op.opcode);
+        if(type != T_PTR && type != T_ARITH){
+            ir->ops[out++] = op;
+            continue;
+        }
+
+        int32_t delta = bfopt_delta(&op);
+        if(out > 0 && bfop_type(ir->ops[out - 1].opcode) == type
+                && ir->ops[out - 1].off == op.off){
+            delta += bfopt_delta(&ir->ops[--out]);
+        }
+        if(delta != 0){
+            ir->ops[out].off = op.off;
+            bfopt_set_delta(&ir->ops[out++], type, delta);
+        }
+    }
+    ir->length = out;
+    return ir;
+}
+
+int32_t bfop_structural_eq(const void *op1, const void *op2){
+    bfop_t *lhs = (bfop_t *)op1;
+    bfop_t *rhs = (bfop_t *)op2;
+
+    if(lhs->opcode == rhs->opcode && lhs->arg == rhs->arg && lhs->off == rhs->off){
+        return 1;
+    }
+
+    switch(lhs->opcode){
+        case JZ:
+        case JNZ:
+        case LABEL:
+        case ZERO:
+        case PUT:
+        case GET:
+            return lhs->opcode == rhs->opcode;
+        case ADD:
+            return rhs->opcode == ADD || (rhs->opcode == ADDV && rhs->arg == 1)
+                    || (rhs->opcode == SUBV && rhs->arg == -1);
+        case SUB:
+            return rhs->opcode == SUB || (rhs->opcode == SUBV && rhs->arg == 1)
+                || (rhs->opcode == ADDV && rhs->arg == -1);
+        case INC:
+            return rhs->opcode == INC || (rhs->opcode == INCV && rhs->arg == 1)
+                || (rhs->opcode == DECV && rhs->arg == -1);
+        case DEC:
+            return rhs->opcode == DEC || (rhs->opcode == DECV && rhs->arg == 1)
+                || (rhs->opcode == INCV && rhs->arg == -1);
+        case ADDV:
+            if(rhs->opcode == ADD)
+                return lhs->arg == 1;
+            if(rhs->opcode == SUB)
+                return lhs->arg == -1;
+            if(rhs->opcode == SUBV)
+                return lhs->arg == -(rhs->arg);
+            break;
+        case SUBV:
+            if(rhs->opcode == SUB)
+                return lhs->arg == 1;
+            if(rhs->opcode == ADD)
+                return lhs->arg == -1;
+            if(rhs->opcode == ADDV)
+                return lhs->arg == -(rhs->arg);
+            break;
+        case INCV:
+            if(rhs->opcode == INC)
+                return lhs->arg == 1;
+            if(rhs->opcode == DEC)
+                return lhs->arg == -1;
+            if(rhs->opcode == DECV)
+                return lhs->arg == -(rhs->arg);
+            break;
+        case DECV:
+            if(rhs->opcode == DEC)
+                return lhs->arg == 1;
+            if(rhs->opcode == INC)
+                return lhs->arg == -1;
+            if(rhs->opcode == INCV)
+                return lhs->arg == -(rhs->arg);
+            break;
+
+    }
+    return 0;
+}
+
+static const char *bfopt_filter_ops[] = {
+    "inc", "incv", "dec", "decv", "add", "addv", "sub", "subv",
+    "put", "get", "jnz", "jz", "zero", "mul", "scan"
+};
+
+static const int32_t bfopt_filter_opcodes[] = {
+    INC, INCV, DEC, DECV, ADD, ADDV, SUB, SUBV,
+    PUT, GET, JNZ, JZ, ZERO, MUL, SCAN
+};
+
+static int32_t bfopt_filter_class(int32_t opcode){
+    /* What the filter automaton sees of an op. Moves and arithmetic are
+     * told apart only by type, since their deltas are operands. */
+    switch(bfop_type(opcode)){
+        case T_PTR:
+            return INCV;
+        case T_ARITH:
+            return ADDV;
+    }
+    return opcode;
+}
+
+static bfop_t bfopt_filter_key(int32_t opcode){
+    bfop_t key = {0, bfopt_filter_class(opcode), 0};
+    return key;
+}
+
+static int32_t bfopt_expr_eval(const bfopt_expr_t *e, const int32_t *vals){
+    //Value of e with every variable it uses bound in vals.
+    int64_t v = e->constant;
+    for(int32_t i = 0; i < BFOPT_FILTER_VARS; i++){
+        v += (int64_t)e->coef[i] * vals[i];
+    }
+    return (int32_t)v;
+}
+
+static int32_t bfopt_expr_unify(const bfopt_expr_t *e, int32_t value,
+        int32_t *vals, int32_t *bound){
+    /* Matches e against value. If e has one unbound variable, it is bound to
+     * whatever makes e equal value; the loader makes sure there is never
+     * more than one, and that its coefficient is +-1. */
+    int32_t free_var = -1;
+    int64_t v = e->constant;
+    for(int32_t i = 0; i < BFOPT_FILTER_VARS; i++){
+        if(!e->coef[i]){
+            continue;
+        }
+        if(*bound & (1 << i)){
+            v += (int64_t)e->coef[i] * vals[i];
+        }else{
+            free_var = i;
+        }
+    }
+    if(free_var < 0){
+        return (int32_t)v == value;
+    }
+    vals[free_var] = (int32_t)(((int64_t)value - v) * e->coef[free_var]);
+    *bound |= 1 << free_var;
+    return 1;
+}
+
+static int32_t bfopt_filter_match(const bfopt_filter_t *f, const bfop_t *ops,
+        int32_t *vals, int32_t *labels, int32_t *label_bound){
+    /* Checks ops, which the automaton has already matched op class by op
+     * class against f's pattern, for the operands and guards too. On a
+     * match, vals and labels hold what the pattern bound. */
+    int32_t bound = 0;
+    *label_bound = 0;
+    for(size_t k = 0; k < f->pattern_length; k++){
+        const bfopt_fop_t *p = &f->pattern[k];
+        const bfop_t *op = &ops[k];
+        int32_t ok;
+        switch(bfop_type(op->opcode)){
+            case T_PTR:
+            case T_ARITH:
+                ok = bfopt_expr_unify(&p->arg, bfopt_delta(op), vals, &bound)
+                    && bfopt_expr_unify(&p->off, op->off, vals, &bound);
+                break;
+            case T_BRANCH:
+            {
+                int32_t name = p->arg.constant;
+                if(*label_bound & (1 << name)){
+                    ok = labels[name] == op->arg;
+                }else{
+                    labels[name] = op->arg;
+                    *label_bound |= 1 << name;
+                    ok = 1;
+                }
+                break;
+            }
+            default:
+                ok = bfopt_expr_unify(&p->arg, op->arg, vals, &bound)
+                    && bfopt_expr_unify(&p->off, op->off, vals, &bound);
+                break;
+        }
+        if(!ok){
+            return 0;
+        }
+    }
+
+    for(size_t g = 0; g < f->guard_count; g++){
+        const bfopt_guard_t *guard = &f->guards[g];
+        int32_t lhs = bfopt_expr_eval(&guard->lhs, vals);
+        int32_t rhs = bfopt_expr_eval(&guard->rhs, vals);
+        int32_t ok = 0;
+        switch(guard->test){
+            case BFOPT_ODD: ok = lhs & 1; break;
+            case BFOPT_EVEN: ok = !(lhs & 1); break;
+            case BFOPT_EQ: ok = lhs == rhs; break;
+            case BFOPT_NE: ok = lhs != rhs; break;
+            case BFOPT_LT: ok = lhs < rhs; break;
+            case BFOPT_LE: ok = lhs <= rhs; break;
+            case BFOPT_GT: ok = lhs > rhs; break;
+            case BFOPT_GE: ok = lhs >= rhs; break;
+        }
+        if(!ok){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int32_t bfopt_ac_child(const bfopt_filters_t *filters, int32_t node, const bfop_t *key){
+    for(int32_t c = filters->nodes[node].child; c >= 0; c = filters->nodes[c].sibling){
+        const bfop_t *k = &filters->nodes[c].key;
+        if(k->opcode == key->opcode && k->arg == key->arg && k->off == key->off){
+            return c;
+        }
+    }
+    return -1;
+}
+
+static int32_t bfopt_ac_node(bfopt_filters_t *filters, int32_t parent, const bfop_t *key){
+    //Appends a child of parent on key and returns it.
+    if(filters->node_count == filters->node_capacity){
+        filters->node_capacity *= 2;
+        filters->nodes = realloc(filters->nodes,
+                            filters->node_capacity * sizeof(bfopt_acnode_t));
+        if(!filters->nodes){
+            CriticalError("Failed to allocate memory");
+        }
+    }
+    int32_t node = filters->node_count++;
+    bfopt_acnode_t *n = &filters->nodes[node];
+    n->key = *key;
+    n->child = -1;
+    n->fail = 0;
+    n->first = -1;
+    n->dict = -1;
+    if(parent >= 0){
+        n->sibling = filters->nodes[parent].child;
+        filters->nodes[parent].child = node;
+    }else{
+        n->sibling = -1;
+    }
+    return node;
+}
+
+static int32_t bfopt_ac_step(const bfopt_filters_t *filters, int32_t node, const bfop_t *op){
+    //The automaton's state after reading op in state node.
+    bfop_t key = bfopt_filter_key(op->opcode);
+    int32_t next;
+    while((next = bfopt_ac_child(filters, node, &key)) < 0 && node){
+        node = filters->nodes[node].fail;
+    }
+    return next < 0 ? 0 : next;
+}
+
+static void bfopt_ac_build(bfopt_filters_t *filters){
+    /* Sets the fail links breadth first, so a node's fail target is always
+     * done before it, and points each node at the nearest node down its
+     * fail chain that ends some filter's pattern. */
+    int32_t *queue = malloc(filters->node_count * sizeof(int32_t));
+    if(!queue){
+        CriticalError("Failed to allocate memory");
+    }
+    size_t head = 0, tail = 0;
+    for(int32_t c = filters->nodes[0].child; c >= 0; c = filters->nodes[c].sibling){
+        filters->nodes[c].fail = 0;
+        filters->nodes[c].dict = -1;
+        queue[tail++] = c;
+    }
+    while(head < tail){
+        int32_t node = queue[head++];
+        for(int32_t c = filters->nodes[node].child; c >= 0; c = filters->nodes[c].sibling){
+            int32_t f = filters->nodes[node].fail;
+            int32_t next;
+            while((next = bfopt_ac_child(filters, f, &filters->nodes[c].key)) < 0 && f){
+                f = filters->nodes[f].fail;
+            }
+            f = next < 0 ? 0 : next;
+            filters->nodes[c].fail = f;
+            filters->nodes[c].dict = filters->nodes[f].first >= 0 ? f
+                                        : filters->nodes[f].dict;
+            queue[tail++] = c;
+        }
+    }
+    free(queue);
+    filters->built = 1;
+}
+
+void bfopt_filters_init(bfopt_filters_t *filters){
+    filters->filters = NULL;
+    filters->count = filters->capacity = 0;
+    filters->node_count = 0;
+    filters->node_capacity = 64;
+    filters->nodes = malloc(filters->node_capacity * sizeof(bfopt_acnode_t));
+    if(!filters->nodes){
+        CriticalError("Failed to allocate memory");
+    }
+    bfop_t root = {0, -1, 0};
+    bfopt_ac_node(filters, -1, &root);
+    filters->built = 1;
+}
+
+void bfopt_filters_free(bfopt_filters_t *filters){
+    for(size_t i = 0; i < filters->count; i++){
+        free(filters->filters[i].pattern);
+        free(filters->filters[i].guards);
+        free(filters->filters[i].replace);
+        free(filters->filters[i].origin);
+    }
+    free(filters->filters);
+    free(filters->nodes);
+    filters->filters = NULL;
+    filters->nodes = NULL;
+    filters->count = filters->capacity = 0;
+    filters->node_count = filters->node_capacity = 0;
+}
+
+static void bfopt_filters_insert(bfopt_filters_t *filters, bfopt_filter_t *f){
+    /* Takes ownership of f's arrays and adds it to the set. Filters ending
+     * at the same node are tried in the order they were added. */
+    if(filters->count == filters->capacity){
+        filters->capacity = filters->capacity ? filters->capacity * 2 : 8;
+        filters->filters = realloc(filters->filters,
+                            filters->capacity * sizeof(bfopt_filter_t));
+        if(!filters->filters){
+            CriticalError("Failed to allocate memory");
+        }
+    }
+    int32_t id = filters->count++;
+    filters->filters[id] = *f;
+    filters->filters[id].next = -1;
+
+    int32_t node = 0;
+    for(size_t i = 0; i < f->pattern_length; i++){
+        bfop_t key = bfopt_filter_key(f->pattern[i].opcode);
+        int32_t next = bfopt_ac_child(filters, node, &key);
+        node = next < 0 ? bfopt_ac_node(filters, node, &key) : next;
+    }
+    int32_t *link = &filters->nodes[node].first;
+    while(*link >= 0){
+        link = &filters->filters[*link].next;
+    }
+    *link = id;
+    filters->built = 0;
+}
+
+static bfopt_fop_t *bfopt_fops_from_ir(const bfir_t *ir, int32_t *labels){
+    //Constant filter ops for a literal op sequence.
+    bfopt_fop_t *fops = calloc(ir->length ? ir->length : 1, sizeof(bfopt_fop_t));
+    if(!fops){
+        CriticalError("Failed to allocate memory");
+    }
+    for(size_t i = 0; i < ir->length; i++){
+        const bfop_t *op = &ir->ops[i];
+        fops[i].opcode = bfopt_filter_class(op->opcode);
+        switch(bfop_type(op->opcode)){
+            case T_PTR:
+            case T_ARITH:
+                fops[i].arg.constant = bfopt_delta(op);
+                break;
+            case T_BRANCH:
+                if(op->arg < 0 || op->arg >= BFOPT_FILTER_VARS){
+                    CriticalError("Filter label out of range");
+                }
+                if(op->arg >= *labels){
+                    *labels = op->arg + 1;
+                }
+                /* Fall through */
+            default:
+                fops[i].arg.constant = op->arg;
+                break;
+        }
+        fops[i].off.constant = op->off;
+    }
+    return fops;
+}
+
+void bfopt_filters_add(bfopt_filters_t *filters, const bfir_t *pattern, const bfir_t *replace){
+    /* Adds a filter with no variables to the set. Label numbers are names,
+     * as in a .flt file. An empty pattern is ignored. */
+    if(pattern->length == 0){
+        return;
+    }
+    bfopt_filter_t f;
+    memset(&f, 0, sizeof(f));
+    f.pattern = bfopt_fops_from_ir(pattern, &f.labels);
+    f.pattern_length = pattern->length;
+    f.replace = bfopt_fops_from_ir(replace, &f.labels);
+    f.replace_length = replace->length;
+    bfopt_filters_insert(filters, &f);
+}
+
+static void bfopt_filter_error(const char *filename, int32_t line, const char *msg,
+        const char *token){
+    fprintf(stderr, "Error: bad filter %s line %d: %s \"%s\"\n", filename, line,
+            msg, token);
+    exit(1);
+}
+
+static int32_t bfopt_parse_var(const char **s, char (*names)[24], int32_t *count){
+    /* Reads a $name at *s and returns its variable number, numbering names
+     * in order of first appearance. Returns -1 if there are too many. */
+    const char *p = *s + 1;
+    size_t n = 0;
+    while((p[n] >= 'a' && p[n] <= 'z') || (p[n] >= 'A' && p[n] <= 'Z')
+            || (p[n] >= '0' && p[n] <= '9') || p[n] == '_'){
+        n++;
+    }
+    if(n == 0 || n >= sizeof(names[0])){
+        return -1;
+    }
+    *s = p + n;
+    for(int32_t i = 0; i < *count; i++){
+        if(strlen(names[i]) == n && !strncmp(names[i], p, n)){
+            return i;
+        }
+    }
+    if(*count == BFOPT_FILTER_VARS){
+        return -1;
+    }
+    memcpy(names[*count], p, n);
+    names[*count][n] = '\0';
+    return (*count)++;
+}
+
+static int32_t bfopt_parse_expr(const char *s, bfopt_expr_t *e, char (*names)[24],
+        int32_t *count){
+    /* Parses a sum of terms such as "-$a", "$a+$b" or "2*$a-1", where a term
+     * is a number, a variable, or a number times a variable. Returns 0 if s
+     * is not one. */
+    memset(e, 0, sizeof(*e));
+    int32_t first = 1;
+    while(*s){
+        int32_t sign = 1;
+        if(*s == '+' || *s == '-'){
+            sign = *s++ == '-' ? -1 : 1;
+        }else if(!first){
+            return 0;
+        }
+        first = 0;
+        if(*s == '$'){
+            int32_t v = bfopt_parse_var(&s, names, count);
+            if(v < 0){
+                return 0;
+            }
+            e->coef[v] += sign;
+        }else if(*s >= '0' && *s <= '9'){
+            char *end;
+            int32_t n = (int32_t)strtol(s, &end, 10);
+            s = end;
+            if(*s == '*'){
+                s++;
+                int32_t v = *s == '$' ? bfopt_parse_var(&s, names, count) : -1;
+                if(v < 0){
+                    return 0;
+                }
+                e->coef[v] += sign * n;
+            }else{
+                e->constant += sign * n;
+            }
+        }else{
+            return 0;
+        }
+    }
+    return !first;
+}
+
+static int32_t bfopt_expr_vars(const bfopt_expr_t *e){
+    //Bitmask of the variables e uses.
+    int32_t mask = 0;
+    for(int32_t i = 0; i < BFOPT_FILTER_VARS; i++){
+        if(e->coef[i]){
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+static void bfopt_expr_negate(bfopt_expr_t *e){
+    e->constant = -e->constant;
+    for(int32_t i = 0; i < BFOPT_FILTER_VARS; i++){
+        e->coef[i] = -e->coef[i];
+    }
+}
+
+static int32_t bfopt_parse_fop(char **tok, int32_t ntok, bfopt_fop_t *f,
+        char (*names)[24], int32_t *count){
+    /* Parses one op line of a filter into f. Returns 0 if it is malformed. */
+    memset(f, 0, sizeof(*f));
+    int32_t cmd = LABEL;
+    for(size_t i = 0; i < sizeof(bfopt_filter_opcodes) / sizeof(int32_t); i++){
+        if(!strcmp(tok[0], bfopt_filter_ops[i])){
+            cmd = bfopt_filter_opcodes[i];
+            break;
+        }
+    }
+    f->opcode = bfopt_filter_class(cmd);
+
+    int32_t at = 1;
+    switch(cmd){
+        case INC:
+        case ADD:
+            f->arg.constant = 1;
+            break;
+        case DEC:
+        case SUB:
+            f->arg.constant = -1;
+            break;
+        case INCV:
+        case DECV:
+        case ADDV:
+        case SUBV:
+        case SCAN:
+            if(ntok < 2 || !bfopt_parse_expr(tok[1], &f->arg, names, count)){
+                return 0;
+            }
+            if(cmd == DECV || cmd == SUBV){
+                bfopt_expr_negate(&f->arg);
+            }
+            at = 2;
+            break;
+        case MUL:
+            if(ntok < 3 || !bfopt_parse_expr(tok[1], &f->arg, names, count)
+                    || !bfopt_parse_expr(tok[2], &f->off, names, count)){
+                return 0;
+            }
+            at = 3;
+            break;
+        case JNZ:
+        case JZ:
+            if(ntok < 2 || sscanf(tok[1], "L%d", &f->arg.constant) != 1){
+                return 0;
+            }
+            at = 2;
+            break;
+        case LABEL:
+            if(sscanf(tok[0], "L%d:", &f->arg.constant) != 1){
+                return 0;
+            }
+            break;
+    }
+    if(bfop_type(cmd) == T_BRANCH && (f->arg.constant < 0
+                || f->arg.constant >= BFOPT_FILTER_VARS)){
+        return 0;
+    }
+
+    switch(bfop_type(cmd)){
+        case T_ARITH:
+        case T_IO:
+        case T_ZERO:
+            if(at < ntok && tok[at][0] == '@'){
+                if(!bfopt_parse_expr(tok[at] + 1, &f->off, names, count)){
+                    return 0;
+                }
+                at++;
+            }
+            break;
+    }
+    return at == ntok;
+}
+
+static int32_t bfopt_parse_guard(char **tok, int32_t ntok, bfopt_guard_t *g,
+        char (*names)[24], int32_t *count){
+    /* Parses "expr odd", "expr even" or "expr OP expr" for a comparison OP.
+     * Returns 0 if the line is none of those. */
+    const char *tests[] = {"odd", "even", "==", "!=", "<", "<=", ">", ">="};
+    memset(g, 0, sizeof(*g));
+    if(ntok < 2 || !bfopt_parse_expr(tok[0], &g->lhs, names, count)){
+        return 0;
+    }
+    g->test = -1;
+    for(int32_t i = 0; i < 8; i++){
+        if(!strcmp(tok[1], tests[i])){
+            g->test = i;
+        }
+    }
+    if(g->test == BFOPT_ODD || g->test == BFOPT_EVEN){
+        return ntok == 2;
+    }
+    return g->test >= 0 && ntok == 3
+        && bfopt_parse_expr(tok[2], &g->rhs, names, count);
+}
+
+static void bfopt_filter_push(void **items, size_t *length, size_t *capacity,
+        size_t size, const void *item){
+    if(*length == *capacity){
+        *capacity = *capacity ? *capacity * 2 : 8;
+        *items = realloc(*items, *capacity * size);
+        if(!*items){
+            CriticalError("Failed to allocate memory");
+        }
+    }
+    memcpy((char *)*items + (*length)++ * size, item, size);
+}
+
+static void bfopt_filter_finish(bfopt_filters_t *filters, bfopt_filter_t *f,
+        const char *filename, int32_t line){
+    /* Checks that every variable and label can be worked out from a match
+     * before adding f to the set. Pattern operands are unified left to
+     * right, so each one may bring in at most one new variable, and only
+     * with a coefficient of +-1 so its value is always a whole number. */
+    if(f->pattern_length == 0){
+        bfopt_filter_error(filename, line, "empty pattern", "pattern");
+    }
+    int32_t bound = 0;
+    for(size_t k = 0; k < f->pattern_length; k++){
+        const bfopt_fop_t *p = &f->pattern[k];
+        const bfopt_expr_t *exprs[] = {&p->arg, &p->off};
+        for(int32_t x = 0; x < 2; x++){
+            if(bfop_type(p->opcode) == T_BRANCH && x == 0){
+                continue;
+            }
+            int32_t fresh = bfopt_expr_vars(exprs[x]) & ~bound;
+            if(fresh & (fresh - 1)){
+                bfopt_filter_error(filename, line,
+                    "pattern operand with more than one new variable", "pattern");
+            }
+            for(int32_t i = 0; i < BFOPT_FILTER_VARS; i++){
+                if((fresh & (1 << i)) && abs(exprs[x]->coef[i]) != 1){
+                    bfopt_filter_error(filename, line,
+                        "new variable with a coefficient other than 1 or -1", "pattern");
+                }
+            }
+            bound |= fresh;
+        }
+    }
+    for(size_t g = 0; g < f->guard_count; g++){
+        if((bfopt_expr_vars(&f->guards[g].lhs) | bfopt_expr_vars(&f->guards[g].rhs))
+                & ~bound){
+            bfopt_filter_error(filename, line, "variable not in the pattern", "where");
+        }
+    }
+    for(size_t k = 0; k < f->replace_length; k++){
+        const bfopt_fop_t *r = &f->replace[k];
+        int32_t vars = bfopt_expr_vars(&r->off);
+        if(bfop_type(r->opcode) != T_BRANCH){
+            vars |= bfopt_expr_vars(&r->arg);
+        }
+        if(vars & ~bound){
+            bfopt_filter_error(filename, line, "variable not in the pattern", "replace");
+        }
+    }
+
+    f->origin = malloc(strlen(filename) + 16);
+    if(!f->origin){
+        CriticalError("Failed to allocate memory");
+    }
+    sprintf(f->origin, "%s:%d", filename, line);
+
+    const bfopt_fop_t *lists[] = {f->pattern, f->replace};
+    size_t lengths[] = {f->pattern_length, f->replace_length};
+    for(int32_t l = 0; l < 2; l++){
+        for(size_t k = 0; k < lengths[l]; k++){
+            if(bfop_type(lists[l][k].opcode) == T_BRANCH
+                    && lists[l][k].arg.constant >= f->labels){
+                f->labels = lists[l][k].arg.constant + 1;
+            }
+        }
+    }
+    bfopt_filters_insert(filters, f);
+    memset(f, 0, sizeof(*f));
+}
+
+void bfopt_filters_parse(bfopt_filters_t *filters, FILE *input, const char *filename){
+    /* Reads filters from input, one op or guard per line; see the Filters
+     * section of bytecode_spec.txt. A file may hold any number of them. */
+    char buf[256];
+    char *tok[8];
+    char names[BFOPT_FILTER_VARS][24];
+    int32_t count = 0, line = 0, start = 0;
+    enum {NONE, PATTERN, WHERE, REPLACE} section = NONE;
+    bfopt_filter_t f;
+    memset(&f, 0, sizeof(f));
+    size_t pattern_capacity = 0, guard_capacity = 0, replace_capacity = 0;
+
+    while(fgets(buf, sizeof(buf), input)){
+        line++;
+        char *hash = strchr(buf, '#');
+        if(hash){
+            *hash = '\0';
+        }
+        int32_t ntok = 0;
+        for(char *t = strtok(buf, " \t\r\n"); t; t = strtok(NULL, " \t\r\n")){
+            if(ntok == 8){
+                bfopt_filter_error(filename, line, "too many tokens", tok[0]);
+            }
+            tok[ntok++] = t;
+        }
+        if(ntok == 0){
+            continue;
+        }
+
+        if(ntok == 1 && !strcmp(tok[0], "pattern")){
+            if(section != NONE && section != REPLACE){
+                bfopt_filter_error(filename, start, "missing section", "replace");
+            }
+            if(section != NONE){
+                bfopt_filter_finish(filters, &f, filename, start);
+                pattern_capacity = guard_capacity = replace_capacity = 0;
+            }
+            count = 0;
+            start = line;
+            section = PATTERN;
+        }else if(ntok == 1 && !strcmp(tok[0], "where") && section == PATTERN){
+            section = WHERE;
+        }else if(ntok == 1 && !strcmp(tok[0], "replace")
+                && (section == PATTERN || section == WHERE)){
+            section = REPLACE;
+        }else if(section == WHERE){
+            bfopt_guard_t g;
+            if(!bfopt_parse_guard(tok, ntok, &g, names, &count)){
+                bfopt_filter_error(filename, line, "bad guard", tok[0]);
+            }
+            bfopt_filter_push((void **)&f.guards, &f.guard_count, &guard_capacity,
+                sizeof(g), &g);
+        }else if(section == PATTERN || section == REPLACE){
+            bfopt_fop_t op;
+            if(!bfopt_parse_fop(tok, ntok, &op, names, &count)){
+                bfopt_filter_error(filename, line, "bad op", tok[0]);
+            }
+            if(section == PATTERN){
+                bfopt_filter_push((void **)&f.pattern, &f.pattern_length,
+                    &pattern_capacity, sizeof(op), &op);
+            }else{
+                bfopt_filter_push((void **)&f.replace, &f.replace_length,
+                    &replace_capacity, sizeof(op), &op);
+            }
+        }else{
+            bfopt_filter_error(filename, line, "unexpected", tok[0]);
+        }
+    }
+    if(section != REPLACE){
+        bfopt_filter_error(filename, start, "missing section", "replace");
+    }
+    bfopt_filter_finish(filters, &f, filename, start);
+}
+
+void bfopt_filters_load(bfopt_filters_t *filters, const char *filename){
+    //Adds the filters in a .flt file to the set.
+    FILE *input = fopen(filename, "r");
+    if(!input){
+        CriticalError("Could not open file");
+    }
+    bfopt_filters_parse(filters, input, filename);
+    fclose(input);
+}
+
+static void bfopt_filter_emit(bfir_t *pending, const bfopt_filter_t *f,
+        const int32_t *vals, const int32_t *labels, int32_t label_bound,
+        int32_t label){
+    /* Pushes f's replacement onto pending in reverse, so it pops off in
+     * order. Labels the pattern matched keep their numbers; the rest are
+     * numbered from label up. Moves and arithmetic that come to nothing
+     * are left out. */
+    for(size_t k = f->replace_length; k-- > 0;){
+        const bfopt_fop_t *r = &f->replace[k];
+        bfop_t op = {0, r->opcode, bfopt_expr_eval(&r->off, vals)};
+        int32_t type = bfop_type(r->opcode);
+        if(type == T_BRANCH){
+            int32_t name = r->arg.constant;
+            op.arg = (label_bound & (1 << name)) ? labels[name] : label + name;
+        }else if(type == T_PTR || type == T_ARITH){
+            int32_t delta = bfopt_expr_eval(&r->arg, vals);
+            if(delta == 0){
+                continue;
+            }
+            bfopt_set_delta(&op, type, delta);
+        }else{
+            op.arg = bfopt_expr_eval(&r->arg, vals);
+        }
+        *bfir_push(pending, 0, 0) = op;
+    }
+}
+
+bfir_t *bfopt_apply_filters(bfir_t *ir, bfopt_filters_t *filters){
+    /* Applies every filter in the set in one left to right pass. The output
+     * is treated as a stack, with the automaton's state recorded after each
+     * op. When the ops on top fit a filter's pattern, operands and guards
+     * included, they are popped, the state rewinds to what it was below
+     * them, and the replacement is fed back in ahead of the rest of the
+     * input. That way a replacement gets matched together with whatever is
+     * on either side of it, and overlapping filters reach a fixed point
+     * without rescanning. Longer patterns are tried first, then filters in
+     * the order they were added. */
+    if(filters->count == 0){
+        return ir;
+    }
+    if(!filters->built){
+        bfopt_ac_build(filters);
+    }
+
+    int32_t label = -1;
+    for(size_t i = 0; i < ir->length; i++){
+        /*Find the highest loop label so as to avoid labelling conflicts */
+        if(ir->ops[i].opcode == LABEL && ir->ops[i].arg > label){
+            label = ir->ops[i].arg;
+        }
+    }
+    label++;
+
+    bfir_t out, pending;
+    bfir_init(&out);
+    bfir_init(&pending);
+    bfir_reserve(&out, ir->length);
+    size_t state_capacity = out.capacity;
+    int32_t *states = malloc(state_capacity * sizeof(int32_t));
+    if(!states){
+        CriticalError("Failed to allocate memory");
+    }
+    int32_t vals[BFOPT_FILTER_VARS], labels[BFOPT_FILTER_VARS], label_bound;
+    size_t i = 0, rewrites = 0;
+    int32_t state = 0;
+    while(pending.length || i < ir->length){
+        bfop_t op = pending.length ? pending.ops[--pending.length] : ir->ops[i++];
+        state = bfopt_ac_step(filters, state, &op);
+        *bfir_push(&out, 0, 0) = op;
+        if(out.length > state_capacity){
+            state_capacity = out.capacity;
+            states = realloc(states, state_capacity * sizeof(int32_t));
+            if(!states){
+                CriticalError("Failed to allocate memory");
+            }
+        }
+        states[out.length - 1] = state;
+
+        bfopt_filter_t *f = NULL;
+        int32_t node = filters->nodes[state].first >= 0 ? state
+                            : filters->nodes[state].dict;
+        for(; node >= 0 && !f; node = filters->nodes[node].dict){
+            for(int32_t id = filters->nodes[node].first; id >= 0;
+                    id = filters->filters[id].next){
+                bfopt_filter_t *c = &filters->filters[id];
+                if(bfopt_filter_match(c, &out.ops[out.length - c->pattern_length],
+                            vals, labels, &label_bound)){
+                    f = c;
+                    break;
+                }
+            }
+        }
+        if(!f){
+            continue;
+        }
+        if(++rewrites > BFOPT_REWRITES * (ir->length + 1)){
+            CriticalError("Filters keep rewriting each other's output");
+        }
+        out.length -= f->pattern_length;
+        state = out.length ? states[out.length - 1] : 0;
+        bfopt_filter_emit(&pending, f, vals, labels, label_bound, label);
+        f->hits++;
+        label += f->labels;
+    }
+
+    bfir_swap(ir, &out);
+    bfir_free(&out);
+    bfir_free(&pending);
+    free(states);
+    return ir;
+}
+
+bfir_t *bfopt_apply_filter(bfir_t *ir, const bfir_t *pattern, const bfir_t *replace){
+    //Applies a single filter, as a set of one.
+    bfopt_filters_t filters;
+    bfopt_filters_init(&filters);
+    bfopt_filters_add(&filters, pattern, replace);
+    bfopt_apply_filters(ir, &filters);
+    bfopt_filters_free(&filters);
+    return ir;
+}
+
+/* filters/zero.flt, built in so bfi and the unit tests don't need it */
+static const char bfopt_zero_filter[] =
+    "pattern\n"
+    "jz L0\n"
+    "L1:\n"
+    "addv $a\n"
+    "jnz L1\n"
+    "L0:\n"
+    "where\n"
+    "$a odd\n"
+    "replace\n"
+    "zero\n";
+
+bfir_t *bfopt_make_zeros(bfir_t *ir){
+    //Replaces [-], [+] and any loop adding an odd amount with ZERO.
+    FILE *input = fmemopen((void *)bfopt_zero_filter, strlen(bfopt_zero_filter), "r");
+    if(!input){
+        CriticalError("Failed to allocate memory");
+    }
+    bfopt_filters_t filters;
+    bfopt_filters_init(&filters);
+    bfopt_filters_parse(&filters, input, "zero");
+    fclose(input);
+    bfopt_apply_filters(ir, &filters);
+    bfopt_filters_free(&filters);
+    return ir;
+}
+
+static size_t bfopt_scan_loop(const bfir_t *ir, size_t start, int32_t *offs,
+        int32_t *deltas, size_t *cells){
+    /* If ops[start] opens a loop whose body is only moves and arithmetic and
+     * which leaves the pointer where it found it, records the net change to
+     * each cell it touches and returns the index just past the loop.
+     * Returns 0 otherwise. */
+    const bfop_t *ops = ir->ops;
+    if(ops[start].opcode != JZ || start + 1 >= ir->length
+            || ops[start + 1].opcode != LABEL){
+        return 0;
+    }
+
+    int32_t pos = 0;
+    size_t n = 0, j;
+    for(j = start + 2; j < ir->length; j++){
+        int32_t type = bfop_type(ops[j].opcode);
+        if(type == T_PTR){
+            pos += bfopt_delta(&ops[j]);
+        }else if(type == T_ARITH){
+            size_t k = 0;
+            int32_t at = pos + ops[j].off;
+            while(k < n && offs[k] != at){
+                k++;
+            }
+            if(k == n){
+                if(n == BFOPT_MUL_CELLS){
+                    return 0;
+                }
+                offs[n] = at;
+                deltas[n++] = 0;
+            }
+            deltas[k] += bfopt_delta(&ops[j]);
+        }else{
+            break;
+        }
+    }
+
+    if(j + 1 >= ir->length || pos != 0
+            || ops[j].opcode != JNZ || ops[j].arg != ops[start + 1].arg
+            || ops[j + 1].opcode != LABEL || ops[j + 1].arg != ops[start].arg){
+        return 0;
+    }
+    *cells = n;
+    return j + 2;
+}
+
+bfir_t *bfopt_make_muls(bfir_t *ir){
+    /* Rewrites balanced loops that step their own cell by one, like
+     * [->+>+++<<], into a MUL for every other cell they touch followed by a
+     * ZERO. MUL adds the loop cell times arg to the cell off away, so
+     * [->+>+++<<] becomes MUL 1 @1; MUL 3 @2; ZERO and [-] is a bare ZERO.
+     * The rewrite is never longer than the loop, so it happens in place. */
+    int32_t offs[BFOPT_MUL_CELLS], deltas[BFOPT_MUL_CELLS];
+    size_t out = 0, i = 0, cells, end;
+    while(i < ir->length){
+        end = bfopt_scan_loop(ir, i, offs, deltas, &cells);
+
+        int32_t step = 0;
+        for(size_t k = 0; end && k < cells; k++){
+            if(offs[k] == 0){
+                step = (uint8_t)deltas[k];
+            }
+        }
+        if(step != 1 && step != UINT8_MAX){
+            /* Not one of ours, or the loop cell isn't counted down (or up)
+             * by exactly one per trip, so the trip count is unknown */
+            ir->ops[out++] = ir->ops[i++];
+            continue;
+        }
+
+        /* Counting up from x by one takes 256 - x trips, which is -x */
+        for(size_t k = 0; k < cells; k++){
+            int32_t factor = (int8_t)(step == 1 ? -deltas[k] : deltas[k]);
+            if(offs[k] == 0 || factor == 0){
+                continue;
+            }
+            bfop_t *op = &ir->ops[out++];
+            op->opcode = MUL;
+            op->arg = factor;
+            op->off = offs[k];
+        }
+        bfop_t *op = &ir->ops[out++];
+        op->opcode = ZERO;
+        op->arg = op->off = 0;
+        i = end;
+    }
+    ir->length = out;
+    return ir;
+}
+
+bfir_t *bfopt_make_scans(bfir_t *ir){
+    /* Rewrites loops whose body is a single move, like [>] or [<<<<], into
+     * a SCAN that steps the pointer by arg until it lands on a zero cell.
+     * Backends can then search the tape a block at a time. In place. */
+    size_t out = 0, i = 0;
+    while(i < ir->length){
+        const bfop_t *ops = &ir->ops[i];
+        int32_t stride = 0;
+        if(i + 4 < ir->length && ops[0].opcode == JZ && ops[1].opcode == LABEL
+                && bfop_type(ops[2].opcode) == T_PTR
+                && ops[3].opcode == JNZ && ops[3].arg == ops[1].arg
+                && ops[4].opcode == LABEL && ops[4].arg == ops[0].arg){
+            stride = bfopt_delta(&ops[2]);
+        }
+        if(stride == 0){
+            ir->ops[out++] = ir->ops[i++];
+            continue;
+        }
+        bfop_t *op = &ir->ops[out++];
+        op->opcode = SCAN;
+        op->arg = stride;
+        op->off = 0;
+        i += 5;
+    }
+    ir->length = out;
+    return ir;
+}
+
+bfir_t *bfopt_defer_moves(bfir_t *ir){
+    /* Folds pointer moves into the offsets of the arithmetic, ZERO and I/O
+     * ops after them, so a straight-line block like >+>>-<<<+ moves the
+     * pointer at most once. The pending move is made real before branches
+     * and labels, which test or expect the real pointer, before MULs, whose
+     * offsets are relative to it, and at the end of the program. Every
+     * dropped move made room for at most one of those, so this runs in
+     * place. */
+    size_t out = 0;
+    int32_t pending = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t op = ir->ops[i];
+        switch(bfop_type(op.opcode)){
+            case T_PTR:
+                pending += bfopt_delta(&op);
+                continue;
+            case T_ARITH:
+            case T_IO:
+            case T_ZERO:
+                op.off += pending;
+                ir->ops[out++] = op;
+                continue;
+        }
+        if(pending){
+            ir->ops[out].off = 0;
+            bfopt_set_delta(&ir->ops[out++], T_PTR, pending);
+            pending = 0;
+        }
+        ir->ops[out++] = op;
+    }
+    if(pending){
+        ir->ops[out].off = 0;
+        bfopt_set_delta(&ir->ops[out++], T_PTR, pending);
+    }
+    ir->length = out;
+    return ir;
+}
+
+static void bfopt_known_reset(bfopt_known_t *k){
+    k->count = 0;
+    k->tape = NULL;
+    k->lo = k->hi = 0;
+    k->reached = 1;
+}
+
+static int32_t bfopt_known_get(const bfopt_known_t *k, int32_t off){
+    //Returns the value of the cell at off, or -1 if it isn't known.
+    for(int32_t i = 0; i < k->count; i++){
+        if(k->offs[i] == off){
+            return k->vals[i];
+        }
+    }
+    int64_t at = k->pos + off;
+    if(!k->tape || at < 0){
+        return -1;
+    }
+    return (size_t)at < k->cells ? k->tape[at] : 0;
+}
+
+static void bfopt_known_set(bfopt_known_t *k, int32_t off, int32_t val){
+    /* Records the cell at off as holding val, or as unknown if val is -1.
+     * With no room left, the starting tape goes first, since forgetting it
+     * leaves everything not listed unknown, and then the oldest entry. */
+    int32_t i;
+    for(i = 0; i < k->count && k->offs[i] != off; i++);
+    if(i == k->count && !k->tape && val < 0){
+        return;
+    }
+    if(i < k->count && !k->tape && val < 0){
+        memmove(&k->offs[i], &k->offs[i + 1], (k->count - i - 1) * sizeof(int32_t));
+        memmove(&k->vals[i], &k->vals[i + 1], (k->count - i - 1) * sizeof(int32_t));
+        k->count--;
+        return;
+    }
+    if(i == BFOPT_KNOWN_CELLS){
+        int32_t kept = 0;
+        k->tape = NULL;
+        for(int32_t j = 0; j < k->count; j++){
+            if(k->vals[j] >= 0){
+                k->offs[kept] = k->offs[j];
+                k->vals[kept++] = k->vals[j];
+            }
+        }
+        k->count = kept;
+        if(kept == BFOPT_KNOWN_CELLS){
+            memmove(&k->offs[0], &k->offs[1], (kept - 1) * sizeof(int32_t));
+            memmove(&k->vals[0], &k->vals[1], (kept - 1) * sizeof(int32_t));
+            k->count--;
+        }
+        if(val < 0){
+            return;
+        }
+        i = k->count;
+    }
+    if(i == k->count){
+        k->offs[k->count++] = off;
+    }
+    k->vals[i] = val < 0 ? -1 : (uint8_t)val;
+}
+
+static void bfopt_known_move(bfopt_known_t *k, int32_t diff){
+    for(int32_t i = 0; i < k->count; i++){
+        k->offs[i] -= diff;
+    }
+    k->pos += diff;
+    k->lo = k->lo - diff < 0 ? k->lo - diff : 0;
+    k->hi = k->hi - diff > 0 ? k->hi - diff : 0;
+}
+
+static int32_t bfopt_known_reach(bfopt_known_t *k, int32_t off){
+    /* Returns whether the cell at off is already known to be on the tape,
+     * and notes that it is from now on. */
+    int64_t at = k->pos + off;
+    if((off >= k->lo && off <= k->hi) || (k->tape && at >= 0 && (size_t)at < k->cells)){
+        return 1;
+    }
+    if(off < k->lo){
+        k->lo = off;
+    }else{
+        k->hi = off;
+    }
+    return 0;
+}
+
+static void bfopt_known_meet(bfopt_known_t *k, const bfopt_known_t *other){
+    //Keeps only what k and other agree on, for a point both can reach.
+    bfopt_known_t out;
+    if(!other->reached){
+        return;
+    }
+    if(!k->reached){
+        *k = *other;
+        return;
+    }
+    out.count = 0;
+    out.reached = 1;
+    out.tape = k->tape && k->tape == other->tape && k->pos == other->pos ? k->tape : NULL;
+    out.cells = k->cells;
+    out.pos = k->pos;
+    out.lo = k->lo > other->lo ? k->lo : other->lo;
+    out.hi = k->hi < other->hi ? k->hi : other->hi;
+    for(int32_t side = 0; side < 2; side++){
+        const bfopt_known_t *from = side ? other : k;
+        for(int32_t i = 0; i < from->count; i++){
+            int32_t off = from->offs[i];
+            int32_t val = bfopt_known_get(k, off);
+            if(val != bfopt_known_get(other, off)){
+                val = -1;
+            }
+            if(bfopt_known_get(&out, off) != val){
+                bfopt_known_set(&out, off, val);
+            }
+        }
+    }
+    *k = out;
+}
+
+/* Facts waiting at a label for the branches to it, packed to the cells they
+ * list. A big program has many of these at once. */
+typedef struct {
+    const uint8_t *tape;
+    size_t cells;
+    int64_t pos;
+    int32_t lo, hi;
+    int32_t count;
+    int32_t cell[];     /* count offsets, then their values */
+} bfopt_saved_t;
+
+static bfopt_saved_t *bfopt_known_save(bfopt_saved_t *saved, const bfopt_known_t *k){
+    //Packs k into saved, which is reallocated to fit, or allocated if NULL.
+    saved = realloc(saved, sizeof(bfopt_saved_t) + 2 * k->count * sizeof(int32_t));
+    if(!saved){
+        CriticalError("Failed to allocate memory");
+    }
+    saved->tape = k->tape;
+    saved->cells = k->cells;
+    saved->pos = k->pos;
+    saved->lo = k->lo;
+    saved->hi = k->hi;
+    saved->count = k->count;
+    memcpy(saved->cell, k->offs, k->count * sizeof(int32_t));
+    memcpy(saved->cell + k->count, k->vals, k->count * sizeof(int32_t));
+    return saved;
+}
+
+static void bfopt_known_load(bfopt_known_t *k, const bfopt_saved_t *saved){
+    k->tape = saved->tape;
+    k->cells = saved->cells;
+    k->pos = saved->pos;
+    k->lo = saved->lo;
+    k->hi = saved->hi;
+    k->count = saved->count;
+    memcpy(k->offs, saved->cell, saved->count * sizeof(int32_t));
+    memcpy(k->vals, saved->cell + saved->count, saved->count * sizeof(int32_t));
+    k->reached = 1;
+}
+
+bfir_t *bfopt_fold_output(bfir_t *ir, const uint8_t *tape, size_t cells){
+    /* Works out which cells hold values known at compile time and turns each
+     * run of PUTs of known values into one WRITE_CONST of the bytes they
+     * print, kept in ir's data pool. The program is taken to start from tape
+     * (zero past cells), or from unknown cells if tape is NULL.
+     *
+     * Facts flow forward through the program: a forward branch hands its own
+     * to its label, where they meet the ones falling through, and the head of
+     * a loop, which is branched back to, starts out knowing nothing. A run
+     * only continues past ops that can't stop the program, ie. pointer moves
+     * and cell accesses within reach of cells already touched, so merging the
+     * writes never changes what gets printed before a bounds error. */
+    int32_t max_label = -1;
+    for(size_t i = 0; i < ir->length; i++){
+        if(ir->ops[i].opcode == LABEL && ir->ops[i].arg > max_label){
+            max_label = ir->ops[i].arg;
+        }
+    }
+    size_t *where = malloc((max_label + 1) * sizeof(size_t));
+    uint8_t *back = calloc(max_label + 1, sizeof(uint8_t));
+    /* What the forward branches to each label know, until it's reached.
+     * NULL if none can be taken. */
+    bfopt_saved_t **pending = calloc(max_label + 1, sizeof(bfopt_saved_t *));
+    if(max_label >= 0 && (!where || !back || !pending)){
+        CriticalError("Failed to allocate memory");
+    }
+    for(size_t i = 0; i < ir->length; i++){
+        if(ir->ops[i].opcode == LABEL){
+            where[ir->ops[i].arg] = i;
+        }
+    }
+    for(size_t i = 0; i < ir->length; i++){
+        const bfop_t *op = &ir->ops[i];
+        if((op->opcode == JZ || op->opcode == JNZ) && where[op->arg] < i){
+            back[op->arg] = 1;
+        }
+    }
+
+    bfopt_known_t k, edge, other;
+    bfopt_known_reset(&k);
+    k.tape = tape;
+    k.cells = cells;
+    k.pos = 0;
+
+    bfir_t out;
+    bfir_init(&out);
+    bfir_reserve(&out, ir->length);
+    size_t run = 0;
+    int32_t in_run = 0, safe, val, cell;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t op = ir->ops[i];
+        safe = 0;
+        switch(op.opcode){
+            case INC:
+            case INCV:
+            case DEC:
+            case DECV:
+                cell = bfopt_delta(&op);
+                safe = bfopt_known_reach(&k, cell);
+                bfopt_known_move(&k, cell);
+                break;
+            case ADD:
+            case ADDV:
+            case SUB:
+            case SUBV:
+                safe = bfopt_known_reach(&k, op.off);
+                val = bfopt_known_get(&k, op.off);
+                bfopt_known_set(&k, op.off, val < 0 ? -1 : val + bfopt_delta(&op));
+                break;
+            case ZERO:
+                safe = bfopt_known_reach(&k, op.off);
+                bfopt_known_set(&k, op.off, 0);
+                break;
+            case PUT:
+                val = bfopt_known_get(&k, op.off);
+                if(val >= 0 && bfopt_known_reach(&k, op.off)){
+                    if(!in_run){
+                        run = out.length;
+                        bfir_push(&out, WRITE_CONST, out.data_length);
+                        in_run = 1;
+                    }
+                    bfir_push_data(&out, val);
+                    out.ops[run].off++;
+                    continue;
+                }
+                break;
+            case GET:
+                bfopt_known_reach(&k, op.off);
+                bfopt_known_set(&k, op.off, -1);
+                break;
+            case MUL:
+                /* The target only changes, or is even touched, when the loop
+                 * cell isn't zero */
+                cell = bfopt_known_get(&k, 0);
+                safe = cell > 0 ? bfopt_known_reach(&k, op.off)
+                    : op.off >= k.lo && op.off <= k.hi;
+                val = bfopt_known_get(&k, op.off);
+                if(cell != 0){
+                    bfopt_known_set(&k, op.off, cell < 0 || val < 0 ? -1
+                        : val + cell * op.arg);
+                }
+                break;
+            case SCAN:
+                bfopt_known_reset(&k);
+                bfopt_known_set(&k, 0, 0);
+                break;
+            case JZ:
+            case JNZ:
+                /* Taken, a JZ knows its cell is zero; falling through, a JNZ
+                 * does. Edges that can't be taken carry nothing. */
+                cell = bfopt_known_get(&k, 0);
+                if(where[op.arg] > i && (op.opcode == JZ ? cell <= 0 : cell != 0)){
+                    edge = k;
+                    if(op.opcode == JZ){
+                        bfopt_known_set(&edge, 0, 0);
+                    }
+                    if(pending[op.arg]){
+                        bfopt_known_load(&other, pending[op.arg]);
+                        bfopt_known_meet(&edge, &other);
+                    }
+                    pending[op.arg] = bfopt_known_save(pending[op.arg], &edge);
+                }
+                if(op.opcode == JZ ? cell == 0 : cell > 0){
+                    k.reached = 0;
+                }else if(op.opcode == JNZ){
+                    bfopt_known_set(&k, 0, 0);
+                }
+                break;
+            case LABEL:
+                if(back[op.arg]){
+                    bfopt_known_reset(&k);
+                }else if(pending[op.arg]){
+                    bfopt_known_load(&other, pending[op.arg]);
+                    bfopt_known_meet(&k, &other);
+                    free(pending[op.arg]);
+                    pending[op.arg] = NULL;
+                }
+                break;
+        }
+        if(!safe){
+            in_run = 0;
+        }
+        *bfir_push(&out, 0, 0) = op;
+    }
+
+    bfir_swap(ir, &out);
+    bfir_free(&out);
+    for(int32_t label = 0; label <= max_label; label++){
+        free(pending[label]);
+    }
+    free(where);
+    free(back);
+    free(pending);
+    return ir;
+}
+
+static int32_t bfopt_read_at(FILE *input, int32_t *off){
+    /* Reads the optional " @k" cell offset after an op's arguments. Returns
+     * 0 if there is an @ without a number after it. */
+    int c;
+    do{
+        c = fgetc(input);
+    }while(c == ' ' || c == '\t');
+    if(c != '@'){
+        ungetc(c, input);
+        return 1;
+    }
+    return fscanf(input, "%d", off) == 1;
+}
+
+bfir_t *load_bytecode(FILE *input, bfir_t *ir){
+    /* Reads a .bc file as written by bfcc_codegen back into IR.
+     * Anything that is not a known command or a well formed label is a
+     * hard error, since we're about to execute it. */
+    char buf[24];
+    char *commands[] = {
+        "inc",
+        "incv", 
+        "dec", 
+        "decv", 
+        "add",
+        "addv",
+        "sub",
+        "subv",
+        "put",
+        "get",
+        "jnz",
+        "jz",
+        "zero",
+        "mul",
+        "scan"
+    };
+    int32_t opcodes[] = {INC, INCV, DEC, DECV, ADD, ADDV, SUB, SUBV, PUT, GET,
+                            JNZ, JZ, ZERO, MUL, SCAN};
+    int32_t length = sizeof(opcodes) / sizeof(opcodes[0]);
+    int32_t cmd, arg, off, ok;
+
+    while(fscanf(input, "%23s", buf) != EOF){
+        cmd = LABEL;
+        arg = off = 0;
+        for(int i = 0; i < length; i++){
+            if(!strcmp(buf, commands[i])){
+                cmd = opcodes[i];
+                break;
+            }
+        }
+        ok = 1;
+        switch(cmd){
+            case INCV:
+            case DECV:
+            case ADDV:
+            case SUBV:
+                ok = fscanf(input, " %d", &arg) == 1;
+                break;
+            case MUL:
+                ok = fscanf(input, " %d %d", &arg, &off) == 2 && off != 0;
+                break;
+            case SCAN:
+                ok = fscanf(input, " %d", &arg) == 1 && arg != 0;
+                break;
+            case JNZ:
+            case JZ:
+                ok = fscanf(input, " L%d", &arg) == 1 && arg >= 0;
+                break;
+            case LABEL:
+                ok = sscanf(buf, "L%d:", &arg) == 1 && arg >= 0;
+                break;
+        }
+        switch(bfop_type(cmd)){
+            case T_ARITH:
+            case T_IO:
+            case T_ZERO:
+                ok = ok && bfopt_read_at(input, &off);
+                break;
+        }
+        if(!ok){
+            fprintf(stderr, "Error: bad bytecode near \"%s\"\n", buf);
+            exit(1);
+        }
+
+        bfir_push(ir, cmd, arg)->off = off;
+    }
+    return ir;
+}
+
+void apply_filter_file(char *filename, bfir_t *ir){
+    bfopt_filters_t filters;
+    bfopt_filters_init(&filters);
+    bfopt_filters_load(&filters, filename);
+    bfopt_apply_filters(ir, &filters);
+    bfopt_filters_free(&filters);
+}
+
+double bfopt_clock(void){
+    //Monotonic wall clock time in seconds.
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bfopt_stats_add(bfopt_stats_t *stats, size_t ops_in, size_t ops_out, double seconds){
+    /* Records one run of a stage that took the IR from ops_in to ops_out
+     * ops, and the process's peak memory use so far. */
+    struct rusage usage;
+    if(!stats->runs){
+        stats->ops_in = ops_in;
+    }
+    stats->ops_out = ops_out;
+    stats->runs++;
+    stats->seconds += seconds;
+    getrusage(RUSAGE_SELF, &usage);
+    stats->peak_kb = usage.ru_maxrss;
+}
+
+static bfir_t *bfopt_pass_combine(bfir_t *ir, void *data){
+    return bfopt_combine_arith(ir);
+}
+
+static bfir_t *bfopt_pass_filters(bfir_t *ir, void *data){
+    //Without a filter set, only the built in zero filter.
+    return data ? bfopt_apply_filters(ir, data) : bfopt_make_zeros(ir);
+}
+
+static bfir_t *bfopt_pass_muls(bfir_t *ir, void *data){
+    return bfopt_make_muls(ir);
+}
+
+static bfir_t *bfopt_pass_scans(bfir_t *ir, void *data){
+    return bfopt_make_scans(ir);
+}
+
+static bfir_t *bfopt_pass_moves(bfir_t *ir, void *data){
+    return bfopt_defer_moves(ir);
+}
+
+void bfopt_pipeline_init(bfopt_pipeline_t *pl, int32_t level, bfopt_filters_t *filters){
+    /* The standard pipeline at -O level. -O1 merges arithmetic and applies
+     * filters, -O2 adds loop rewriting, and -O3 is left for what the
+     * caller adds, such as compile-time evaluation. */
+    pl->count = 0;
+    pl->level = level;
+    bfopt_pipeline_add(pl, "combine", 1, 1, bfopt_pass_combine, NULL);
+    bfopt_pipeline_add(pl, "filters", 1, 1, bfopt_pass_filters, filters);
+    bfopt_pipeline_add(pl, "muls", 2, 1, bfopt_pass_muls, NULL);
+    bfopt_pipeline_add(pl, "scans", 2, 1, bfopt_pass_scans, NULL);
+    bfopt_pipeline_add(pl, "moves", 2, 0, bfopt_pass_moves, NULL);
+}
+
+void bfopt_pipeline_add(bfopt_pipeline_t *pl, const char *name, int32_t level,
+        int32_t repeat, bfopt_run_t run, void *data){
+    if(pl->count == BFOPT_MAX_PASSES){
+        CriticalError("Too many passes");
+    }
+    bfopt_pass_t *pass = &pl->passes[pl->count++];
+    pass->name = name;
+    pass->level = level;
+    pass->repeat = repeat;
+    pass->enabled = -1;
+    pass->run = run;
+    pass->data = data;
+    memset(&pass->stats, 0, sizeof(pass->stats));
+}
+
+int32_t bfopt_pipeline_set(bfopt_pipeline_t *pl, const char *name, int32_t enabled){
+    /* Turns the named pass on or off whatever the level. Returns 0 if there
+     * is no such pass. */
+    for(int32_t i = 0; i < pl->count; i++){
+        if(!strcmp(pl->passes[i].name, name)){
+            pl->passes[i].enabled = enabled;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int32_t bfopt_pipeline_enabled(const bfopt_pipeline_t *pl, const bfopt_pass_t *pass){
+    return pass->enabled >= 0 ? pass->enabled : pl->level >= pass->level;
+}
+
+bfir_t *bfopt_pipeline_run(bfopt_pipeline_t *pl, bfir_t *ir){
+    /* Runs the enabled passes in order. A group of repeating passes goes
+     * round until a whole round leaves the IR as it found it, or it has
+     * had BFOPT_MAX_ROUNDS goes. */
+    bfop_t *before = NULL;
+    size_t before_capacity = 0;
+    int32_t i = 0;
+    while(i < pl->count){
+        int32_t end = i + 1;
+        if(pl->passes[i].repeat){
+            while(end < pl->count && pl->passes[end].repeat){
+                end++;
+            }
+        }
+        for(int32_t round = 0; round < BFOPT_MAX_ROUNDS; round++){
+            if(pl->passes[i].repeat){
+                if(ir->length > before_capacity){
+                    before_capacity = ir->length;
+                    before = realloc(before, before_capacity * sizeof(bfop_t));
+                    if(!before){
+                        CriticalError("Failed to allocate memory");
+                    }
+                }
+                memcpy(before, ir->ops, ir->length * sizeof(bfop_t));
+            }
+            size_t length = ir->length;
+            for(int32_t k = i; k < end; k++){
+                bfopt_pass_t *pass = &pl->passes[k];
+                if(bfopt_pipeline_enabled(pl, pass)){
+                    size_t ops_in = ir->length;
+                    double t0 = bfopt_clock();
+                    pass->run(ir, pass->data);
+                    bfopt_stats_add(&pass->stats, ops_in, ir->length, bfopt_clock() - t0);
+                }
+            }
+            if(!pl->passes[i].repeat || (ir->length == length
+                    && !memcmp(before, ir->ops, length * sizeof(bfop_t)))){
+                break;
+            }
+        }
+        i = end;
+    }
+    free(before);
+    return ir;
+}
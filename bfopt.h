@@ -0,0 +1,210 @@
+/* Ken Sheedlo
+ * bfcc, a tiny optimizing brainfuck compiler in C
+ * Parser and optimization pass definitions */
+
+#ifndef BFOPT_H
+#define BFOPT_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<sys/resource.h>
+
+#include "error_handling.h"
+#include "bfop.h"
+#include "bfir.h"
+
+/* Most distinct cells a loop body may touch and still become MULs */
+#define BFOPT_MUL_CELLS 16
+
+/* Rewrites a filter set may make per op of input before it is assumed to be
+ * going round in circles */
+#define BFOPT_REWRITES 16
+
+/* Most variables, and most labels, one filter may name */
+#define BFOPT_FILTER_VARS 8
+
+/* A filter operand: constant plus the sum of coef[i] times variable i */
+typedef struct {
+    int32_t constant;
+    int32_t coef[BFOPT_FILTER_VARS];
+} bfopt_expr_t;
+
+/* One op of a filter. Moves are all INCV and arithmetic all ADDV, with the
+ * delta as arg; branches and labels keep the label's name in arg. */
+typedef struct {
+    int32_t opcode;
+    bfopt_expr_t arg;
+    bfopt_expr_t off;
+} bfopt_fop_t;
+
+/* Guard tests */
+#define BFOPT_ODD 0
+#define BFOPT_EVEN 1
+#define BFOPT_EQ 2
+#define BFOPT_NE 3
+#define BFOPT_LT 4
+#define BFOPT_LE 5
+#define BFOPT_GT 6
+#define BFOPT_GE 7
+
+typedef struct {
+    int32_t test;
+    bfopt_expr_t lhs;
+    bfopt_expr_t rhs;       /* unused by BFOPT_ODD and BFOPT_EVEN */
+} bfopt_guard_t;
+
+/* A pattern, the guards its variables must pass, and its replacement.
+ * Labels named in the replacement but not the pattern are fresh ones. */
+typedef struct {
+    bfopt_fop_t *pattern;
+    size_t pattern_length;
+    bfopt_guard_t *guards;
+    size_t guard_count;
+    bfopt_fop_t *replace;
+    size_t replace_length;
+    int32_t labels;         /* one past the highest label name used */
+    int32_t next;           /* next filter ending at the same node, or -1 */
+    char *origin;           /* "file:line" it was loaded from, or NULL */
+    size_t hits;            /* times it has been applied */
+} bfopt_filter_t;
+
+/* A node of the filter matching automaton: an Aho-Corasick trie over op
+ * classes (bfopt_filter_key), kept in one array. Children are a sibling
+ * list, since the alphabet is every op. Arguments are left to the filters
+ * themselves to check. */
+typedef struct {
+    bfop_t key;             /* op class on the edge in from the parent */
+    int32_t child;          /* first child, or -1 */
+    int32_t sibling;        /* next child of the parent, or -1 */
+    int32_t fail;           /* longest proper suffix that is also a prefix */
+    int32_t first;          /* first filter whose pattern ends here, or -1 */
+    int32_t dict;           /* nearest fail ancestor with filters, or -1 */
+} bfopt_acnode_t;
+
+/* Any number of filters, all matched in a single pass */
+typedef struct {
+    bfopt_filter_t *filters;
+    size_t count;
+    size_t capacity;
+    bfopt_acnode_t *nodes;
+    size_t node_count;
+    size_t node_capacity;
+    int32_t built;          /* fail links are up to date */
+} bfopt_filters_t;
+
+/* Most cells bfopt_fold_output tracks by offset at once */
+#define BFOPT_KNOWN_CELLS 64
+
+/* What bfopt_fold_output knows at one point in the program. Cells are
+ * addressed relative to the data pointer; one that isn't listed is unknown,
+ * unless tape is set, in which case it still holds its starting value from
+ * tape (zero past the end) at pos + off. A listed value of -1 is unknown.
+ * Offsets [lo, hi] have already been touched, so they are on the tape. */
+typedef struct {
+    int32_t offs[BFOPT_KNOWN_CELLS];
+    int32_t vals[BFOPT_KNOWN_CELLS];
+    int32_t count;
+    const uint8_t *tape;
+    size_t cells;
+    int64_t pos;
+    int32_t lo, hi;
+    int32_t reached;        /* some path gets here */
+} bfopt_known_t;
+
+/* Most passes a pipeline may hold */
+#define BFOPT_MAX_PASSES 16
+
+/* Most rounds a group of repeating passes gets to reach a fixed point */
+#define BFOPT_MAX_ROUNDS 16
+
+/* Highest -O level, which runs every pass, and the one used by default */
+#define BFOPT_MAX_LEVEL 3
+
+typedef bfir_t *(*bfopt_run_t)(bfir_t *ir, void *data);
+
+/* What a compiler stage has cost, summed over its runs */
+typedef struct {
+    int32_t runs;
+    double seconds;
+    size_t ops_in;          /* before its first run */
+    size_t ops_out;         /* after its last */
+    long peak_kb;           /* peak resident memory after its last run */
+} bfopt_stats_t;
+
+/* A named pass. Runs of neighbouring passes with repeat set are run again
+ * as a group until none of them changes the IR, since each one's rewrites
+ * can open up more work for the others. */
+typedef struct {
+    const char *name;
+    int32_t level;          /* lowest -O level that runs it */
+    int32_t repeat;
+    int32_t enabled;        /* 1 or 0 to override level, or -1 */
+    bfopt_run_t run;
+    void *data;
+    bfopt_stats_t stats;
+} bfopt_pass_t;
+
+typedef struct {
+    bfopt_pass_t passes[BFOPT_MAX_PASSES];
+    int32_t count;
+    int32_t level;
+} bfopt_pipeline_t;
+
+bfir_t *bfcc_parse(char *program, bfir_t *ir);
+
+int32_t bfopt_delta(const bfop_t *op);
+
+void bfopt_set_delta(bfop_t *op, int32_t type, int32_t delta);
+
+bfir_t *bfopt_combine_arith(bfir_t *ir);
+
+bfir_t *bfopt_make_zeros(bfir_t *ir);
+
+bfir_t *bfopt_make_muls(bfir_t *ir);
+
+bfir_t *bfopt_make_scans(bfir_t *ir);
+
+bfir_t *bfopt_defer_moves(bfir_t *ir);
+
+bfir_t *bfopt_fold_output(bfir_t *ir, const uint8_t *tape, size_t cells);
+
+bfir_t *bfopt_apply_filter(bfir_t *ir, const bfir_t *pattern, const bfir_t *replace);
+
+void bfopt_filters_init(bfopt_filters_t *filters);
+
+void bfopt_filters_free(bfopt_filters_t *filters);
+
+void bfopt_filters_add(bfopt_filters_t *filters, const bfir_t *pattern, const bfir_t *replace);
+
+void bfopt_filters_load(bfopt_filters_t *filters, const char *filename);
+
+void bfopt_filters_parse(bfopt_filters_t *filters, FILE *input, const char *filename);
+
+bfir_t *bfopt_apply_filters(bfir_t *ir, bfopt_filters_t *filters);
+
+/*Compares op1, op2 for structural equality.*/
+int32_t bfop_structural_eq(const void *op1, const void *op2);
+
+bfir_t *load_bytecode(FILE *input, bfir_t *ir);
+
+void apply_filter_file(char *filename, bfir_t *ir);
+
+double bfopt_clock(void);
+
+void bfopt_stats_add(bfopt_stats_t *stats, size_t ops_in, size_t ops_out, double seconds);
+
+void bfopt_pipeline_init(bfopt_pipeline_t *pl, int32_t level, bfopt_filters_t *filters);
+
+void bfopt_pipeline_add(bfopt_pipeline_t *pl, const char *name, int32_t level,
+        int32_t repeat, bfopt_run_t run, void *data);
+
+int32_t bfopt_pipeline_set(bfopt_pipeline_t *pl, const char *name, int32_t enabled);
+
+int32_t bfopt_pipeline_enabled(const bfopt_pipeline_t *pl, const bfopt_pass_t *pass);
+
+bfir_t *bfopt_pipeline_run(bfopt_pipeline_t *pl, bfir_t *ir);
+
+#endif
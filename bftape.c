@@ -0,0 +1,74 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * Guard-paged tape implementation */
+
+#include<signal.h>
+#include<string.h>
+#include<sys/mman.h>
+#include<unistd.h>
+
+#include "bftape.h"
+#include "bfio.h"
+
+/* The mapped tape, for the fault handler */
+static uintptr_t bftape_start, bftape_end;
+
+static void bftape_fault(int sig, siginfo_t *info, void *context){
+    /* Runs where the program touched memory it can't. Anything but a guard
+     * is a real crash, so that goes back to the default action and faults
+     * again. */
+    static const char bounds_msg[] = "Program failed due to errors: ERR_BOUNDS\n";
+    static const char mem_msg[] = "Program failed due to errors: ERR_MEM\n";
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    if(addr >= bftape_start - BFTAPE_GUARD && addr < bftape_start){
+        write(STDERR_FILENO, bounds_msg, sizeof(bounds_msg) - 1);
+        bfio_flush();
+        _exit(ERR_BOUNDS);
+    }
+    if(addr >= bftape_end && addr < bftape_end + BFTAPE_GUARD){
+        write(STDERR_FILENO, mem_msg, sizeof(mem_msg) - 1);
+        bfio_flush();
+        _exit(ERR_MEM);
+    }
+    signal(SIGSEGV, SIG_DFL);
+}
+
+int32_t bftape_map(bfstate_t *state){
+    /* Maps a guarded tape into state. Returns 0, leaving state alone, if the
+     * reservation isn't allowed, eg. under a tight ulimit -v. */
+    size_t total = BFTAPE_GUARD + BFTAPE_SIZE + BFTAPE_GUARD;
+    uint8_t *map = mmap(NULL, total, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(map == MAP_FAILED){
+        return 0;
+    }
+    if(mprotect(map + BFTAPE_GUARD, BFTAPE_SIZE, PROT_READ | PROT_WRITE)){
+        munmap(map, total);
+        return 0;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = bftape_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGSEGV, &action, NULL)){
+        munmap(map, total);
+        return 0;
+    }
+
+    state->base = map + BFTAPE_GUARD;
+    state->mem_size = BFTAPE_SIZE;
+    state->guarded = 1;
+    bftape_start = (uintptr_t)state->base;
+    bftape_end = bftape_start + BFTAPE_SIZE;
+    return 1;
+}
+
+void bftape_unmap(bfstate_t *state){
+    signal(SIGSEGV, SIG_DFL);
+    munmap(state->base - BFTAPE_GUARD, BFTAPE_GUARD + BFTAPE_SIZE + BFTAPE_GUARD);
+    state->base = NULL;
+    state->mem_size = 0;
+    state->guarded = 0;
+}
@@ -0,0 +1,32 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * Guard-paged tape */
+
+#ifndef BFTAPE_H
+#define BFTAPE_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#include "bfi.h"
+
+/* The tape is reserved whole up front and the kernel zero fills pages as
+ * they are first touched, so it never has to grow or move and only costs
+ * what the program uses. Inaccessible guards on either side are big enough
+ * that no single 32-bit cell offset can step over them, and touching one
+ * is reported like a failed bounds check: ERR_BOUNDS before the start,
+ * ERR_MEM past the end. */
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define BFTAPE_SIZE ((size_t)1 << 36)
+#define BFTAPE_GUARD ((size_t)1 << 32)
+#else
+#define BFTAPE_SIZE ((size_t)1 << 28)
+#define BFTAPE_GUARD ((size_t)1 << 24)
+#endif
+
+int32_t bftape_map(bfstate_t *state);
+
+void bftape_unmap(bfstate_t *state);
+
+#endif
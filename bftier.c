@@ -0,0 +1,268 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * Tiered execution implementation */
+
+#include<sys/mman.h>
+
+#include "bftier.h"
+
+static void *bftier_compiler(void *arg){
+    /* Compiler thread. Each queued header h names the loop insns[h, t) where
+     * t is the JZ's target, which compiles to a function that runs the whole
+     * loop and returns with the data pointer just past it.
+     *
+     * Handoff: the code goes into a fresh mapping that is made executable
+     * before its entry point is published with a release store. Published
+     * code is never modified afterwards, so the interpreter only ever sees
+     * NULL or a complete function. */
+    bftier_t *tier = (bftier_t *)arg;
+    const bfvm_insn_t *insns = tier->code->insns;
+    const uint8_t *data = tier->code->data;
+
+    for(;;){
+        pthread_mutex_lock(&tier->lock);
+        while(!tier->done && tier->queue_head == tier->queue_tail){
+            pthread_cond_wait(&tier->wake, &tier->lock);
+        }
+        if(tier->done){
+            pthread_mutex_unlock(&tier->lock);
+            break;
+        }
+        size_t header = tier->queue[tier->queue_head++];
+        pthread_mutex_unlock(&tier->lock);
+
+        bfx64_buf_t buf;
+        bfx64_init(&buf);
+        size_t entry = bfx64_compile(&buf, insns, data, header, insns[header].arg,
+                        tier->checked);
+        size_t map_size;
+        void *map = bfjit_install(&buf, &map_size);
+        bfx64_free(&buf);
+
+        tier->maps[tier->compiled] = map;
+        tier->map_sizes[tier->compiled] = map_size;
+        tier->compiled++;
+        __atomic_store_n(&tier->native[header],
+            (bfjit_fn_t)((uint8_t *)map + entry), __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void bftier_init(bftier_t *tier, const bfvm_code_t *code, int32_t checked){
+    size_t length = code->length;
+    tier->code = code;
+    tier->checked = checked;
+    tier->native = calloc(length, sizeof(bfjit_fn_t));
+    tier->counts = calloc(length, sizeof(uint32_t));
+    tier->queue = malloc(length * sizeof(size_t));
+    tier->maps = malloc(length * sizeof(void *));
+    tier->map_sizes = malloc(length * sizeof(size_t));
+    if(!tier->native || !tier->counts || !tier->queue || !tier->maps
+            || !tier->map_sizes){
+        CriticalError("Failed to allocate memory");
+    }
+    tier->queue_head = tier->queue_tail = 0;
+    tier->done = 0;
+    tier->compiled = 0;
+    pthread_mutex_init(&tier->lock, NULL);
+    pthread_cond_init(&tier->wake, NULL);
+    if(pthread_create(&tier->thread, NULL, bftier_compiler, tier)){
+        CriticalError("Failed to start compiler thread");
+    }
+}
+
+void bftier_free(bftier_t *tier){
+    /* Stops the compiler thread, dropping anything still queued, and
+     * releases all compiled code. */
+    pthread_mutex_lock(&tier->lock);
+    tier->done = 1;
+    pthread_cond_signal(&tier->wake);
+    pthread_mutex_unlock(&tier->lock);
+    pthread_join(tier->thread, NULL);
+
+    for(size_t i = 0; i < tier->compiled; i++){
+        munmap(tier->maps[i], tier->map_sizes[i]);
+    }
+    pthread_mutex_destroy(&tier->lock);
+    pthread_cond_destroy(&tier->wake);
+    free(tier->native);
+    free(tier->counts);
+    free(tier->queue);
+    free(tier->maps);
+    free(tier->map_sizes);
+}
+
+static void bftier_enqueue(bftier_t *tier, size_t header){
+    pthread_mutex_lock(&tier->lock);
+    tier->queue[tier->queue_tail++] = header;
+    pthread_cond_signal(&tier->wake);
+    pthread_mutex_unlock(&tier->lock);
+}
+
+uint8_t *bftier_run(bftier_t *tier, uint8_t *mem, bfstate_t *state){
+    /* The IR interpreter with loop counters. Loop headers (JZ) and taken
+     * back-edges (JNZ) check for native code for their loop and, once it
+     * exists, run the rest of the loop natively and resume after it. */
+    static const void *checked[BFVM_MAX_OPCODE] = {
+        [INCV] = &&do_incv,
+        [ADDV] = &&do_addv,
+        [PUT] = &&do_put,
+        [GET] = &&do_get,
+        [JZ] = &&do_jz,
+        [JNZ] = &&do_jnz,
+        [ZERO] = &&do_zero,
+        [MUL] = &&do_mul,
+        [SCAN] = &&do_scan,
+        [WRITE_CONST] = &&do_write,
+        [BFVM_HALT] = &&do_halt
+    };
+    /* As in bfvm_run, a guarded tape needs no checks */
+    static const void *guarded[BFVM_MAX_OPCODE] = {
+        [INCV] = &&do_incv_guarded,
+        [ADDV] = &&do_addv_guarded,
+        [PUT] = &&do_put_guarded,
+        [GET] = &&do_get_guarded,
+        [JZ] = &&do_jz,
+        [JNZ] = &&do_jnz,
+        [ZERO] = &&do_zero_guarded,
+        [MUL] = &&do_mul_guarded,
+        [SCAN] = &&do_scan,
+        [WRITE_CONST] = &&do_write,
+        [BFVM_HALT] = &&do_halt
+    };
+
+    const void **dispatch = state->guarded ? guarded : checked;
+    const bfvm_insn_t *insns = tier->code->insns;
+    const bfvm_insn_t *ip = insns;
+    bfjit_fn_t *native = tier->native;
+    uint32_t *counts = tier->counts;
+    uint8_t *base = state->base;
+    size_t mem_size = state->mem_size;
+    size_t header;
+    bfjit_fn_t fn;
+    bfjit_rt_t rt;
+    bfjit_rt_init(&rt, state);
+
+#define DISPATCH() goto *dispatch[ip->opcode]
+#define NEXT() do{ ip++; DISPATCH(); }while(0)
+#define CHECK(ptr) do{ \
+        if((size_t)((ptr) - base) >= mem_size){ \
+            if((ptr) < base){ \
+                fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_BOUNDS"); \
+                exit(ERR_BOUNDS); \
+            } \
+            ptr = bf_grow_tape(ptr, state); \
+            base = state->base; \
+            mem_size = state->mem_size; \
+        } \
+    }while(0)
+
+/* Points cell at the op's cell, which deferred moves may have left
+ * anywhere, checking it the way the move would have been checked */
+#define AT() do{ \
+        cell = mem + ip->off; \
+        CHECK(cell); \
+        mem = cell - ip->off; \
+    }while(0)
+
+    uint8_t *cell;
+    DISPATCH();
+
+do_incv:
+    mem += ip->arg;
+    CHECK(mem);
+    NEXT();
+do_mul:
+    if(*mem){
+        AT();
+        *cell += *mem * ip->arg;
+    }
+    NEXT();
+do_scan:
+    mem = bf_scan(mem, ip->arg, state);
+    base = state->base;
+    mem_size = state->mem_size;
+    NEXT();
+do_addv:
+    AT();
+    *cell += ip->arg;
+    NEXT();
+do_zero:
+    AT();
+    *cell = 0;
+    NEXT();
+do_put:
+    AT();
+    bfio_put(*cell);
+    NEXT();
+do_write:
+    bfio_write(tier->code->data + ip->arg, ip->off);
+    NEXT();
+do_get:
+    AT();
+    *cell = bfio_get();
+    NEXT();
+do_incv_guarded:
+    mem += ip->arg;
+    NEXT();
+do_mul_guarded:
+    if(*mem){
+        mem[ip->off] += *mem * ip->arg;
+    }
+    NEXT();
+do_addv_guarded:
+    mem[ip->off] += ip->arg;
+    NEXT();
+do_zero_guarded:
+    mem[ip->off] = 0;
+    NEXT();
+do_put_guarded:
+    bfio_put(mem[ip->off]);
+    NEXT();
+do_get_guarded:
+    mem[ip->off] = bfio_get();
+    NEXT();
+do_jz:
+    header = ip - insns;
+    fn = __atomic_load_n(&native[header], __ATOMIC_ACQUIRE);
+    if(fn){
+        goto run_native;
+    }
+    if(!*mem){
+        ip = insns + ip->arg;
+        DISPATCH();
+    }
+    NEXT();
+do_jnz:
+    if(*mem){
+        header = ip->arg - 1;
+        fn = __atomic_load_n(&native[header], __ATOMIC_ACQUIRE);
+        if(fn){
+            goto run_native;
+        }
+        if(++counts[header] == BFTIER_HOT_THRESHOLD){
+            bftier_enqueue(tier, header);
+        }
+        ip = insns + ip->arg;
+        DISPATCH();
+    }
+    NEXT();
+run_native:
+    /* The interpreter may have grown the tape since rt was last synced,
+     * and the native code may grow it again. */
+    rt.base = state->base;
+    rt.end = state->base + state->mem_size;
+    mem = fn(mem, &rt);
+    base = state->base;
+    mem_size = state->mem_size;
+    ip = insns + insns[header].arg;
+    DISPATCH();
+do_halt:
+
+#undef AT
+#undef CHECK
+#undef NEXT
+#undef DISPATCH
+
+    return mem;
+}
@@ -0,0 +1,53 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * Tiered execution: interpret first, JIT hot loops in the background */
+
+#ifndef BFTIER_H
+#define BFTIER_H
+
+#include<pthread.h>
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#include "bfi.h"
+#include "bfvm.h"
+#include "bfjit.h"
+
+/* Taken back-edges before a loop is handed to the compiler thread */
+#ifndef BFTIER_HOT_THRESHOLD
+#define BFTIER_HOT_THRESHOLD 1000
+#endif
+
+typedef struct {
+    const bfvm_code_t *code;
+    int32_t checked;        /* compiled loops check bounds */
+
+    /* Indexed by the instruction index of a loop's JZ. native[] is written
+     * only by the compiler thread and counts[] only by the interpreter. */
+    bfjit_fn_t *native;
+    uint32_t *counts;
+
+    /* Work queue of loop headers. Each header is queued at most once, so
+     * a flat array the size of the code never wraps. */
+    size_t *queue;
+    size_t queue_head;
+    size_t queue_tail;
+    int32_t done;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+
+    /* Owned by the compiler thread until it is joined */
+    void **maps;
+    size_t *map_sizes;
+    size_t compiled;
+} bftier_t;
+
+void bftier_init(bftier_t *tier, const bfvm_code_t *code, int32_t checked);
+
+void bftier_free(bftier_t *tier);
+
+uint8_t *bftier_run(bftier_t *tier, uint8_t *mem, bfstate_t *state);
+
+#endif
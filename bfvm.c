@@ -0,0 +1,557 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * Direct-threaded interpreter implementation */
+
+#define _GNU_SOURCE     /* memrchr */
+#include<string.h>
+
+#include "bfvm.h"
+
+uint8_t *bf_grow_tape(uint8_t *mem, bfstate_t *state){
+    /* Doubles the tape until mem is back in bounds and returns mem relocated
+     * into the new tape. A guarded tape is already as big as it gets. */
+    if(state->guarded){
+        fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_MEM");
+        exit(ERR_MEM);
+    }
+    size_t index = mem - state->base;
+    size_t new_size = state->mem_size;
+    while(index >= new_size){
+        new_size *= 2;
+    }
+
+    //Allocate moar memory plz
+    uint8_t *new_base = calloc(new_size, sizeof(uint8_t));
+    if(!new_base){
+        fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_MEM");
+        exit(ERR_MEM);
+    }
+    memcpy(new_base, state->base, state->mem_size);
+    free(state->base);
+    state->base = new_base;
+    state->mem_size = new_size;
+    return new_base + index;
+}
+
+uint8_t *bf_scan(uint8_t *mem, int32_t stride, bfstate_t *state){
+    /* Steps mem by stride until it lands on a zero cell and returns it. The
+     * unit strides go through memchr/memrchr. Cells past the end of the tape
+     * are zero, so a scan running off the end stops on the first one it
+     * would have stepped to, growing the tape to hold it; one running off
+     * the start fails the bounds check the loop would have. */
+    size_t index = mem - state->base;
+    uint8_t *hit;
+    if(index >= state->mem_size){
+        /* Unchecked moves on a guarded tape can leave mem off either end,
+         * where the loop's first test would have hit a guard */
+        if(mem >= state->base){
+            return bf_grow_tape(mem, state);
+        }
+    }else if(stride == 1){
+        hit = memchr(mem, 0, state->mem_size - index);
+        return hit ? hit : bf_grow_tape(state->base + state->mem_size, state);
+    }else if(stride == -1){
+        hit = memrchr(state->base, 0, index + 1);
+        if(hit){
+            return hit;
+        }
+    }else if(stride > 0){
+        while(index < state->mem_size && state->base[index]){
+            index += stride;
+        }
+        if(index < state->mem_size){
+            return state->base + index;
+        }
+        return bf_grow_tape(state->base + index, state);
+    }else{
+        while(state->base[index] && index >= (size_t)-stride){
+            index += stride;
+        }
+        if(!state->base[index]){
+            return state->base + index;
+        }
+    }
+    fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_BOUNDS");
+    exit(ERR_BOUNDS);
+}
+
+void bfvm_lower(bfvm_code_t *code, bfir_t *ir){
+    /* Lowers optimized IR into a flat instruction array. Labels disappear
+     * and branches are resolved to the index of the instruction following
+     * their target label. */
+    int32_t max_label = -1;
+    size_t length = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        if(op->opcode == LABEL){
+            if(op->arg > max_label){
+                max_label = op->arg;
+            }
+        }else{
+            length++;
+        }
+    }
+
+    int32_t *targets = malloc((max_label + 1) * sizeof(int32_t));
+    code->insns = malloc((length + 1) * sizeof(bfvm_insn_t));
+    if(!targets || !code->insns){
+        CriticalError("Failed to allocate memory");
+    }
+    for(int32_t i = 0; i <= max_label; i++){
+        targets[i] = -1;
+    }
+
+    size_t pc = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        if(op->opcode == LABEL){
+            targets[op->arg] = pc;
+        }else{
+            pc++;
+        }
+    }
+
+    pc = 0;
+    for(size_t i = 0; i < ir->length; i++){
+        bfop_t *op = &ir->ops[i];
+        bfvm_insn_t *insn = &code->insns[pc];
+        insn->handler = NULL;
+        insn->arg = op->arg;
+        insn->off = op->off;
+        switch(op->opcode){
+            case INC:insn->opcode = INCV;insn->arg = 1;break;
+            case INCV:insn->opcode = INCV;break;
+            case DEC:insn->opcode = INCV;insn->arg = -1;break;
+            case DECV:insn->opcode = INCV;insn->arg = -(op->arg);break;
+            case ADD:insn->opcode = ADDV;insn->arg = 1;break;
+            case ADDV:insn->opcode = ADDV;break;
+            case SUB:insn->opcode = ADDV;insn->arg = -1;break;
+            case SUBV:insn->opcode = ADDV;insn->arg = -(op->arg);break;
+            case JZ:
+            case JNZ:
+                if(op->arg < 0 || op->arg > max_label || targets[op->arg] < 0){
+                    CriticalError("Branch to undefined label");
+                }
+                insn->opcode = op->opcode;
+                insn->arg = targets[op->arg];
+                break;
+            case LABEL:
+                continue;
+            default:
+                insn->opcode = op->opcode;
+                break;
+        }
+        pc++;
+    }
+    code->insns[length].handler = NULL;
+    code->insns[length].opcode = BFVM_HALT;
+    code->insns[length].arg = 0;
+    code->insns[length].off = 0;
+    code->length = length + 1;
+    code->data = ir->data;
+    code->threaded = NULL;
+
+    free(targets);
+}
+
+void bfvm_free(bfvm_code_t *code){
+    free(code->insns);
+    code->insns = NULL;
+    code->length = 0;
+}
+
+uint8_t *bfvm_run(bfvm_code_t *code, uint8_t *mem, bfstate_t *state){
+    /* Runs lowered code with computed-goto dispatch. Every handler jumps
+     * straight to the next handler, so there is no central switch. */
+    static const void *dispatch[BFVM_MAX_OPCODE] = {
+        [INCV] = &&do_incv,
+        [ADDV] = &&do_addv,
+        [PUT] = &&do_put,
+        [GET] = &&do_get,
+        [JZ] = &&do_jz,
+        [JNZ] = &&do_jnz,
+        [ZERO] = &&do_zero,
+        [MUL] = &&do_mul,
+        [SCAN] = &&do_scan,
+        [WRITE_CONST] = &&do_write,
+        [BFVM_HALT] = &&do_halt
+    };
+    /* On a guarded tape a stray touch faults into bftape's handler, so the
+     * ops that would check their cell here just use it */
+    static const void *guarded[BFVM_MAX_OPCODE] = {
+        [INCV] = &&do_incv_guarded,
+        [ADDV] = &&do_addv_guarded,
+        [PUT] = &&do_put_guarded,
+        [GET] = &&do_get_guarded,
+        [JZ] = &&do_jz,
+        [JNZ] = &&do_jnz,
+        [ZERO] = &&do_zero_guarded,
+        [MUL] = &&do_mul_guarded,
+        [SCAN] = &&do_scan,
+        [WRITE_CONST] = &&do_write,
+        [BFVM_HALT] = &&do_halt
+    };
+
+    bfvm_insn_t *insns = code->insns;
+    const void **table = state->guarded ? guarded : dispatch;
+    if(code->threaded != table){
+        for(size_t i = 0; i < code->length; i++){
+            insns[i].handler = table[insns[i].opcode];
+            if(!insns[i].handler){
+                CriticalError("Unknown opcode in lowered code");
+            }
+        }
+        code->threaded = table;
+    }
+
+    bfvm_insn_t *ip = insns;
+    uint8_t *base = state->base;
+    size_t mem_size = state->mem_size;
+
+#define DISPATCH() goto *ip->handler
+#define NEXT() do{ ip++; DISPATCH(); }while(0)
+#define CHECK(ptr) do{ \
+        if((size_t)((ptr) - base) >= mem_size){ \
+            if((ptr) < base){ \
+                fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_BOUNDS"); \
+                exit(ERR_BOUNDS); \
+            } \
+            ptr = bf_grow_tape(ptr, state); \
+            base = state->base; \
+            mem_size = state->mem_size; \
+        } \
+    }while(0)
+
+/* Points cell at the op's cell, which deferred moves may have left
+ * anywhere, checking it the way the move would have been checked */
+#define AT() do{ \
+        cell = mem + ip->off; \
+        CHECK(cell); \
+        mem = cell - ip->off; \
+    }while(0)
+
+    uint8_t *cell;
+    DISPATCH();
+
+do_incv:
+    mem += ip->arg;
+    CHECK(mem);
+    NEXT();
+do_mul:
+    /* The loop this replaced only moved the pointer if the cell was
+     * nonzero, so only then can the target be out of bounds */
+    if(*mem){
+        AT();
+        *cell += *mem * ip->arg;
+    }
+    NEXT();
+do_scan:
+    mem = bf_scan(mem, ip->arg, state);
+    base = state->base;
+    mem_size = state->mem_size;
+    NEXT();
+do_addv:
+    AT();
+    *cell += ip->arg;
+    NEXT();
+do_zero:
+    AT();
+    *cell = 0;
+    NEXT();
+do_put:
+    AT();
+    bfio_put(*cell);
+    NEXT();
+do_write:
+    bfio_write(code->data + ip->arg, ip->off);
+    NEXT();
+do_get:
+    AT();
+    *cell = bfio_get();
+    NEXT();
+do_incv_guarded:
+    mem += ip->arg;
+    NEXT();
+do_mul_guarded:
+    if(*mem){
+        mem[ip->off] += *mem * ip->arg;
+    }
+    NEXT();
+do_addv_guarded:
+    mem[ip->off] += ip->arg;
+    NEXT();
+do_zero_guarded:
+    mem[ip->off] = 0;
+    NEXT();
+do_put_guarded:
+    bfio_put(mem[ip->off]);
+    NEXT();
+do_get_guarded:
+    mem[ip->off] = bfio_get();
+    NEXT();
+do_jz:
+    if(!*mem){
+        ip = insns + ip->arg;
+        DISPATCH();
+    }
+    NEXT();
+do_jnz:
+    if(*mem){
+        ip = insns + ip->arg;
+        DISPATCH();
+    }
+    NEXT();
+do_halt:
+
+#undef AT
+#undef CHECK
+#undef NEXT
+#undef DISPATCH
+
+    return mem;
+}
+
+uint8_t *bfvm_run_image(const bfbin_image_t *image, uint8_t *mem, bfstate_t *state){
+    /* Executes a mapped .bfb image in place. Ops are decoded as they are
+     * dispatched and branches go through the image's branch table. */
+    static const void *checked[256] = {
+        [BFBIN_HALT] = &&do_halt,
+        [BFBIN_MOVE8] = &&do_move8,
+        [BFBIN_MOVE32] = &&do_move32,
+        [BFBIN_ADD] = &&do_add,
+        [BFBIN_ZERO] = &&do_zero,
+        [BFBIN_PUT] = &&do_put,
+        [BFBIN_GET] = &&do_get,
+        [BFBIN_JZ16] = &&do_jz16,
+        [BFBIN_JZ32] = &&do_jz32,
+        [BFBIN_JNZ16] = &&do_jnz16,
+        [BFBIN_JNZ32] = &&do_jnz32,
+        [BFBIN_MUL8] = &&do_mul8,
+        [BFBIN_MUL32] = &&do_mul32,
+        [BFBIN_ADD_AT] = &&do_add_at,
+        [BFBIN_ZERO_AT] = &&do_zero_at,
+        [BFBIN_PUT_AT] = &&do_put_at,
+        [BFBIN_GET_AT] = &&do_get_at,
+        [BFBIN_SCAN8] = &&do_scan8,
+        [BFBIN_SCAN32] = &&do_scan32
+    };
+    /* As in bfvm_run, a guarded tape needs no checks */
+    static const void *guarded[256] = {
+        [BFBIN_HALT] = &&do_halt,
+        [BFBIN_MOVE8] = &&do_move8_guarded,
+        [BFBIN_MOVE32] = &&do_move32_guarded,
+        [BFBIN_ADD] = &&do_add,
+        [BFBIN_ZERO] = &&do_zero,
+        [BFBIN_PUT] = &&do_put,
+        [BFBIN_GET] = &&do_get,
+        [BFBIN_JZ16] = &&do_jz16,
+        [BFBIN_JZ32] = &&do_jz32,
+        [BFBIN_JNZ16] = &&do_jnz16,
+        [BFBIN_JNZ32] = &&do_jnz32,
+        [BFBIN_MUL8] = &&do_mul8_guarded,
+        [BFBIN_MUL32] = &&do_mul32_guarded,
+        [BFBIN_ADD_AT] = &&do_add_at_guarded,
+        [BFBIN_ZERO_AT] = &&do_zero_at_guarded,
+        [BFBIN_PUT_AT] = &&do_put_at_guarded,
+        [BFBIN_GET_AT] = &&do_get_at_guarded,
+        [BFBIN_SCAN8] = &&do_scan8,
+        [BFBIN_SCAN32] = &&do_scan32
+    };
+
+    const void **dispatch = state->guarded ? guarded : checked;
+    const uint8_t *code = image->code;
+    const int32_t *branches = image->branches;
+    const uint8_t *pc = code;
+    uint8_t *base = state->base;
+    size_t mem_size = state->mem_size;
+    int32_t delta;
+    uint8_t *cell;
+    uint16_t idx16;
+    uint32_t idx32;
+
+#define DISPATCH() do{ \
+        const void *handler = dispatch[*pc]; \
+        if(!handler){ \
+            CriticalError("Corrupt bytecode"); \
+        } \
+        goto *handler; \
+    }while(0)
+#define CHECK(ptr) do{ \
+        if((size_t)((ptr) - base) >= mem_size){ \
+            if((ptr) < base){ \
+                fprintf(stderr, "%s: %s\n", "Program failed due to errors", "ERR_BOUNDS"); \
+                exit(ERR_BOUNDS); \
+            } \
+            ptr = bf_grow_tape(ptr, state); \
+            base = state->base; \
+            mem_size = state->mem_size; \
+        } \
+    }while(0)
+#define MOVE() do{ \
+        mem += delta; \
+        CHECK(mem); \
+    }while(0)
+#define AT() do{ \
+        delta = (int8_t)pc[1]; \
+        cell = mem + delta; \
+        CHECK(cell); \
+        mem = cell - delta; \
+    }while(0)
+#define MULTIPLY() do{ \
+        if(*mem){ \
+            cell = mem + delta; \
+            CHECK(cell); \
+            mem = cell - delta; \
+            *cell += *mem * pc[-1]; \
+        } \
+    }while(0)
+
+    DISPATCH();
+
+do_move8:
+    delta = (int8_t)pc[1];
+    MOVE();
+    pc += 2;
+    DISPATCH();
+do_move32:
+    memcpy(&delta, pc + 1, sizeof(int32_t));
+    MOVE();
+    pc += 5;
+    DISPATCH();
+do_mul8:
+    delta = (int8_t)pc[1];
+    pc += 3;
+    MULTIPLY();
+    DISPATCH();
+do_mul32:
+    memcpy(&delta, pc + 1, sizeof(int32_t));
+    pc += 6;
+    MULTIPLY();
+    DISPATCH();
+do_scan8:
+    delta = (int8_t)pc[1];
+    pc += 2;
+    goto scan;
+do_scan32:
+    memcpy(&delta, pc + 1, sizeof(int32_t));
+    pc += 5;
+scan:
+    mem = bf_scan(mem, delta, state);
+    base = state->base;
+    mem_size = state->mem_size;
+    DISPATCH();
+do_add_at:
+    AT();
+    *cell += pc[2];
+    pc += 3;
+    DISPATCH();
+do_zero_at:
+    AT();
+    *cell = 0;
+    pc += 2;
+    DISPATCH();
+do_put_at:
+    AT();
+    bfio_put(*cell);
+    pc += 2;
+    DISPATCH();
+do_get_at:
+    AT();
+    *cell = bfio_get();
+    pc += 2;
+    DISPATCH();
+do_move8_guarded:
+    mem += (int8_t)pc[1];
+    pc += 2;
+    DISPATCH();
+do_move32_guarded:
+    memcpy(&delta, pc + 1, sizeof(int32_t));
+    mem += delta;
+    pc += 5;
+    DISPATCH();
+do_mul8_guarded:
+    delta = (int8_t)pc[1];
+    pc += 3;
+    goto multiply_guarded;
+do_mul32_guarded:
+    memcpy(&delta, pc + 1, sizeof(int32_t));
+    pc += 6;
+multiply_guarded:
+    if(*mem){
+        mem[delta] += *mem * pc[-1];
+    }
+    DISPATCH();
+do_add_at_guarded:
+    mem[(int8_t)pc[1]] += pc[2];
+    pc += 3;
+    DISPATCH();
+do_zero_at_guarded:
+    mem[(int8_t)pc[1]] = 0;
+    pc += 2;
+    DISPATCH();
+do_put_at_guarded:
+    bfio_put(mem[(int8_t)pc[1]]);
+    pc += 2;
+    DISPATCH();
+do_get_at_guarded:
+    mem[(int8_t)pc[1]] = bfio_get();
+    pc += 2;
+    DISPATCH();
+do_add:
+    *mem += pc[1];
+    pc += 2;
+    DISPATCH();
+do_zero:
+    *mem = 0;
+    pc++;
+    DISPATCH();
+do_put:
+    bfio_put(*mem);
+    pc++;
+    DISPATCH();
+do_get:
+    *mem = bfio_get();
+    pc++;
+    DISPATCH();
+do_jz16:
+    if(!*mem){
+        memcpy(&idx16, pc + 1, sizeof(uint16_t));
+        pc = code + branches[idx16];
+    }else{
+        pc += 3;
+    }
+    DISPATCH();
+do_jz32:
+    if(!*mem){
+        memcpy(&idx32, pc + 1, sizeof(uint32_t));
+        pc = code + branches[idx32];
+    }else{
+        pc += 5;
+    }
+    DISPATCH();
+do_jnz16:
+    if(*mem){
+        memcpy(&idx16, pc + 1, sizeof(uint16_t));
+        pc = code + branches[idx16];
+    }else{
+        pc += 3;
+    }
+    DISPATCH();
+do_jnz32:
+    if(*mem){
+        memcpy(&idx32, pc + 1, sizeof(uint32_t));
+        pc = code + branches[idx32];
+    }else{
+        pc += 5;
+    }
+    DISPATCH();
+do_halt:
+
+#undef MULTIPLY
+#undef AT
+#undef MOVE
+#undef CHECK
+#undef DISPATCH
+
+    return mem;
+}
@@ -0,0 +1,54 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * Direct-threaded interpreter over the optimized bfcc op stream */
+
+#ifndef BFVM_H
+#define BFVM_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+
+#include "bfi.h"
+#include "bfio.h"
+#include "bfbin.h"
+#include "bfopt.h"
+
+/* Opcodes that only exist in lowered code */
+#define BFVM_HALT 0x7F
+#define BFVM_MAX_OPCODE 0x80
+
+/* One lowered instruction. Pointer moves are all INCV and cell arithmetic is
+ * all ADDV, with signed args. Branch args are instruction indices. ADDV,
+ * ZERO, PUT and GET work on the cell off away from the data pointer; MUL
+ * keeps its factor in arg and its target's offset in off, and WRITE_CONST
+ * its text's index in data and its length. The handler is filled in by
+ * bfvm_run from the dispatch table for the tape it runs on, checked or
+ * guarded, and threaded remembers which. */
+typedef struct {
+    const void *handler;
+    int32_t opcode;
+    int32_t arg;
+    int32_t off;
+} bfvm_insn_t;
+
+typedef struct {
+    bfvm_insn_t *insns;
+    size_t length;
+    const uint8_t *data;    /* the IR's data pool, borrowed */
+    const void **threaded;
+} bfvm_code_t;
+
+uint8_t *bf_grow_tape(uint8_t *mem, bfstate_t *state);
+
+uint8_t *bf_scan(uint8_t *mem, int32_t stride, bfstate_t *state);
+
+void bfvm_lower(bfvm_code_t *code, bfir_t *ir);
+
+void bfvm_free(bfvm_code_t *code);
+
+uint8_t *bfvm_run(bfvm_code_t *code, uint8_t *mem, bfstate_t *state);
+
+uint8_t *bfvm_run_image(const bfbin_image_t *image, uint8_t *mem, bfstate_t *state);
+
+#endif
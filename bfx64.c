@@ -0,0 +1,370 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * x86-64 machine code emitter implementation */
+
+#include "bfx64.h"
+
+void bfx64_init(bfx64_buf_t *buf){
+    buf->capacity = 4096;
+    buf->length = 0;
+    buf->buf = malloc(buf->capacity);
+    if(!buf->buf){
+        CriticalError("Failed to allocate memory");
+    }
+}
+
+void bfx64_free(bfx64_buf_t *buf){
+    free(buf->buf);
+    buf->buf = NULL;
+    buf->length = buf->capacity = 0;
+}
+
+void bfx64_emit(bfx64_buf_t *buf, const uint8_t *bytes, size_t count){
+    if(buf->length + count > buf->capacity){
+        while(buf->length + count > buf->capacity){
+            buf->capacity *= 2;
+        }
+        buf->buf = realloc(buf->buf, buf->capacity);
+        if(!buf->buf){
+            CriticalError("Failed to allocate memory");
+        }
+    }
+    memcpy(buf->buf + buf->length, bytes, count);
+    buf->length += count;
+}
+
+void bfx64_byte(bfx64_buf_t *buf, uint8_t byte){
+    bfx64_emit(buf, &byte, 1);
+}
+
+void bfx64_imm32(bfx64_buf_t *buf, int32_t imm){
+    bfx64_emit(buf, (uint8_t *)&imm, sizeof(int32_t));
+}
+
+void bfx64_patch32(bfx64_buf_t *buf, size_t at, int32_t value){
+    memcpy(buf->buf + at, &value, sizeof(int32_t));
+}
+
+#define EMIT BFX64_EMIT
+
+static void bfx64_add_rbx(bfx64_buf_t *buf, int32_t arg){
+    if(arg >= INT8_MIN && arg <= INT8_MAX){
+        EMIT(buf, 0x48, 0x83, 0xC3, (uint8_t)arg);                  /* add rbx, imm8 */
+    }else{
+        EMIT(buf, 0x48, 0x81, 0xC3);                                /* add rbx, imm32 */
+        bfx64_imm32(buf, arg);
+    }
+}
+
+static void bfx64_check(bfx64_buf_t *buf, int32_t arg, size_t *bounds_at, size_t *bounds){
+    /* Bounds check after rbx moved by arg, calling the stub when it fails.
+     * Without bounds_at the tape is guarded and there's nothing to do. */
+    if(!bounds_at){
+        return;
+    }
+    if(arg > 0){
+        EMIT(buf, 0x4C, 0x39, 0xF3, 0x72, 0x05);                    /* cmp rbx, r14; jb */
+    }else{
+        EMIT(buf, 0x4C, 0x39, 0xEB, 0x73, 0x05);                    /* cmp rbx, r13; jae */
+    }
+    EMIT(buf, 0xE8);                                                /* call bounds stub */
+    bounds_at[(*bounds)++] = buf->length;
+    bfx64_imm32(buf, 0);
+}
+
+static void bfx64_at_rbx(bfx64_buf_t *buf, uint8_t reg, int32_t off){
+    //ModRM (and displacement) for reg and [rbx+off].
+    if(off == 0){
+        bfx64_byte(buf, (reg << 3) | 0x03);
+    }else if(off >= INT8_MIN && off <= INT8_MAX){
+        bfx64_byte(buf, 0x40 | (reg << 3) | 0x03);
+        bfx64_byte(buf, (uint8_t)off);
+    }else{
+        bfx64_byte(buf, 0x80 | (reg << 3) | 0x03);
+        bfx64_imm32(buf, off);
+    }
+}
+
+static void bfx64_reach(bfx64_buf_t *buf, int32_t off, int32_t *lo, int32_t *hi,
+        size_t *bounds_at, size_t *bounds){
+    /* Cells in [lo, hi] around rbx are known to be on the tape. Touching one
+     * outside that range first walks rbx out to it and back, the way the
+     * deferred moves would have, which checks it and grows the range. The
+     * range resets whenever rbx moves or control flow joins. */
+    if(!bounds_at || (off >= *lo && off <= *hi)){
+        return;
+    }
+    bfx64_add_rbx(buf, off);
+    bfx64_check(buf, off, bounds_at, bounds);
+    bfx64_add_rbx(buf, -off);
+    if(off < *lo){
+        *lo = off;
+    }else{
+        *hi = off;
+    }
+}
+
+int32_t bfx64_scan_mask(int32_t stride){
+    /* pmovmskb bits for the cells a scan by stride tests in one 16 cell
+     * block. Rightward blocks start at the data pointer and leftward ones
+     * end at it. Returns 0 if the stride doesn't divide 16. */
+    int32_t step = stride < 0 ? -stride : stride;
+    int32_t mask = 0;
+    if(step > 16 || 16 % step){
+        return 0;
+    }
+    for(int32_t bit = 0; bit < 16; bit += step){
+        mask |= 1 << (stride > 0 ? bit : 15 - bit);
+    }
+    return mask;
+}
+
+static void bfx64_scan(bfx64_buf_t *buf, int32_t stride, size_t *bounds_at, size_t *bounds){
+    /* While a whole 16 cell block in the scan's direction is on the tape,
+     * compare it against zero with SSE2 and keep only the cells the loop
+     * would have stepped on. Near the ends, and for strides that don't
+     * divide 16, fall back to stepping and checking one cell at a time. */
+    int32_t mask = bfx64_scan_mask(stride);
+    size_t vec, to_scalar = 0, to_found = 0, to_done = 0, scalar, to_end;
+    if(mask){
+        EMIT(buf, 0x66, 0x0F, 0xEF, 0xC9);                          /* pxor xmm1, xmm1 */
+        vec = buf->length;
+        if(stride > 0){
+            EMIT(buf, 0x48, 0x8D, 0x43, 0x10);                      /* lea rax, [rbx+16] */
+            EMIT(buf, 0x4C, 0x39, 0xF0, 0x0F, 0x87);                /* cmp rax, r14; ja scalar */
+        }else{
+            EMIT(buf, 0x48, 0x8D, 0x43, 0xF1);                      /* lea rax, [rbx-15] */
+            EMIT(buf, 0x4C, 0x39, 0xE8, 0x0F, 0x82);                /* cmp rax, r13; jb scalar */
+        }
+        to_scalar = buf->length;
+        bfx64_imm32(buf, 0);
+        if(stride > 0){
+            EMIT(buf, 0xF3, 0x0F, 0x6F, 0x03);                      /* movdqu xmm0, [rbx] */
+        }else{
+            EMIT(buf, 0xF3, 0x0F, 0x6F, 0x43, 0xF1);                /* movdqu xmm0, [rbx-15] */
+        }
+        EMIT(buf, 0x66, 0x0F, 0x74, 0xC1);                          /* pcmpeqb xmm0, xmm1 */
+        EMIT(buf, 0x66, 0x0F, 0xD7, 0xC0);                          /* pmovmskb eax, xmm0 */
+        EMIT(buf, 0x25);                                            /* and eax, mask */
+        bfx64_imm32(buf, mask);
+        EMIT(buf, 0x0F, 0x85);                                      /* jnz found */
+        to_found = buf->length;
+        bfx64_imm32(buf, 0);
+        if(stride > 0){
+            EMIT(buf, 0x48, 0x83, 0xC3, 0x10);                      /* add rbx, 16 */
+        }else{
+            EMIT(buf, 0x48, 0x83, 0xEB, 0x10);                      /* sub rbx, 16 */
+        }
+        EMIT(buf, 0xE9);                                            /* jmp vec */
+        bfx64_imm32(buf, vec - (buf->length + 4));
+        bfx64_patch32(buf, to_found, buf->length - (to_found + 4));
+        if(stride > 0){
+            EMIT(buf, 0x0F, 0xBC, 0xC0, 0x48, 0x01, 0xC3);          /* bsf eax, eax; add rbx, rax */
+        }else{
+            EMIT(buf, 0x0F, 0xBD, 0xC0);                            /* bsr eax, eax */
+            EMIT(buf, 0x48, 0x8D, 0x5C, 0x03, 0xF1);                /* lea rbx, [rbx+rax-15] */
+        }
+        EMIT(buf, 0xE9);                                            /* jmp done */
+        to_done = buf->length;
+        bfx64_imm32(buf, 0);
+        bfx64_patch32(buf, to_scalar, buf->length - (to_scalar + 4));
+    }
+
+    /* The vector loop can leave rbx one block past the end, so the scalar
+     * loop checks before it looks */
+    scalar = buf->length;
+    bfx64_check(buf, stride, bounds_at, bounds);
+    EMIT(buf, 0x80, 0x3B, 0x00);                                    /* cmp byte [rbx], 0 */
+    EMIT(buf, 0x0F, 0x84);                                          /* je done */
+    to_end = buf->length;
+    bfx64_imm32(buf, 0);
+    bfx64_add_rbx(buf, stride);
+    EMIT(buf, 0xE9);                                                /* jmp scalar */
+    bfx64_imm32(buf, scalar - (buf->length + 4));
+    bfx64_patch32(buf, to_end, buf->length - (to_end + 4));
+    if(mask){
+        bfx64_patch32(buf, to_done, buf->length - (to_done + 4));
+    }
+}
+
+size_t bfx64_compile(bfx64_buf_t *buf, const bfvm_insn_t *insns, const uint8_t *data,
+        size_t start, size_t end, int32_t checked){
+    /* Emits a function running insns[start, end) and returns the offset of
+     * its entry point in buf. A branch to end, or a HALT, leaves the function.
+     * Branches anywhere else outside the range are an error. WRITE_CONST's
+     * text is copied out of data into the code. Unless checked, the tape is
+     * guarded and moves aren't bounds checked; scans still keep their SSE
+     * blocks between base and end. */
+    size_t entry = buf->length;
+    size_t count = end - start;
+    size_t *offs = malloc((count + 1) * sizeof(size_t));
+    size_t *branch_at = malloc((count + 1) * sizeof(size_t));
+    size_t *branch_to = malloc((count + 1) * sizeof(size_t));
+    size_t *bounds_at = malloc((count + 1) * sizeof(size_t));
+    uint8_t *joins = calloc(count + 1, sizeof(uint8_t));
+    size_t branches = 0, bounds = 0, skip;
+    int32_t lo = 0, hi = 0;
+    if(!offs || !branch_at || !branch_to || !bounds_at || !joins){
+        CriticalError("Failed to allocate memory");
+    }
+    size_t *check_at = checked ? bounds_at : NULL;
+
+    /* Branch targets are where the checked range around rbx is forgotten */
+    for(size_t i = start; i < end; i++){
+        int32_t arg = insns[i].arg;
+        if((insns[i].opcode == JZ || insns[i].opcode == JNZ)
+                && arg >= (int64_t)start && arg < (int64_t)end){
+            joins[arg - start] = 1;
+        }
+    }
+
+    /* push rbx; push rbp; push r12; push r13; push r14
+     * mov rbx, rdi; mov r12, rsi
+     * mov r13, [r12+BASE]; mov r14, [r12+END] */
+    EMIT(buf, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56);
+    EMIT(buf, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4);
+    EMIT(buf, 0x4D, 0x8B, 0x6C, 0x24, BFX64_RT_BASE);
+    EMIT(buf, 0x4D, 0x8B, 0x74, 0x24, BFX64_RT_END);
+
+    for(size_t i = start; i < end; i++){
+        const bfvm_insn_t *insn = &insns[i];
+        int32_t arg = insn->arg;
+        offs[i - start] = buf->length;
+        if(joins[i - start]){
+            lo = hi = 0;
+        }
+        switch(insn->opcode){
+            case INCV:
+                if(arg == 0){
+                    break;
+                }
+                bfx64_add_rbx(buf, arg);
+                bfx64_check(buf, arg, check_at, &bounds);
+                lo = hi = 0;
+                break;
+            case MUL:
+                /* Only a nonzero loop cell would have walked the pointer to
+                 * the target, so only then is the target bounds checked.
+                 * rbx visits the target and comes back. */
+                EMIT(buf, 0x80, 0x3B, 0x00);                        /* cmp byte [rbx], 0 */
+                EMIT(buf, 0x0F, 0x84);                              /* je skip */
+                skip = buf->length;
+                bfx64_imm32(buf, 0);
+                bfx64_add_rbx(buf, insn->off);
+                bfx64_check(buf, insn->off, check_at, &bounds);
+                EMIT(buf, 0x0F, 0xB6, 0x83);                        /* movzx eax, byte [rbx-off] */
+                bfx64_imm32(buf, -insn->off);
+                if((uint8_t)arg == 1){
+                    EMIT(buf, 0x00, 0x03);                          /* add [rbx], al */
+                }else if((uint8_t)arg == UINT8_MAX){
+                    EMIT(buf, 0x28, 0x03);                          /* sub [rbx], al */
+                }else{
+                    EMIT(buf, 0x69, 0xC0);                          /* imul eax, eax, imm32 */
+                    bfx64_imm32(buf, arg);
+                    EMIT(buf, 0x00, 0x03);                          /* add [rbx], al */
+                }
+                bfx64_add_rbx(buf, -insn->off);
+                bfx64_patch32(buf, skip, buf->length - (skip + 4));
+                break;
+            case SCAN:
+                bfx64_scan(buf, arg, check_at, &bounds);
+                lo = hi = 0;
+                break;
+            case ADDV:
+                if((uint8_t)arg){
+                    bfx64_reach(buf, insn->off, &lo, &hi, check_at, &bounds);
+                    EMIT(buf, 0x80);                                /* add byte [rbx+off], imm8 */
+                    bfx64_at_rbx(buf, 0, insn->off);
+                    bfx64_byte(buf, (uint8_t)arg);
+                }
+                break;
+            case ZERO:
+                bfx64_reach(buf, insn->off, &lo, &hi, check_at, &bounds);
+                EMIT(buf, 0xC6);                                    /* mov byte [rbx+off], 0 */
+                bfx64_at_rbx(buf, 0, insn->off);
+                bfx64_byte(buf, 0);
+                break;
+            case PUT:
+                bfx64_reach(buf, insn->off, &lo, &hi, check_at, &bounds);
+                EMIT(buf, 0x0F, 0xB6);                              /* movzx edi, byte [rbx+off] */
+                bfx64_at_rbx(buf, 7, insn->off);
+                EMIT(buf, 0x41, 0xFF, 0x54, 0x24, BFX64_RT_PUT);    /* call [r12+PUT] */
+                break;
+            case WRITE_CONST:
+                if(insn->off == 1){
+                    EMIT(buf, 0xBF);                                /* mov edi, imm32 */
+                    bfx64_imm32(buf, data[arg]);
+                    EMIT(buf, 0x41, 0xFF, 0x54, 0x24, BFX64_RT_PUT);/* call [r12+PUT] */
+                    break;
+                }
+                EMIT(buf, 0x48, 0x8D, 0x3D);                        /* lea rdi, [rip+15] */
+                bfx64_imm32(buf, 15);
+                EMIT(buf, 0xBE);                                    /* mov esi, length */
+                bfx64_imm32(buf, insn->off);
+                EMIT(buf, 0x41, 0xFF, 0x54, 0x24, BFX64_RT_WRITE);  /* call [r12+WRITE] */
+                EMIT(buf, 0xE9);                                    /* jmp past the text */
+                bfx64_imm32(buf, insn->off);
+                bfx64_emit(buf, data + arg, insn->off);
+                break;
+            case GET:
+                bfx64_reach(buf, insn->off, &lo, &hi, check_at, &bounds);
+                EMIT(buf, 0x41, 0xFF, 0x54, 0x24, BFX64_RT_GET);    /* call [r12+GET] */
+                EMIT(buf, 0x88);                                    /* mov [rbx+off], al */
+                bfx64_at_rbx(buf, 0, insn->off);
+                break;
+            case JZ:
+            case JNZ:
+                if(arg < (int64_t)start || arg > (int64_t)end){
+                    CriticalError("Branch out of compiled range");
+                }
+                EMIT(buf, 0x80, 0x3B, 0x00);                        /* cmp byte [rbx], 0 */
+                EMIT(buf, 0x0F, insn->opcode == JZ ? 0x84 : 0x85);  /* je/jne rel32 */
+                branch_at[branches] = buf->length;
+                branch_to[branches++] = arg - start;
+                bfx64_imm32(buf, 0);
+                lo = hi = 0;
+                break;
+            case BFVM_HALT:
+                if(i + 1 < end){
+                    EMIT(buf, 0xE9);                                /* jmp epilogue */
+                    branch_at[branches] = buf->length;
+                    branch_to[branches++] = count;
+                    bfx64_imm32(buf, 0);
+                }
+                break;
+            default:
+                CriticalError("Unknown opcode in lowered code");
+        }
+    }
+
+    /* mov rax, rbx; pop r14; pop r13; pop r12; pop rbp; pop rbx; ret */
+    offs[count] = buf->length;
+    EMIT(buf, 0x48, 0x89, 0xD8);
+    EMIT(buf, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3);
+
+    /* Bounds stub, reached by a near call from the body:
+     * sub rsp, 8; mov rdi, r12; mov rsi, rbx; call [r12+BOUNDS]
+     * mov rbx, rax; reload r13/r14; add rsp, 8; ret */
+    size_t stub = buf->length;
+    EMIT(buf, 0x48, 0x83, 0xEC, 0x08);
+    EMIT(buf, 0x4C, 0x89, 0xE7, 0x48, 0x89, 0xDE);
+    EMIT(buf, 0x41, 0xFF, 0x54, 0x24, BFX64_RT_BOUNDS);
+    EMIT(buf, 0x48, 0x89, 0xC3);
+    EMIT(buf, 0x4D, 0x8B, 0x6C, 0x24, BFX64_RT_BASE);
+    EMIT(buf, 0x4D, 0x8B, 0x74, 0x24, BFX64_RT_END);
+    EMIT(buf, 0x48, 0x83, 0xC4, 0x08, 0xC3);
+
+    for(size_t i = 0; i < branches; i++){
+        bfx64_patch32(buf, branch_at[i], offs[branch_to[i]] - (branch_at[i] + 4));
+    }
+    for(size_t i = 0; i < bounds; i++){
+        bfx64_patch32(buf, bounds_at[i], stub - (bounds_at[i] + 4));
+    }
+
+    free(offs);
+    free(branch_at);
+    free(branch_to);
+    free(bounds_at);
+    free(joins);
+    return entry;
+}
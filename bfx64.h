@@ -0,0 +1,60 @@
+/* Ken Sheedlo
+ * Brainfuck Interpreter
+ * x86-64 machine code emitter */
+
+#ifndef BFX64_H
+#define BFX64_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include "error_handling.h"
+#include "bfvm.h"
+
+/* Generated code is a SysV function
+ *
+ *     uint8_t *fn(uint8_t *mem, void *rt);
+ *
+ * that returns the final data pointer. While it runs the data pointer lives
+ * in rbx, the runtime table in r12, and the current tape bounds in r13/r14.
+ * The runtime table is laid out as below; bfjit and the ELF writer each
+ * provide their own. */
+#define BFX64_RT_BASE 0     /* uint8_t *: first tape cell */
+#define BFX64_RT_END 8      /* uint8_t *: one past the last tape cell */
+#define BFX64_RT_BOUNDS 16  /* uint8_t *(*)(void *rt, uint8_t *mem) */
+#define BFX64_RT_PUT 24     /* void (*)(int c) */
+#define BFX64_RT_GET 32     /* int (*)(void) */
+#define BFX64_RT_WRITE 40   /* void (*)(const uint8_t *text, size_t length) */
+
+/* Appends literal bytes: BFX64_EMIT(buf, 0x48, 0x89, 0xD8); */
+#define BFX64_EMIT(buf, ...) do{ \
+        const uint8_t _b[] = {__VA_ARGS__}; \
+        bfx64_emit(buf, _b, sizeof(_b)); \
+    }while(0)
+
+typedef struct {
+    uint8_t *buf;
+    size_t length;
+    size_t capacity;
+} bfx64_buf_t;
+
+void bfx64_init(bfx64_buf_t *buf);
+
+void bfx64_free(bfx64_buf_t *buf);
+
+void bfx64_emit(bfx64_buf_t *buf, const uint8_t *bytes, size_t count);
+
+void bfx64_byte(bfx64_buf_t *buf, uint8_t byte);
+
+void bfx64_imm32(bfx64_buf_t *buf, int32_t imm);
+
+void bfx64_patch32(bfx64_buf_t *buf, size_t at, int32_t value);
+
+int32_t bfx64_scan_mask(int32_t stride);
+
+size_t bfx64_compile(bfx64_buf_t *buf, const bfvm_insn_t *insns, const uint8_t *data,
+        size_t start, size_t end, int32_t checked);
+
+#endif
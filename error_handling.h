@@ -1,8 +1,12 @@
 /* Ken Sheedlo
  * Error handling routines */
 
+#ifndef ERROR_HANDLING_H
+#define ERROR_HANDLING_H
+
 #include<stdio.h>
 #include<stdlib.h>
 
 void CriticalError(char *str);
 
+#endif
@@ -10,6 +10,7 @@ void list_init(list_t *list){
         CriticalError("Failed to allocate memory");
     }
     new_node->data = NULL;
+    new_node->list = list;
     new_node->next = new_node;
     new_node->prev = new_node;
 
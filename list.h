@@ -1,6 +1,9 @@
 /* Ken Sheedlo
  * Simple circularly linked list implementation */
 
+#ifndef LIST_H
+#define LIST_H
+
 #include "error_handling.h"
 
 struct _ll_t;   /*Forward declaration*/
@@ -42,3 +45,4 @@ void list_filter(list_t *rop, list_t *op, int32_t (*filt)(const void *));
 
 void list_zip(list_t *rop, list_t *op1, list_t *op2);
 
+#endif
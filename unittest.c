@@ -150,12 +150,289 @@ int32_t test_list_match(){
     return !st;
 }
 
+int32_t assert_bfir_contents(bfir_t *ir, int32_t *ops, int32_t *args, int32_t len){
+    if(ir->length != len){
+        fprintf(stderr, "Wrong IR length, expected %d, actual is %zu\n",
+                len, ir->length);
+        bfir_print(stderr, ir);
+        return 0;
+    }
+    for(int i = 0; i < len; i++){
+        if(ir->ops[i].opcode != ops[i] || ir->ops[i].arg != args[i]){
+            fprintf(stderr, "Error: IR not equal at op %d\n", i);
+            bfir_print(stderr, ir);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int32_t test_bfir_combine_arith(){
+    /*Runs merge, cancelled pairs let their neighbours merge */
+    char program[] = {'+', '+', '>', '<', '+', '>', '>', '>', '<', '-', '-', EOF};
+    bfir_t ir;
+    bfir_init(&ir);
+
+    bfcc_parse(program, &ir);
+    bfopt_combine_arith(&ir);
+
+    int32_t ox[] = {ADDV, INCV, SUBV};
+    int32_t ax[] = {3, 2, 2};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 3);
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfir_make_zeros(){
+    char program[] = {'[', '-', ']', '>', '[', '[', '-', ']', ']', EOF};
+    bfir_t ir;
+    bfir_init(&ir);
+
+    bfcc_parse(program, &ir);
+    bfopt_combine_arith(&ir);
+    bfopt_make_zeros(&ir);
+
+    int32_t ox[] = {ZERO, INC, JZ, LABEL, ZERO, JNZ, LABEL};
+    int32_t ax[] = {0, 0, 3, 2, 0, 2, 3};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 7);
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfir_make_muls(){
+    /*Copy/multiply loops become MULs, anything unbalanced is left alone */
+    char program[] = {'[', '-', '>', '+', '>', '+', '+', '+', '<', '<', ']',
+                        '[', '>', '+', '<', ']', EOF};
+    bfir_t ir;
+    bfir_init(&ir);
+
+    bfcc_parse(program, &ir);
+    bfopt_combine_arith(&ir);
+    bfopt_make_muls(&ir);
+
+    int32_t ox[] = {MUL, MUL, ZERO, JZ, LABEL, INC, ADD, DEC, JNZ, LABEL};
+    int32_t ax[] = {1, 3, 0, 3, 2, 0, 0, 0, 2, 3};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 10);
+    if(st && (ir.ops[0].off != 1 || ir.ops[1].off != 2)){
+        fprintf(stderr, "Error: wrong MUL offsets\n");
+        bfir_print(stderr, &ir);
+        st = 0;
+    }
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfir_defer_moves(){
+    /*Moves fold into offsets and are settled before the loop */
+    char program[] = {'>', '+', '>', '+', '+', '<', '.', '[', '-', ']', EOF};
+    bfir_t ir;
+    bfir_init(&ir);
+
+    bfcc_parse(program, &ir);
+    bfopt_combine_arith(&ir);
+    bfopt_defer_moves(&ir);
+
+    int32_t ox[] = {ADD, ADDV, PUT, INC, JZ, LABEL, SUB, JNZ, LABEL};
+    int32_t ax[] = {0, 2, 0, 0, 1, 0, 0, 0, 1};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 9);
+    if(st && (ir.ops[0].off != 1 || ir.ops[1].off != 2 || ir.ops[2].off != 1)){
+        fprintf(stderr, "Error: wrong deferred offsets\n");
+        bfir_print(stderr, &ir);
+        st = 0;
+    }
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfir_make_scans(){
+    /*Single-move loops become SCANs, anything else in the body stops it */
+    char program[] = {'[', '>', ']', '[', '<', '<', '<', '<', ']',
+                        '[', '>', '+', ']', EOF};
+    bfir_t ir;
+    bfir_init(&ir);
+
+    bfcc_parse(program, &ir);
+    bfopt_combine_arith(&ir);
+    bfopt_make_scans(&ir);
+
+    int32_t ox[] = {SCAN, SCAN, JZ, LABEL, INC, ADD, JNZ, LABEL};
+    int32_t ax[] = {1, -4, 5, 4, 0, 0, 4, 5};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 8);
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfeval_prefix(){
+    /*Everything before the first GET runs at compile time and comes back as
+     * straight-line code */
+    char program[] = {'+', '+', '.', '>', '+', ',', '.', EOF};
+    bfir_t ir;
+    bfeval_t ev;
+    bfir_init(&ir);
+
+    bfcc_parse(program, &ir);
+    bfopt_combine_arith(&ir);
+    bfopt_defer_moves(&ir);
+    bfeval_prefix(&ir, &ev, BFEVAL_STEPS);
+
+    int32_t st = ev.resume == 3 && ev.ptr == 0 && ev.cells == 2
+        && ev.out_length == 1 && ev.out[0] == 2;
+    if(!st){
+        fprintf(stderr, "Error: wrong prefix state\n");
+    }
+
+    bfeval_resume(&ir, &ev, 0);
+    int32_t ox[] = {ADDV, PUT, ZERO, ADDV, ADD, GET, PUT, INC};
+    int32_t ax[] = {2, 0, 0, 2, 0, 0, 0, 0};
+    st = st && assert_bfir_contents(&ir, ox, ax, 8);
+    bfeval_free(&ev);
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfopt_fold_output(){
+    /*PUTs of cells set after the input merge into one write; the input
+     * itself still goes out through PUT */
+    char program[] = {',', '>', '[', '-', ']', '+', '+', '.', '+', '.', '<', '.', EOF};
+    bfir_t ir;
+    bfir_init(&ir);
+
+    bfcc_parse(program, &ir);
+    bfopt_combine_arith(&ir);
+    bfopt_make_zeros(&ir);
+    bfopt_defer_moves(&ir);
+    bfopt_fold_output(&ir, NULL, 0);
+
+    int32_t ox[] = {GET, ZERO, ADDV, WRITE_CONST, ADD, PUT};
+    int32_t ax[] = {0, 0, 2, 0, 0, 0};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 6);
+    if(st && (ir.ops[3].off != 2 || ir.data_length != 2 || ir.data[0] != 2
+            || ir.data[1] != 3)){
+        fprintf(stderr, "Error: wrong constant write\n");
+        bfir_print(stderr, &ir);
+        st = 0;
+    }
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfopt_filters(){
+    /*One pass applies both filters, including where the first one's
+     * rewrite lets the second match across it */
+    bfir_t ir, pattern, replace;
+    bfopt_filters_t filters;
+    bfir_init(&ir);
+    bfir_init(&pattern);
+    bfir_init(&replace);
+    bfopt_filters_init(&filters);
+
+    bfir_push(&pattern, PUT, 0);
+    bfir_push(&pattern, GET, 0);
+    bfir_push(&replace, ZERO, 0);
+    bfopt_filters_add(&filters, &pattern, &replace);
+    pattern.length = 0;
+    bfir_push(&pattern, INC, 0);
+    bfir_push(&pattern, ZERO, 0);
+    bfir_push(&pattern, DEC, 0);
+    bfopt_filters_add(&filters, &pattern, &replace);
+
+    int32_t prog[] = {INC, PUT, GET, DEC, PUT, GET, PUT};
+    for(int i = 0; i < 7; i++){
+        bfir_push(&ir, prog[i], 0);
+    }
+    bfopt_apply_filters(&ir, &filters);
+
+    int32_t ox[] = {ZERO, ZERO, PUT};
+    int32_t ax[] = {0, 0, 0};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 3);
+    bfopt_filters_free(&filters);
+    bfir_free(&pattern);
+    bfir_free(&replace);
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfopt_filter_vars(){
+    /*Variables bind across ops, including offsets, and the guard keeps
+     * arithmetic that doesn't cancel */
+    const char text[] =
+        "pattern\n"
+        "addv $a @$k\n"
+        "addv $b @$k\n"
+        "where\n"
+        "$a == -$b\n"
+        "replace\n";
+    bfir_t ir;
+    bfopt_filters_t filters;
+    bfir_init(&ir);
+    bfopt_filters_init(&filters);
+    FILE *input = fmemopen((void *)text, strlen(text), "r");
+    bfopt_filters_parse(&filters, input, "test");
+    fclose(input);
+
+    bfir_push(&ir, ADDV, 3)->off = 2;
+    bfir_push(&ir, SUBV, 3)->off = 2;
+    bfir_push(&ir, PUT, 0);
+    bfir_push(&ir, ADDV, 3)->off = 1;
+    bfir_push(&ir, SUBV, 3)->off = 2;
+    bfir_push(&ir, ADDV, 3)->off = 1;
+    bfir_push(&ir, SUBV, 2)->off = 1;
+    bfopt_apply_filters(&ir, &filters);
+
+    int32_t ox[] = {PUT, ADDV, SUBV, ADDV, SUBV};
+    int32_t ax[] = {0, 3, 3, 3, 2};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 5);
+    bfopt_filters_free(&filters);
+    bfir_free(&ir);
+    return st;
+}
+
+int32_t test_bfopt_pipeline(){
+    /*Arithmetic the filter brings together is merged on the next round,
+     * and -O1 leaves loops alone */
+    char program[] = {'+', '.', ',', '+', '[', '-', '>', '+', '<', ']', EOF};
+    bfir_t ir, pattern, replace;
+    bfopt_filters_t filters;
+    bfopt_pipeline_t pipeline;
+    bfir_init(&ir);
+    bfir_init(&pattern);
+    bfir_init(&replace);
+    bfopt_filters_init(&filters);
+
+    bfir_push(&pattern, PUT, 0);
+    bfir_push(&pattern, GET, 0);
+    bfopt_filters_add(&filters, &pattern, &replace);
+    bfopt_pipeline_init(&pipeline, 1, &filters);
+
+    bfcc_parse(program, &ir);
+    bfopt_pipeline_run(&pipeline, &ir);
+
+    int32_t ox[] = {ADDV, JZ, LABEL, SUB, INC, ADD, DEC, JNZ, LABEL};
+    int32_t ax[] = {2, 1, 0, 0, 0, 0, 0, 0, 1};
+    int32_t st = assert_bfir_contents(&ir, ox, ax, 9);
+    bfopt_filters_free(&filters);
+    bfir_free(&pattern);
+    bfir_free(&replace);
+    bfir_free(&ir);
+    return st;
+}
+
 int main(int argc, char **argv){
     int32_t (*TESTS[])() = {
         test_list_addfirst,
         test_list_addlast,
         test_list_remove,
-        test_list_match
+        test_list_match,
+        test_bfir_combine_arith,
+        test_bfir_make_zeros,
+        test_bfir_make_muls,
+        test_bfir_defer_moves,
+        test_bfir_make_scans,
+        test_bfeval_prefix,
+        test_bfopt_fold_output,
+        test_bfopt_filters,
+        test_bfopt_filter_vars,
+        test_bfopt_pipeline
     };
 
     const int32_t TEST_LENGTH = sizeof(TESTS) / sizeof(TESTS[0]);
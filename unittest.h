@@ -1,6 +1,9 @@
 /*Ken Sheedlo's brainfuck compiler
  * Unit test program. */
 
+#ifndef UNITTEST_H
+#define UNITTEST_H
+
 #include<assert.h>
 #include<stdio.h>
 #include<stdlib.h>
@@ -22,3 +25,26 @@ int32_t test_list_remove();
 
 int32_t test_list_match();
 
+int32_t assert_bfir_contents(bfir_t *ir, int32_t *ops, int32_t *args, int32_t len);
+
+int32_t test_bfir_combine_arith();
+
+int32_t test_bfir_make_zeros();
+
+int32_t test_bfir_make_muls();
+
+int32_t test_bfir_defer_moves();
+
+int32_t test_bfir_make_scans();
+
+int32_t test_bfeval_prefix();
+
+int32_t test_bfopt_fold_output();
+
+int32_t test_bfopt_filters();
+
+int32_t test_bfopt_filter_vars();
+
+int32_t test_bfopt_pipeline();
+
+#endif